@@ -0,0 +1,304 @@
+/*
+ * fwctl.c: asynchronous control of firewire sound devices via hwdep
+ *
+ * Commands are queued, then written by one write() for many of them. The
+ * responses are read by one read() for many of them, and matched to the
+ * commands by seqnum. Fireworks devices take EFW commands and BeBoB/OXFW based
+ * devices take AV/C commands.
+ *
+ * Licensed under the terms of the GNU General Public License, version 2.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include "./include/uapi/sound/firewire.h"
+#include "fwctl.h"
+
+#define QUEUE_SIZE	8192
+#define READ_SIZE	16384
+#define PENDINGS	256
+
+/* the driver uses larger seqnums for its own commands */
+#define EFW_SEQNUM_LIMIT	0x10000
+#define EFW_VERSION		1
+
+struct pending {
+	bool used;
+	uint32_t seqnum;
+	fwctl_callback_t callback;
+	void *private_data;
+};
+
+struct fwctl {
+	int fd;
+	unsigned int type;
+	uint32_t seqnum;
+
+	uint8_t queue[QUEUE_SIZE];
+	unsigned int queued;
+
+	struct pending pendings[PENDINGS];
+
+	uint8_t buf[READ_SIZE];
+};
+
+struct fwctl *fwctl_open(const char *path)
+{
+	struct snd_firewire_get_info info;
+	struct fwctl *ctl;
+	int err;
+
+	ctl = calloc(1, sizeof(struct fwctl));
+	if (ctl == NULL)
+		return NULL;
+
+	ctl->fd = open(path, O_RDWR);
+	if (ctl->fd < 0)
+		goto err_free;
+
+	if (ioctl(ctl->fd, SNDRV_FIREWIRE_IOCTL_GET_INFO, &info) < 0)
+		goto err_close;
+	ctl->type = info.type;
+
+	return ctl;
+err_close:
+	err = errno;
+	close(ctl->fd);
+	errno = err;
+err_free:
+	free(ctl);
+	return NULL;
+}
+
+void fwctl_close(struct fwctl *ctl)
+{
+	close(ctl->fd);
+	free(ctl);
+}
+
+int fwctl_get_fd(struct fwctl *ctl)
+{
+	return ctl->fd;
+}
+
+unsigned int fwctl_get_type(struct fwctl *ctl)
+{
+	return ctl->type;
+}
+
+static struct pending *add_pending(struct fwctl *ctl, uint32_t seqnum,
+				   fwctl_callback_t callback,
+				   void *private_data)
+{
+	unsigned int i;
+
+	for (i = 0; i < PENDINGS; i++) {
+		if (ctl->pendings[i].used)
+			continue;
+		ctl->pendings[i].used = true;
+		ctl->pendings[i].seqnum = seqnum;
+		ctl->pendings[i].callback = callback;
+		ctl->pendings[i].private_data = private_data;
+		return &ctl->pendings[i];
+	}
+
+	return NULL;
+}
+
+/* the slot is released before calling back, thus the callback can queue */
+static void complete_pending(struct fwctl *ctl, uint32_t seqnum, int status,
+			     const void *resp, unsigned int length)
+{
+	struct pending *p;
+	unsigned int i;
+
+	for (i = 0; i < PENDINGS; i++) {
+		p = &ctl->pendings[i];
+		if (!p->used || p->seqnum != seqnum)
+			continue;
+		p->used = false;
+		if (p->callback != NULL)
+			p->callback(ctl, status, resp, length, p->private_data);
+		return;
+	}
+}
+
+int fwctl_queue_efw(struct fwctl *ctl, uint32_t category, uint32_t command,
+		    const uint32_t *params, unsigned int count,
+		    fwctl_callback_t callback, void *private_data)
+{
+	struct snd_efw_transaction *t;
+	unsigned int i, size;
+
+	if (ctl->type != SNDRV_FIREWIRE_TYPE_FIREWORKS)
+		return -ENOTSUP;
+
+	size = sizeof(struct snd_efw_transaction) + count * sizeof(uint32_t);
+	if (ctl->queued + size > QUEUE_SIZE)
+		return -ENOSPC;
+
+	/* the device responds with the next seqnum */
+	if (add_pending(ctl, ctl->seqnum + 1, callback, private_data) == NULL)
+		return -EBUSY;
+
+	t = (struct snd_efw_transaction *)(ctl->queue + ctl->queued);
+	t->length	= htobe32(size / sizeof(uint32_t));
+	t->version	= htobe32(EFW_VERSION);
+	t->seqnum	= htobe32(ctl->seqnum);
+	t->category	= htobe32(category);
+	t->command	= htobe32(command);
+	t->status	= 0;
+	for (i = 0; i < count; i++)
+		t->params[i] = htobe32(params[i]);
+
+	ctl->queued += size;
+	ctl->seqnum += 2;
+	if (ctl->seqnum + 2 > EFW_SEQNUM_LIMIT)
+		ctl->seqnum = 0;
+
+	return 0;
+}
+
+int fwctl_queue_avc(struct fwctl *ctl, const uint8_t *frame,
+		    unsigned int length,
+		    fwctl_callback_t callback, void *private_data)
+{
+	struct snd_firewire_avc_frame *f;
+	unsigned int size;
+
+	if (ctl->type != SNDRV_FIREWIRE_TYPE_BEBOB &&
+	    ctl->type != SNDRV_FIREWIRE_TYPE_OXFW)
+		return -ENOTSUP;
+
+	if (length == 0 || length > SND_FIREWIRE_AVC_FRAME_MAX)
+		return -EINVAL;
+
+	size = sizeof(struct snd_firewire_avc_frame) + ((length + 3) & ~3);
+	if (ctl->queued + size > QUEUE_SIZE)
+		return -ENOSPC;
+
+	if (add_pending(ctl, ctl->seqnum, callback, private_data) == NULL)
+		return -EBUSY;
+
+	f = (struct snd_firewire_avc_frame *)(ctl->queue + ctl->queued);
+	memset(f, 0, size);
+	f->seqnum = ctl->seqnum++;
+	f->length = length;
+	memcpy(f->frame, frame, length);
+
+	ctl->queued += size;
+
+	return 0;
+}
+
+/*
+ * Returns -EAGAIN when the driver has no space for more responses. The rest
+ * of commands are kept, then call this again after fwctl_dispatch().
+ */
+int fwctl_flush(struct fwctl *ctl)
+{
+	unsigned int pos = 0;
+	ssize_t len;
+	int err = 0;
+
+	while (pos < ctl->queued) {
+		len = write(ctl->fd, ctl->queue + pos, ctl->queued - pos);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		pos += len;
+	}
+
+	memmove(ctl->queue, ctl->queue + pos, ctl->queued - pos);
+	ctl->queued -= pos;
+
+	return err;
+}
+
+static int dispatch_efw(struct fwctl *ctl, const uint8_t *buf,
+			unsigned int size)
+{
+	struct snd_efw_transaction *t;
+	unsigned int i, length, count = 0;
+	uint32_t *params;
+
+	while (size >= sizeof(struct snd_efw_transaction)) {
+		t = (struct snd_efw_transaction *)buf;
+		length = be32toh(t->length) * sizeof(uint32_t);
+		if (length < sizeof(struct snd_efw_transaction) ||
+		    length > size)
+			break;
+
+		params = t->params;
+		length -= sizeof(struct snd_efw_transaction);
+		for (i = 0; i < length / sizeof(uint32_t); i++)
+			params[i] = be32toh(params[i]);
+
+		complete_pending(ctl, be32toh(t->seqnum), be32toh(t->status),
+				 params, length);
+		count++;
+
+		length += sizeof(struct snd_efw_transaction);
+		buf += length;
+		size -= length;
+	}
+
+	return count;
+}
+
+static int dispatch_avc(struct fwctl *ctl, const uint8_t *buf,
+			unsigned int size)
+{
+	const struct snd_firewire_avc_frame *f;
+	unsigned int length, count = 0;
+
+	while (size >= sizeof(struct snd_firewire_avc_frame)) {
+		f = (const struct snd_firewire_avc_frame *)buf;
+		length = sizeof(struct snd_firewire_avc_frame) +
+			 ((f->length + 3) & ~3);
+		if (length > size)
+			break;
+
+		complete_pending(ctl, f->seqnum, f->error, f->frame, f->length);
+		count++;
+
+		buf += length;
+		size -= length;
+	}
+
+	return count;
+}
+
+/* returns the number of responses, or a negative errno */
+int fwctl_dispatch(struct fwctl *ctl)
+{
+	struct snd_firewire_event_common *event;
+	ssize_t len;
+
+	len = read(ctl->fd, ctl->buf, READ_SIZE);
+	if (len < 0)
+		return -errno;
+	if (len < sizeof(struct snd_firewire_event_common))
+		return 0;
+
+	event = (struct snd_firewire_event_common *)ctl->buf;
+	len -= sizeof(struct snd_firewire_event_common);
+
+	if (event->type == SNDRV_FIREWIRE_EVENT_EFW_RESPONSE)
+		return dispatch_efw(ctl, ctl->buf + sizeof(*event), len);
+	else if (event->type == SNDRV_FIREWIRE_EVENT_AVC_RESPONSE)
+		return dispatch_avc(ctl, ctl->buf + sizeof(*event), len);
+
+	/* the other events are not for this library */
+	return 0;
+}
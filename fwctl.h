@@ -0,0 +1,46 @@
+/*
+ * fwctl.h: asynchronous control of firewire sound devices via hwdep
+ *
+ * Licensed under the terms of the GNU General Public License, version 2.
+ */
+
+#ifndef FWCTL_H_INCLUDED
+#define FWCTL_H_INCLUDED
+
+#include <stdint.h>
+
+struct fwctl;
+
+/*
+ * Called for each response, from fwctl_dispatch().
+ *
+ * status is a negative errno when the command failed in transport. Else it is
+ * the status field of the response for EFW, or zero for AV/C. For EFW, resp
+ * points to the parameters in host byte order and length is in bytes. For
+ * AV/C, resp points to the whole response frame.
+ */
+typedef void (*fwctl_callback_t)(struct fwctl *ctl, int status,
+				 const void *resp, unsigned int length,
+				 void *private_data);
+
+struct fwctl *fwctl_open(const char *path);
+void fwctl_close(struct fwctl *ctl);
+
+int fwctl_get_fd(struct fwctl *ctl);
+unsigned int fwctl_get_type(struct fwctl *ctl);
+
+/* queue a command, sent by the next fwctl_flush() */
+int fwctl_queue_efw(struct fwctl *ctl, uint32_t category, uint32_t command,
+		    const uint32_t *params, unsigned int count,
+		    fwctl_callback_t callback, void *private_data);
+int fwctl_queue_avc(struct fwctl *ctl, const uint8_t *frame,
+		    unsigned int length,
+		    fwctl_callback_t callback, void *private_data);
+
+/* write all of queued commands in as few calls as possible */
+int fwctl_flush(struct fwctl *ctl);
+
+/* read once, and call back for each response in it */
+int fwctl_dispatch(struct fwctl *ctl);
+
+#endif
@@ -8,6 +8,7 @@
 #define SNDRV_FIREWIRE_EVENT_LOCK_STATUS	0x000010cc
 #define SNDRV_FIREWIRE_EVENT_DICE_NOTIFICATION	0xd1ce004e
 #define SNDRV_FIREWIRE_EVENT_EFW_RESPONSE	0x4e617475
+#define SNDRV_FIREWIRE_EVENT_AVC_RESPONSE	0x41564352
 
 struct snd_firewire_event_common {
 	unsigned int type; /* SNDRV_FIREWIRE_EVENT_xxx */
@@ -39,17 +40,42 @@ struct snd_firewire_event_efw_response {
 	uint32_t response[0];	/* some responses */
 };
 
+/*
+ * AV/C commands can be written to the hwdep device of BeBoB and OXFW based
+ * devices, as concatenated frames. They are executed in order, and responses
+ * are read as SNDRV_FIREWIRE_EVENT_AVC_RESPONSE with the same seqnum.
+ */
+#define SND_FIREWIRE_AVC_FRAME_MAX	512
+struct snd_firewire_avc_frame {
+	unsigned int seqnum;	/* any value, copied to the response */
+	int error;		/* negative errno in a failed response */
+	unsigned int length;	/* of frame, up to SND_FIREWIRE_AVC_FRAME_MAX */
+	unsigned char frame[0];	/* padded to a multiple of four bytes */
+};
+struct snd_firewire_event_avc_response {
+	unsigned int type;
+	unsigned char response[0];	/* some snd_firewire_avc_frame */
+};
+
 union snd_firewire_event {
 	struct snd_firewire_event_common            common;
 	struct snd_firewire_event_lock_status       lock_status;
 	struct snd_firewire_event_dice_notification dice_notification;
 	struct snd_firewire_event_efw_response      efw_response;
+	struct snd_firewire_event_avc_response      avc_response;
 };
 
 
+#define SNDRV_FIREWIRE_IOCTL_SET_OFFLOAD _IOW('H', 0xf6, struct snd_firewire_offload)
+#define SNDRV_FIREWIRE_IOCTL_SET_MIDI_CLOCK _IOW('H', 0xf7, struct snd_firewire_midi_clock)
 #define SNDRV_FIREWIRE_IOCTL_GET_INFO _IOR('H', 0xf8, struct snd_firewire_get_info)
 #define SNDRV_FIREWIRE_IOCTL_LOCK      _IO('H', 0xf9)
 #define SNDRV_FIREWIRE_IOCTL_UNLOCK    _IO('H', 0xfa)
+#define SNDRV_FIREWIRE_IOCTL_SET_MONITOR _IOW('H', 0xfb, struct snd_firewire_monitor)
+#define SNDRV_FIREWIRE_IOCTL_SET_MIDI_THRU _IOW('H', 0xfc, struct snd_firewire_midi_thru)
+#define SNDRV_FIREWIRE_IOCTL_GET_CYCLE_CLOCK _IOR('H', 0xfd, struct snd_firewire_cycle_clock)
+#define SNDRV_FIREWIRE_IOCTL_SCHEDULE_START _IOW('H', 0xfe, struct snd_firewire_schedule_start)
+#define SNDRV_FIREWIRE_IOCTL_GET_LINK_OFFSET _IOR('H', 0xff, struct snd_firewire_link_offset)
 
 #define SNDRV_FIREWIRE_TYPE_DICE	1
 #define SNDRV_FIREWIRE_TYPE_FIREWORKS	2
@@ -69,4 +95,102 @@ struct snd_firewire_get_info {
  * Returns -EBUSY if the driver is already streaming.
  */
 
+/*
+ * SNDRV_FIREWIRE_IOCTL_SET_MONITOR replaces routes from capture channels to
+ * playback channels, mixed in kernel within the same isochronous cycle. Gain is
+ * 16.16 fixed point, up to 0x100000. This works while playback packets are
+ * generated from capture packets, i.e. in blocking mode synchronized to the
+ * device. Zero count disables monitoring.
+ */
+#define SNDRV_FIREWIRE_MONITOR_ROUTES	64
+struct snd_firewire_monitor_route {
+	unsigned int src;	/* capture PCM channel */
+	unsigned int dst;	/* playback PCM channel */
+	unsigned int gain;
+};
+struct snd_firewire_monitor {
+	unsigned int count;
+	struct snd_firewire_monitor_route routes[SNDRV_FIREWIRE_MONITOR_ROUTES];
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_SET_MIDI_THRU forwards MIDI bytes received on a port
+ * to a port of another device, or of the same device, without userspace.
+ * Both devices should be streaming, and the route is disconnected when either
+ * of them stops. An empty device_name disconnects the port.
+ */
+struct snd_firewire_midi_thru {
+	unsigned int port;
+	char device_name[16]; /* same as snd_firewire_get_info.device_name */
+	unsigned int dst_port;
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_GET_CYCLE_CLOCK returns a linear model between bus
+ * cycle time and CLOCK_MONOTONIC, estimated while any stream runs on the same
+ * FireWire card. Returns -ENODATA if no stream has run yet.
+ */
+struct snd_firewire_cycle_clock {
+	unsigned long long monotonic;	/* in nanoseconds */
+	unsigned int cycle_time;	/* at 'monotonic', only the lowest three
+					   bits of the second field are valid */
+	unsigned int period;		/* of a cycle, in picoseconds */
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_SCHEDULE_START arms the next start of PCM playback.
+ * After prepared and triggered, the first frame is transmitted in the packet
+ * at the cycle. Call this after preparing, while packets are transmitted.
+ * Returns -EOPNOTSUPP if the stream is offloaded by
+ * SNDRV_FIREWIRE_IOCTL_SET_OFFLOAD.
+ */
+struct snd_firewire_schedule_start {
+	unsigned int cycle_time;	/* only the lowest three bits of the
+					   second field and the cycle field are
+					   used */
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_GET_LINK_OFFSET returns how much the first playback
+ * frame is later than the first capture frame, when capture and playback
+ * substreams linked by snd_pcm_link() were started last time. Returns -ENODATA
+ * if they could not be aligned in the current streaming mode.
+ */
+struct snd_firewire_link_offset {
+	unsigned int ticks;	/* in 24.576 MHz, as SYT */
+	unsigned int frames;
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_SET_MIDI_CLOCK generates MIDI clock and MTC quarter
+ * frames on an outgoing MIDI port, at the sample which they belong to. Start is
+ * sent when the clock is enabled, and Stop when it is disabled. Tempo can be
+ * changed while running. MTC restarts from mtc_start each time. The messages
+ * overtake bytes written to rawmidi, thus the port should not carry the other
+ * messages than System Realtime while MTC runs.
+ */
+#define SNDRV_FIREWIRE_MIDI_CLOCK_TICK	0x01
+#define SNDRV_FIREWIRE_MIDI_CLOCK_MTC	0x02
+struct snd_firewire_midi_clock {
+	unsigned int port;
+	unsigned int flags;		/* SNDRV_FIREWIRE_MIDI_CLOCK_xxx */
+	unsigned int tempo;		/* micro seconds per quarter note */
+	unsigned int ppqn;		/* clocks per quarter note, usually 24 */
+	unsigned int mtc_type;		/* 0/1/2/3 = 24/25/29.97 drop/30 fps */
+	unsigned char mtc_start[4];	/* hours, minutes, seconds, frames */
+};
+
+/*
+ * SNDRV_FIREWIRE_IOCTL_SET_OFFLOAD moves conversion of PCM samples and MIDI
+ * bytes of a stream from the isochronous callback to a worker on the CPU. A
+ * negative cpu follows the offload_cpu option of snd-firewire-lib. Returns
+ * -EBUSY while the stream runs, or -EINVAL if the CPU is not online.
+ */
+#define SNDRV_FIREWIRE_OFFLOAD_CAPTURE	0
+#define SNDRV_FIREWIRE_OFFLOAD_PLAYBACK	1
+struct snd_firewire_offload {
+	unsigned int stream;	/* SNDRV_FIREWIRE_OFFLOAD_xxx */
+	int cpu;
+};
+
 #endif /* _UAPI_SOUND_FIREWIRE_H_INCLUDED */
@@ -9,11 +9,18 @@
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/firewire.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <sound/control.h>
+#include <sound/info.h>
 #include <sound/pcm.h>
 #include <sound/rawmidi.h>
+#include "../../include/uapi/sound/firewire.h"
 #include "amdtp.h"
 
 #define TICKS_PER_CYCLE		3072
@@ -51,6 +58,10 @@
 #define INTERRUPT_INTERVAL	16
 #define QUEUE_LENGTH		48
 #define CALLBACK_TIMEOUT_MS	100
+/* outgoing packets which the controller may have fetched already */
+#define IMMEDIATE_START_MARGIN	8
+/* the worker consumes an entry before the packet buffer is reused */
+#define OFFLOAD_ENTRIES		(QUEUE_LENGTH - INTERRUPT_INTERVAL)
 
 #define IN_PACKET_HEADER_SIZE	4
 #define OUT_PACKET_HEADER_SIZE	0
@@ -62,7 +73,73 @@ struct sort_table {
 	unsigned int payload_size;
 };
 
+static int offload_cpu = -1;
+module_param(offload_cpu, int, 0644);
+MODULE_PARM_DESC(offload_cpu, "CPU to process PCM/MIDI data of AMDTP streams, "
+		 "or -1 to process it in isochronous callback (default)");
+
+static bool software_meter;
+module_param(software_meter, bool, 0644);
+MODULE_PARM_DESC(software_meter, "measure peak/RMS of PCM samples in "
+		 "transferring them (default: false)");
+
+static bool local_pcm_buffer = true;
+module_param(local_pcm_buffer, bool, 0644);
+MODULE_PARM_DESC(local_pcm_buffer, "allocate PCM buffers on the NUMA node of "
+		 "the FireWire controller (default: true)");
+
+static unsigned int stall_cycles = 4000;
+module_param(stall_cycles, uint, 0644);
+MODULE_PARM_DESC(stall_cycles, "cycles without callbacks or incoming data "
+		 "to regard a stream as stalled, or 0 to disable "
+		 "(default: 4000)");
+
+static bool stall_restart = true;
+module_param(stall_restart, bool, 0644);
+MODULE_PARM_DESC(stall_restart, "restart stalled streams at the next PCM "
+		 "prepare (default: true)");
+
 static void pcm_period_tasklet(unsigned long data);
+static void offload_work(struct work_struct *work);
+static void watchdog_work(struct work_struct *work);
+
+/* running streams, to look up the destination of MIDI thru */
+static LIST_HEAD(thru_streams);
+static DEFINE_MUTEX(thru_mutex);
+
+struct amdtp_monitor {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct amdtp_monitor_route routes[];
+};
+
+struct amdtp_midi_clock {
+	struct rcu_head rcu;
+	u8 transport;		/* Start or Stop sent at first, or zero */
+
+	bool clock;
+	unsigned int tempo;
+	unsigned int ppqn;
+	u64 clock_phase;
+
+	bool mtc;
+	unsigned int mtc_type;
+	u64 mtc_phase;
+	u8 time[4];		/* at the first quarter frame of this piece */
+	unsigned int piece;
+};
+
+/* indexed by the rate bits in MTC */
+static const struct {
+	unsigned int fps;
+	unsigned int num;
+	unsigned int den;
+} mtc_rates[4] = {
+	{ 24,    24,    1 },
+	{ 25,    25,    1 },
+	{ 30, 30000, 1001 },	/* drop frame */
+	{ 30,    30,    1 },
+};
 
 /**
  * amdtp_stream_init - initialize an AMDTP stream structure
@@ -89,8 +166,39 @@ int amdtp_stream_init(struct amdtp_stream *s, struct fw_unit *unit,
 	s->sort_table = NULL;
 	s->left_packets = NULL;
 
+	spin_lock_init(&s->lock);
+	s->packet_blocks = NULL;
+	s->monitor_mix = NULL;
+	s->midi_lanes = NULL;
+
+	s->scheduled.armed = false;
+	s->scheduled.pcm = NULL;
+	s->scheduled.missed = 0;
+
+	s->linked_pcm = NULL;
+	s->link_aligned = false;
+
+	seqcount_init(&s->meter.seq);
+
+	RCU_INIT_POINTER(s->monitor, NULL);
+
+	memset(s->midi_clock, 0, sizeof(s->midi_clock));
+	memset(s->midi_thru, 0, sizeof(s->midi_thru));
+	memset(&s->thru_fifo, 0, sizeof(s->thru_fifo));
+	spin_lock_init(&s->thru_fifo.lock);
+	INIT_LIST_HEAD(&s->thru_list);
+
 	s->blocks_for_midi = UINT_MAX;
 
+	s->offload.cpu = -1;
+	s->offload.target = -1;
+	s->offload.ring = NULL;
+	s->offload.copies = NULL;
+	INIT_WORK(&s->offload.work, offload_work);
+
+	INIT_DELAYED_WORK(&s->watchdog.work, watchdog_work);
+	s->watchdog.stalls = 0;
+
 	return 0;
 }
 EXPORT_SYMBOL(amdtp_stream_init);
@@ -101,7 +209,12 @@ EXPORT_SYMBOL(amdtp_stream_init);
  */
 void amdtp_stream_destroy(struct amdtp_stream *s)
 {
+	unsigned int i;
+
 	WARN_ON(amdtp_stream_running(s));
+	kfree(rcu_dereference_protected(s->monitor, true));
+	for (i = 0; i < ARRAY_SIZE(s->midi_clock); i++)
+		kfree(rcu_dereference_protected(s->midi_clock[i], true));
 	mutex_destroy(&s->mutex);
 	fw_unit_put(s->unit);
 }
@@ -219,6 +332,24 @@ static void amdtp_read_s32(struct amdtp_stream *s,
 static void amdtp_read_s32_dualwire(struct amdtp_stream *s,
 				    struct snd_pcm_substream *pcm,
 				    __be32 *buffer, unsigned int frames);
+static void amdtp_write_float(struct amdtp_stream *s,
+			      struct snd_pcm_substream *pcm,
+			      __be32 *buffer, unsigned int frames);
+static void amdtp_write_float_dualwire(struct amdtp_stream *s,
+				       struct snd_pcm_substream *pcm,
+				       __be32 *buffer, unsigned int frames);
+static void amdtp_write_double(struct amdtp_stream *s,
+			       struct snd_pcm_substream *pcm,
+			       __be32 *buffer, unsigned int frames);
+static void amdtp_write_double_dualwire(struct amdtp_stream *s,
+					struct snd_pcm_substream *pcm,
+					__be32 *buffer, unsigned int frames);
+static void amdtp_read_float(struct amdtp_stream *s,
+			     struct snd_pcm_substream *pcm,
+			     __be32 *buffer, unsigned int frames);
+static void amdtp_read_float_dualwire(struct amdtp_stream *s,
+				      struct snd_pcm_substream *pcm,
+				      __be32 *buffer, unsigned int frames);
 
 /**
  * amdtp_stream_set_pcm_format - set the PCM format
@@ -236,6 +367,16 @@ void amdtp_stream_set_pcm_format(struct amdtp_stream *s,
 		return;
 
 	switch (format) {
+	case SNDRV_PCM_FORMAT_FLOAT64:
+		if (s->direction == AMDTP_OUT_STREAM) {
+			if (s->dual_wire)
+				s->transfer_samples =
+						amdtp_write_double_dualwire;
+			else
+				s->transfer_samples = amdtp_write_double;
+			break;
+		}
+		/* fall through */
 	default:
 		WARN_ON(1);
 		/* fall through */
@@ -261,6 +402,19 @@ void amdtp_stream_set_pcm_format(struct amdtp_stream *s,
 			s->transfer_samples = amdtp_read_s32;
 		}
 		break;
+	case SNDRV_PCM_FORMAT_FLOAT:
+		if (s->direction == AMDTP_OUT_STREAM) {
+			if (s->dual_wire)
+				s->transfer_samples =
+						amdtp_write_float_dualwire;
+			else
+				s->transfer_samples = amdtp_write_float;
+		} else if (s->dual_wire) {
+			s->transfer_samples = amdtp_read_float_dualwire;
+		} else {
+			s->transfer_samples = amdtp_read_float;
+		}
+		break;
 	}
 }
 EXPORT_SYMBOL(amdtp_stream_set_pcm_format);
@@ -277,6 +431,14 @@ void amdtp_stream_pcm_prepare(struct amdtp_stream *s)
 	s->pcm_buffer_pointer = 0;
 	s->pcm_period_pointer = 0;
 	s->pointer_flush = true;
+	s->scheduled.armed = false;
+
+	memset(s->meter.peak, 0, sizeof(s->meter.peak));
+	memset(s->meter.squares, 0, sizeof(s->meter.squares));
+	s->meter.frames = 0;
+	write_seqcount_begin(&s->meter.seq);
+	memset(&s->meter.snapshot, 0, sizeof(s->meter.snapshot));
+	write_seqcount_end(&s->meter.seq);
 }
 EXPORT_SYMBOL(amdtp_stream_pcm_prepare);
 
@@ -358,6 +520,18 @@ static unsigned int calculate_syt(struct amdtp_stream *s,
 	}
 }
 
+/* @sample is 24 bit. Squares are summed in 16 bit not to overflow. */
+static inline void meter_sample(struct amdtp_stream *s, unsigned int c,
+				int sample)
+{
+	u32 level = abs(sample);
+
+	if (level > s->meter.peak[c])
+		s->meter.peak[c] = level;
+	level >>= 8;
+	s->meter.squares[c] += level * level;
+}
+
 static void amdtp_write_s32(struct amdtp_stream *s,
 			    struct snd_pcm_substream *pcm,
 			    __be32 *buffer, unsigned int frames)
@@ -365,6 +539,7 @@ static void amdtp_write_s32(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int remaining_frames, i, c;
 	const u32 *src;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	src = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -372,6 +547,8 @@ static void amdtp_write_s32(struct amdtp_stream *s,
 
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < s->pcm_channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s32)*src >> 8);
 			buffer[s->pcm_positions[c]] =
 					cpu_to_be32((*src >> 8) | 0x40000000);
 			src++;
@@ -380,6 +557,9 @@ static void amdtp_write_s32(struct amdtp_stream *s,
 		if (--remaining_frames == 0)
 			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
 static void amdtp_write_s16(struct amdtp_stream *s,
@@ -389,6 +569,7 @@ static void amdtp_write_s16(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int remaining_frames, i, c;
 	const u16 *src;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	src = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -396,6 +577,8 @@ static void amdtp_write_s16(struct amdtp_stream *s,
 
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < s->pcm_channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s16)*src << 8);
 			buffer[s->pcm_positions[c]] =
 					cpu_to_be32((*src << 8) | 0x40000000);
 			src++;
@@ -404,6 +587,9 @@ static void amdtp_write_s16(struct amdtp_stream *s,
 		if (--remaining_frames == 0)
 			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
 static void amdtp_write_s32_dualwire(struct amdtp_stream *s,
@@ -413,6 +599,7 @@ static void amdtp_write_s32_dualwire(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int channels, remaining_frames, i, c;
 	const u32 *src;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	src = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -421,12 +608,16 @@ static void amdtp_write_s32_dualwire(struct amdtp_stream *s,
 
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s32)*src >> 8);
 			buffer[s->pcm_positions[c] * 2] =
 					cpu_to_be32((*src >> 8) | 0x40000000);
 			src++;
 		}
 		buffer += 1;
 		for (c = 0; c < channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s32)*src >> 8);
 			buffer[s->pcm_positions[c] * 2] =
 					cpu_to_be32((*src >> 8) | 0x40000000);
 			src++;
@@ -435,6 +626,9 @@ static void amdtp_write_s32_dualwire(struct amdtp_stream *s,
 		if (--remaining_frames == 0)
 			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames * 2;
 }
 
 static void amdtp_write_s16_dualwire(struct amdtp_stream *s,
@@ -444,6 +638,7 @@ static void amdtp_write_s16_dualwire(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int channels, remaining_frames, i, c;
 	const u16 *src;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	src = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -452,12 +647,16 @@ static void amdtp_write_s16_dualwire(struct amdtp_stream *s,
 
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s16)*src << 8);
 			buffer[s->pcm_positions[c] * 2] =
 					cpu_to_be32((*src << 8) | 0x40000000);
 			src++;
 		}
 		buffer += 1;
 		for (c = 0; c < channels; ++c) {
+			if (meter)
+				meter_sample(s, c, (s16)*src << 8);
 			buffer[s->pcm_positions[c] * 2] =
 					cpu_to_be32((*src << 8) | 0x40000000);
 			src++;
@@ -466,6 +665,9 @@ static void amdtp_write_s16_dualwire(struct amdtp_stream *s,
 		if (--remaining_frames == 0)
 			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames * 2;
 }
 
 static void amdtp_read_s32(struct amdtp_stream *s,
@@ -475,6 +677,7 @@ static void amdtp_read_s32(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int remaining_frames, i, c;
 	u32 *dst;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	dst  = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -483,12 +686,17 @@ static void amdtp_read_s32(struct amdtp_stream *s,
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < s->pcm_channels; ++c) {
 			*dst = be32_to_cpu(buffer[s->pcm_positions[c]]) << 8;
+			if (meter)
+				meter_sample(s, c, (s32)*dst >> 8);
 			dst++;
 		}
 		buffer += s->data_block_quadlets;
 		if (--remaining_frames == 0)
 			dst = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
 static void amdtp_read_s32_dualwire(struct amdtp_stream *s,
@@ -498,6 +706,7 @@ static void amdtp_read_s32_dualwire(struct amdtp_stream *s,
 	struct snd_pcm_runtime *runtime = pcm->runtime;
 	unsigned int channels, remaining_frames, i, c;
 	u32 *dst;
+	bool meter = ACCESS_ONCE(software_meter);
 
 	dst = (void *)runtime->dma_area +
 			frames_to_bytes(runtime, s->pcm_buffer_pointer);
@@ -508,141 +717,834 @@ static void amdtp_read_s32_dualwire(struct amdtp_stream *s,
 		for (c = 0; c < channels; ++c) {
 			*dst =
 			     be32_to_cpu(buffer[s->pcm_positions[c] * 2]) << 8;
+			if (meter)
+				meter_sample(s, c, (s32)*dst >> 8);
 			dst++;
 		}
 		buffer += 1;
 		for (c = 0; c < channels; ++c) {
 			*dst =
 			     be32_to_cpu(buffer[s->pcm_positions[c] * 2]) << 8;
+			if (meter)
+				meter_sample(s, c, (s32)*dst >> 8);
 			dst++;
 		}
 		buffer += s->data_block_quadlets - 1;
 		if (--remaining_frames == 0)
 			dst = (void *)runtime->dma_area;
 	}
+	if (meter)
+		s->meter.frames += frames * 2;
 }
 
-static void amdtp_fill_pcm_silence(struct amdtp_stream *s,
-				   __be32 *buffer, unsigned int frames)
+/*
+ * Floating point samples are converted by integer operations on their IEEE 754
+ * representation, because the FPU cannot be used in the isochronous callback.
+ * 1.0 is scaled to 0x800000, then rounded and clipped to 24 bit. NaN is
+ * converted to silence.
+ */
+static inline int float_to_s24(u32 bits)
 {
-	unsigned int i, c;
+	unsigned int exponent = (bits >> 23) & 0xff;
+	unsigned int shift;
+	u32 value;
+
+	if (exponent >= 127) {
+		if (exponent == 0xff && (bits & 0x007fffff))
+			return 0;
+		return (bits & 0x80000000) ? -0x800000 : 0x7fffff;
+	}
+
+	/* the magnitude is less than 0.5 after scaling */
+	shift = 127 - exponent;
+	if (shift > 24)
+		return 0;
+
+	value = (0x00800000 | (bits & 0x007fffff)) >> (shift - 1);
+	value = (value + 1) >> 1;
+
+	if (bits & 0x80000000)
+		return -(int)value;
+	return min_t(u32, value, 0x7fffff);
+}
+
+static inline int double_to_s24(u64 bits)
+{
+	unsigned int exponent = (bits >> 52) & 0x7ff;
+	unsigned int shift;
+	u64 value;
+
+	if (exponent >= 1023) {
+		if (exponent == 0x7ff && (bits & 0x000fffffffffffffULL))
+			return 0;
+		return (bits >> 63) ? -0x800000 : 0x7fffff;
+	}
+
+	/* 29 bits of the mantissa are under 24 bit */
+	shift = 1023 + 29 - exponent;
+	if (shift > 54)
+		return 0;
+
+	value = (0x0010000000000000ULL | (bits & 0x000fffffffffffffULL)) >>
+								(shift - 1);
+	value = (value + 1) >> 1;
+
+	if (bits >> 63)
+		return -(int)value;
+	return min_t(u64, value, 0x7fffff);
+}
+
+/* Any 24 bit value is exactly representable in single precision. */
+static inline u32 s24_to_float(int sample)
+{
+	u32 value = abs(sample);
+	unsigned int msb;
+
+	if (value == 0)
+		return 0;
+
+	msb = fls(value) - 1;
+	return (sample < 0 ? 0x80000000 : 0) |
+	       ((msb + 127 - 23) << 23) |
+	       ((value << (23 - msb)) & 0x007fffff);
+}
+
+static void amdtp_write_float(struct amdtp_stream *s,
+			      struct snd_pcm_substream *pcm,
+			      __be32 *buffer, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int remaining_frames, i, c;
+	const u32 *src;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
+
+	src = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
 
 	for (i = 0; i < frames; ++i) {
-		for (c = 0; c < s->pcm_channels; ++c)
-			buffer[s->pcm_positions[c]] = cpu_to_be32(0x40000000);
+		for (c = 0; c < s->pcm_channels; ++c) {
+			sample = float_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
+			buffer[s->pcm_positions[c]] =
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
+		}
 		buffer += s->data_block_quadlets;
+		if (--remaining_frames == 0)
+			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
-static void amdtp_fill_pcm_silence_dualwire(struct amdtp_stream *s,
-					   __be32 *buffer, unsigned int frames)
+static void amdtp_write_float_dualwire(struct amdtp_stream *s,
+				       struct snd_pcm_substream *pcm,
+				       __be32 *buffer, unsigned int frames)
 {
-	unsigned int i, c, channels;
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int channels, remaining_frames, i, c;
+	const u32 *src;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
 
+	src = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
 	channels = s->pcm_channels / 2;
+
 	for (i = 0; i < frames; ++i) {
 		for (c = 0; c < channels; ++c) {
+			sample = float_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
 			buffer[s->pcm_positions[c] * 2] =
-			buffer[s->pcm_positions[c] * 2 + 1] =
-						cpu_to_be32(0x40000000);
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
 		}
-		buffer += s->data_block_quadlets;
+		buffer += 1;
+		for (c = 0; c < channels; ++c) {
+			sample = float_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
+			buffer[s->pcm_positions[c] * 2] =
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
+		}
+		buffer += s->data_block_quadlets - 1;
+		if (--remaining_frames == 0)
+			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames * 2;
 }
-static void amdtp_fill_midi(struct amdtp_stream *s,
-			    __be32 *buffer, unsigned int frames)
+
+static void amdtp_write_double(struct amdtp_stream *s,
+			       struct snd_pcm_substream *pcm,
+			       __be32 *buffer, unsigned int frames)
 {
-	unsigned int f, port;
-	u8 *b;
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int remaining_frames, i, c;
+	const u64 *src;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
 
-	for (f = 0; f < frames; f++) {
-		buffer[s->midi_position] = 0x00;
-		b = (u8 *)&buffer[s->midi_position];
+	src = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
 
-		/*
-		 * NOTE:
-		 * Fireworks ignores midi messages in more than first 8
-		 * data blocks of an packet.
-		 */
-		port = (s->data_block_counter + f) % 8;
-		if ((f >= s->blocks_for_midi) ||
-		    (s->midi[port] == NULL) ||
-		    (snd_rawmidi_transmit(s->midi[port], b + 1, 1) <= 0)) {
-			b[0] = 0x80;
-			b[1] = 0x00;	/* confirm to be zero */
-		} else {
-			b[0] = 0x81;
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < s->pcm_channels; ++c) {
+			sample = double_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
+			buffer[s->pcm_positions[c]] =
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
 		}
 		buffer += s->data_block_quadlets;
+		if (--remaining_frames == 0)
+			src = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
-static void amdtp_pull_midi(struct amdtp_stream *s,
-			    __be32 *buffer, unsigned int frames)
+static void amdtp_write_double_dualwire(struct amdtp_stream *s,
+					struct snd_pcm_substream *pcm,
+					__be32 *buffer, unsigned int frames)
 {
-	unsigned int f, port;
-	int len;
-	u8 *b;
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int channels, remaining_frames, i, c;
+	const u64 *src;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
 
-	for (f = 0; f < frames; f++) {
-		port = (s->data_block_counter + f) % 8;
-		b = (u8 *)&buffer[s->midi_position];
+	src = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
+	channels = s->pcm_channels / 2;
 
-		len = b[0] - 0x80;
-		if (len < 1 || 3 < len)
-			continue;
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < channels; ++c) {
+			sample = double_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
+			buffer[s->pcm_positions[c] * 2] =
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
+		}
+		buffer += 1;
+		for (c = 0; c < channels; ++c) {
+			sample = double_to_s24(*src);
+			if (meter)
+				meter_sample(s, c, sample);
+			buffer[s->pcm_positions[c] * 2] =
+				cpu_to_be32((sample & 0x00ffffff) | 0x40000000);
+			src++;
+		}
+		buffer += s->data_block_quadlets - 1;
+		if (--remaining_frames == 0)
+			src = (void *)runtime->dma_area;
+	}
 
-		if (s->midi[port] == NULL)
-			continue;
+	if (meter)
+		s->meter.frames += frames * 2;
+}
+
+static void amdtp_read_float(struct amdtp_stream *s,
+			     struct snd_pcm_substream *pcm,
+			     __be32 *buffer, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int remaining_frames, i, c;
+	u32 *dst;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
+
+	dst = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
 
-		snd_rawmidi_receive(s->midi[port], b + 1, len);
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < s->pcm_channels; ++c) {
+			sample = (s32)(be32_to_cpu(buffer[s->pcm_positions[c]])
+								<< 8) >> 8;
+			if (meter)
+				meter_sample(s, c, sample);
+			*dst = s24_to_float(sample);
+			dst++;
+		}
 		buffer += s->data_block_quadlets;
+		if (--remaining_frames == 0)
+			dst = (void *)runtime->dma_area;
 	}
+
+	if (meter)
+		s->meter.frames += frames;
 }
 
-static void update_pcm_pointers(struct amdtp_stream *s,
-				struct snd_pcm_substream *pcm,
-				unsigned int frames)
-{	unsigned int ptr;
+static void amdtp_read_float_dualwire(struct amdtp_stream *s,
+				      struct snd_pcm_substream *pcm,
+				      __be32 *buffer, unsigned int frames)
+{
+	struct snd_pcm_runtime *runtime = pcm->runtime;
+	unsigned int channels, remaining_frames, i, c;
+	u32 *dst;
+	bool meter = ACCESS_ONCE(software_meter);
+	int sample;
 
-	if (s->dual_wire)
-		frames *= 2;
+	dst = (void *)runtime->dma_area +
+			frames_to_bytes(runtime, s->pcm_buffer_pointer);
+	remaining_frames = runtime->buffer_size - s->pcm_buffer_pointer;
+	channels = s->pcm_channels / 2;
 
-	ptr = s->pcm_buffer_pointer + frames;
-	if (ptr >= pcm->runtime->buffer_size)
-		ptr -= pcm->runtime->buffer_size;
-	ACCESS_ONCE(s->pcm_buffer_pointer) = ptr;
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < channels; ++c) {
+			sample = (s32)(be32_to_cpu(
+				buffer[s->pcm_positions[c] * 2]) << 8) >> 8;
+			if (meter)
+				meter_sample(s, c, sample);
+			*dst = s24_to_float(sample);
+			dst++;
+		}
+		buffer += 1;
+		for (c = 0; c < channels; ++c) {
+			sample = (s32)(be32_to_cpu(
+				buffer[s->pcm_positions[c] * 2]) << 8) >> 8;
+			if (meter)
+				meter_sample(s, c, sample);
+			*dst = s24_to_float(sample);
+			dst++;
+		}
+		buffer += s->data_block_quadlets - 1;
+		if (--remaining_frames == 0)
+			dst = (void *)runtime->dma_area;
+	}
+	if (meter)
+		s->meter.frames += frames * 2;
+}
 
-	s->pcm_period_pointer += frames;
-	if (s->pcm_period_pointer >= pcm->runtime->period_size) {
-		s->pcm_period_pointer -= pcm->runtime->period_size;
-		s->pointer_flush = false;
-		tasklet_hi_schedule(&s->period_tasklet);
+static void amdtp_fill_pcm_silence(struct amdtp_stream *s,
+				   __be32 *buffer, unsigned int frames)
+{
+	unsigned int i, c;
+
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < s->pcm_channels; ++c)
+			buffer[s->pcm_positions[c]] = cpu_to_be32(0x40000000);
+		buffer += s->data_block_quadlets;
 	}
 }
 
-static void pcm_period_tasklet(unsigned long data)
+static void amdtp_fill_pcm_silence_dualwire(struct amdtp_stream *s,
+					   __be32 *buffer, unsigned int frames)
 {
-	struct amdtp_stream *s = (void *)data;
-	struct snd_pcm_substream *pcm = ACCESS_ONCE(s->pcm);
+	unsigned int i, c, channels;
 
-	if (pcm)
-		snd_pcm_period_elapsed(pcm);
+	channels = s->pcm_channels / 2;
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < channels; ++c) {
+			buffer[s->pcm_positions[c] * 2] =
+			buffer[s->pcm_positions[c] * 2 + 1] =
+						cpu_to_be32(0x40000000);
+		}
+		buffer += s->data_block_quadlets;
+	}
 }
 
-static int queue_packet(struct amdtp_stream *s,
-			unsigned int header_length,
-			unsigned int payload_length, bool skip)
+static bool pop_midi_thru(struct amdtp_stream *s, unsigned int port, u8 *b)
 {
-	struct fw_iso_packet p = {0};
-	int err;
+	unsigned long flags;
+	bool popped = false;
 
-	p.interrupt = IS_ALIGNED(s->packet_index + 1, INTERRUPT_INTERVAL);
-	p.tag = TAG_CIP;
-	p.header_length = header_length;
-	p.payload_length = (!skip) ? payload_length : 0;
-	p.skip = skip;
-	err = fw_iso_context_queue(s->context, &p, &s->buffer.iso_buffer,
+	if (ACCESS_ONCE(s->thru_fifo.head[port]) == s->thru_fifo.tail[port])
+		return false;
+
+	spin_lock_irqsave(&s->thru_fifo.lock, flags);
+	if (s->thru_fifo.head[port] != s->thru_fifo.tail[port]) {
+		*b = s->thru_fifo.buf[port][s->thru_fifo.tail[port]++ %
+					    AMDTP_MIDI_THRU_BYTES];
+		popped = true;
+	}
+	spin_unlock_irqrestore(&s->thru_fifo.lock, flags);
+
+	return popped;
+}
+
+static void push_midi_thru(struct amdtp_stream *s, unsigned int port,
+			   u8 *b, unsigned int len)
+{
+	struct amdtp_stream *dst;
+	unsigned int i, head, dst_port;
+	unsigned long flags;
+
+	dst = rcu_dereference(s->midi_thru[port].stream);
+	if (dst == NULL)
+		return;
+	dst_port = ACCESS_ONCE(s->midi_thru[port].port);
+
+	spin_lock_irqsave(&dst->thru_fifo.lock, flags);
+	head = dst->thru_fifo.head[dst_port];
+	if (head + len - dst->thru_fifo.tail[dst_port] >
+						AMDTP_MIDI_THRU_BYTES) {
+		dst->thru_fifo.overruns++;
+	} else {
+		for (i = 0; i < len; i++)
+			dst->thru_fifo.buf[dst_port][head++ %
+					AMDTP_MIDI_THRU_BYTES] = b[i];
+		dst->thru_fifo.head[dst_port] = head;
+	}
+	spin_unlock_irqrestore(&dst->thru_fifo.lock, flags);
+}
+
+/*
+ * Peek bytes from rawmidi into the lane, without acknowledging them. As the
+ * peek starts from the oldest byte not acknowledged, the lane is refilled only
+ * when less than a half of it is left. Bytes for System Realtime messages can
+ * be inserted anywhere in MIDI byte stream, even in the middle of SysEx, thus
+ * they are queued ahead as long as the queue has space.
+ */
+static void fill_midi_lane(struct amdtp_midi_lane *lane,
+			   struct snd_rawmidi_substream *substream)
+{
+	struct snd_rawmidi_runtime *runtime;
+	unsigned int i, pending;
+	int count;
+
+	if (lane->substream != substream) {
+		/* bytes of the former substream are left as they are */
+		lane->substream = substream;
+		lane->bulk_offset += lane->bulk_head;
+		lane->bulk_head = 0;
+		lane->bulk_scan = 0;
+		lane->bulk_tail = 0;
+		for (i = 0; i < AMDTP_MIDI_REALTIME_BYTES; i++)
+			lane->realtime_peeked[i] = false;
+		lane->realtime_sent = 0;
+		lane->running_status = 0;
+		lane->restore_status = false;
+		lane->data_left = 0;
+	}
+	if (substream == NULL)
+		return;
+
+	runtime = substream->runtime;
+	pending = lane->bulk_head - lane->bulk_tail;
+	if ((pending < AMDTP_MIDI_BULK_BYTES / 2) &&
+	    (ACCESS_ONCE(runtime->buffer_size) - ACCESS_ONCE(runtime->avail) >
+								pending)) {
+		memmove(lane->bulk, lane->bulk + lane->bulk_tail, pending);
+		lane->bulk_offset += lane->bulk_tail;
+		lane->bulk_scan -= lane->bulk_tail;
+		lane->bulk_tail = 0;
+
+		count = snd_rawmidi_transmit_peek(substream, lane->bulk,
+						  AMDTP_MIDI_BULK_BYTES);
+		lane->bulk_head = max_t(int, count, pending);
+	}
+
+	while ((lane->bulk_scan < lane->bulk_head) &&
+	       (lane->realtime_head - lane->realtime_tail <
+						AMDTP_MIDI_REALTIME_BYTES)) {
+		if (lane->bulk[lane->bulk_scan] >= 0xf8) {
+			i = lane->realtime_head++ % AMDTP_MIDI_REALTIME_BYTES;
+			lane->realtime[i] = lane->bulk[lane->bulk_scan];
+			lane->realtime_peeked[i] = true;
+		}
+		lane->bulk_scan++;
+	}
+}
+
+/* the number of data bytes after the status byte, except for SysEx */
+static unsigned int midi_data_bytes(u8 status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 1;
+	case 0xf0:
+		break;
+	default:
+		return 2;
+	}
+
+	switch (status) {
+	case 0xf1:
+	case 0xf3:
+		return 1;
+	case 0xf2:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* follow the message in progress, except for realtime bytes */
+static void track_midi_message(struct amdtp_midi_lane *lane, u8 b)
+{
+	if (b >= 0xf8)
+		return;
+
+	if (b == 0xf0) {
+		lane->running_status = 0;
+		lane->data_left = -1;
+	} else if (b >= 0x80) {
+		lane->running_status = (b < 0xf0) ? b : 0;
+		lane->data_left = midi_data_bytes(b);
+	} else if (lane->data_left > 0) {
+		lane->data_left--;
+	} else if (lane->data_left == 0 && lane->running_status != 0) {
+		lane->data_left = midi_data_bytes(lane->running_status) - 1;
+	}
+	lane->restore_status = false;
+}
+
+/*
+ * System Common messages are sent between messages, after the bulk bytes
+ * peeked before them. They cancel running status, thus the status byte is
+ * sent again before the next data byte from rawmidi.
+ */
+static bool pop_midi_common(struct amdtp_midi_lane *lane, u8 *b)
+{
+	unsigned int i;
+
+	if (lane->common_head == lane->common_tail)
+		return false;
+
+	i = lane->common_tail % AMDTP_MIDI_COMMON_BYTES;
+	if (lane->common[i] >= 0x80) {
+		if ((lane->data_left != 0) ||
+		    ((int)(lane->bulk_offset + lane->bulk_tail -
+			   lane->common_mark[i]) < 0))
+			return false;
+		lane->data_left = midi_data_bytes(lane->common[i]);
+		lane->restore_status = (lane->running_status != 0);
+	} else if (lane->data_left > 0) {
+		lane->data_left--;
+	}
+
+	*b = lane->common[i];
+	lane->common_tail++;
+
+	return true;
+}
+
+/* call when the realtime queue is empty, thus all of found bytes are sent */
+static bool pop_midi_bulk(struct amdtp_midi_lane *lane, u8 *b)
+{
+	unsigned int acked = 0;
+	bool popped = false;
+
+	while ((lane->bulk_tail < lane->bulk_scan) &&
+	       (lane->bulk[lane->bulk_tail] >= 0xf8) &&
+	       (lane->realtime_sent > 0)) {
+		lane->bulk_tail++;
+		lane->realtime_sent--;
+		acked++;
+	}
+
+	if ((lane->bulk_tail < lane->bulk_head) && lane->restore_status &&
+	    (lane->bulk[lane->bulk_tail] < 0x80)) {
+		*b = lane->running_status;
+		track_midi_message(lane, *b);
+		popped = true;
+	} else if (lane->bulk_tail < lane->bulk_head) {
+		*b = lane->bulk[lane->bulk_tail++];
+		track_midi_message(lane, *b);
+		if (lane->bulk_scan < lane->bulk_tail)
+			lane->bulk_scan = lane->bulk_tail;
+		acked++;
+		popped = true;
+	}
+
+	if (acked > 0)
+		snd_rawmidi_transmit_ack(lane->substream, acked);
+
+	return popped;
+}
+
+static bool pop_midi(struct amdtp_stream *s, unsigned int port, u8 *b)
+{
+	struct amdtp_midi_lane *lane = &s->midi_lanes[port];
+	unsigned int i;
+
+	fill_midi_lane(lane, ACCESS_ONCE(s->midi[port]));
+
+	if (lane->realtime_head != lane->realtime_tail) {
+		i = lane->realtime_tail++ % AMDTP_MIDI_REALTIME_BYTES;
+		*b = lane->realtime[i];
+		if (lane->realtime_peeked[i]) {
+			lane->realtime_peeked[i] = false;
+			lane->realtime_sent++;
+		}
+		return true;
+	}
+
+	if (pop_midi_thru(s, port, b))
+		return true;
+
+	if (pop_midi_common(lane, b))
+		return true;
+
+	if (lane->substream != NULL)
+		return pop_midi_bulk(lane, b);
+
+	return false;
+}
+
+static inline void queue_midi_realtime(struct amdtp_midi_lane *lane,
+				       const u8 *b, unsigned int len)
+{
+	unsigned int i;
+
+	if (lane->realtime_head - lane->realtime_tail + len >
+						AMDTP_MIDI_REALTIME_BYTES)
+		return;
+
+	for (i = 0; i < len; i++)
+		lane->realtime[lane->realtime_head++ %
+			       AMDTP_MIDI_REALTIME_BYTES] = b[i];
+}
+
+static void queue_midi_common(struct amdtp_midi_lane *lane,
+			      const u8 *b, unsigned int len)
+{
+	unsigned int i, index, mark = lane->bulk_offset + lane->bulk_head;
+
+	if (lane->common_head - lane->common_tail + len >
+						AMDTP_MIDI_COMMON_BYTES)
+		return;
+
+	for (i = 0; i < len; i++) {
+		index = lane->common_head++ % AMDTP_MIDI_COMMON_BYTES;
+		lane->common[index] = b[i];
+		lane->common_mark[index] = mark;
+	}
+}
+
+static void advance_mtc_frame(struct amdtp_midi_clock *c)
+{
+	u8 *time = c->time;
+
+	if (++time[3] < mtc_rates[c->mtc_type].fps)
+		return;
+	time[3] = 0;
+	if (++time[2] < 60)
+		return;
+	time[2] = 0;
+	if (++time[1] >= 60) {
+		time[1] = 0;
+		time[0] = (time[0] + 1) % 24;
+	}
+
+	/* frame 0 and 1 are dropped at each minute except for every tenth */
+	if (c->mtc_type == 2 && time[1] % 10 > 0)
+		time[3] = 2;
+}
+
+/*
+ * Quarter frame messages carry the time in eight pieces, from the lower nibble
+ * of frames to the higher nibble of hours. The time advances two frames after
+ * the last piece.
+ */
+static void queue_mtc_quarter_frame(struct amdtp_midi_clock *c,
+				    struct amdtp_midi_lane *lane)
+{
+	u8 value, msg[2];
+
+	value = c->time[3 - c->piece / 2];
+	if (c->piece & 1)
+		value >>= 4;
+	if (c->piece == 7)
+		value |= c->mtc_type << 1;
+
+	msg[0] = 0xf1;
+	msg[1] = (c->piece << 4) | (value & 0x0f);
+	queue_midi_common(lane, msg, 2);
+
+	if (++c->piece == 8) {
+		c->piece = 0;
+		advance_mtc_frame(c);
+		advance_mtc_frame(c);
+	}
+}
+
+/* called at each data block, of which the rate is @rate */
+static void generate_midi_clock(struct amdtp_midi_clock *c,
+				struct amdtp_midi_lane *lane, unsigned int rate)
+{
+	static const u8 tick = 0xf8;
+	u64 period;
+
+	if (c->transport != 0) {
+		queue_midi_realtime(lane, &c->transport, 1);
+		/* the first tick after Start is the beginning of the song */
+		if (c->transport == 0xfa) {
+			queue_midi_realtime(lane, &tick, 1);
+			c->clock_phase = 0;
+		}
+		c->transport = 0;
+	} else if (c->clock) {
+		period = (u64)rate * c->tempo;
+		c->clock_phase += c->ppqn * 1000000ULL;
+		if (c->clock_phase >= period) {
+			c->clock_phase -= period;
+			queue_midi_realtime(lane, &tick, 1);
+		}
+	}
+
+	if (c->mtc) {
+		period = (u64)rate * mtc_rates[c->mtc_type].den;
+		c->mtc_phase += 4 * mtc_rates[c->mtc_type].num;
+		if (c->mtc_phase >= period) {
+			c->mtc_phase -= period;
+			queue_mtc_quarter_frame(c, lane);
+		}
+	}
+}
+
+static void amdtp_fill_midi(struct amdtp_stream *s, __be32 *buffer,
+			    unsigned int frames, unsigned int dbc)
+{
+	struct amdtp_midi_clock *clocks[ARRAY_SIZE(s->midi_clock)];
+	unsigned int f, port, rate = amdtp_rate_table[s->sfc];
+	bool clocked = false;
+	u8 *b;
+
+	rcu_read_lock();
+	for (port = 0; port < ARRAY_SIZE(clocks); port++) {
+		clocks[port] = rcu_dereference(s->midi_clock[port]);
+		if (clocks[port] != NULL)
+			clocked = true;
+	}
+
+	for (f = 0; f < frames; f++) {
+		for (port = 0; clocked && port < ARRAY_SIZE(clocks); port++) {
+			if (clocks[port] != NULL)
+				generate_midi_clock(clocks[port],
+						    &s->midi_lanes[port], rate);
+		}
+
+		buffer[s->midi_position] = 0x00;
+		b = (u8 *)&buffer[s->midi_position];
+
+		/*
+		 * NOTE:
+		 * Fireworks ignores midi messages in more than first 8
+		 * data blocks of an packet.
+		 */
+		port = (dbc + f) % 8;
+		if ((f >= s->blocks_for_midi) || !pop_midi(s, port, b + 1)) {
+			b[0] = 0x80;
+			b[1] = 0x00;	/* confirm to be zero */
+		} else {
+			b[0] = 0x81;
+		}
+		buffer += s->data_block_quadlets;
+	}
+
+	rcu_read_unlock();
+}
+
+static void amdtp_pull_midi(struct amdtp_stream *s, __be32 *buffer,
+			    unsigned int frames, unsigned int dbc)
+{
+	unsigned int f, port;
+	int len;
+	u8 *b;
+
+	rcu_read_lock();
+
+	for (f = 0; f < frames; f++) {
+		port = (dbc + f) % 8;
+		b = (u8 *)&buffer[s->midi_position];
+		buffer += s->data_block_quadlets;
+
+		len = b[0] - 0x80;
+		if (len < 1 || 3 < len)
+			continue;
+
+		if (s->midi[port] != NULL)
+			snd_rawmidi_receive(s->midi[port], b + 1, len);
+		push_midi_thru(s, port, b + 1, len);
+	}
+
+	rcu_read_unlock();
+}
+
+static void publish_meter(struct amdtp_stream *s)
+{
+	unsigned int c, channels;
+	u64 mean;
+
+	channels = s->pcm_channels;
+	if (s->dual_wire)
+		channels /= 2;
+
+	write_seqcount_begin(&s->meter.seq);
+	for (c = 0; c < channels; c++) {
+		s->meter.snapshot.peak[c] = s->meter.peak[c];
+		mean = div_u64(s->meter.squares[c], s->meter.frames);
+		s->meter.snapshot.rms[c] = int_sqrt(mean) << 8;
+	}
+	write_seqcount_end(&s->meter.seq);
+
+	memset(s->meter.peak, 0, sizeof(s->meter.peak));
+	memset(s->meter.squares, 0, sizeof(s->meter.squares));
+	s->meter.frames = 0;
+}
+
+static void update_pcm_pointers(struct amdtp_stream *s,
+				struct snd_pcm_substream *pcm,
+				unsigned int frames)
+{	unsigned int ptr;
+
+	if (s->dual_wire)
+		frames *= 2;
+
+	ptr = s->pcm_buffer_pointer + frames;
+	if (ptr >= pcm->runtime->buffer_size)
+		ptr -= pcm->runtime->buffer_size;
+	ACCESS_ONCE(s->pcm_buffer_pointer) = ptr;
+
+	s->pcm_period_pointer += frames;
+	if (s->pcm_period_pointer >= pcm->runtime->period_size) {
+		s->pcm_period_pointer -= pcm->runtime->period_size;
+		s->pointer_flush = false;
+		if (s->meter.frames > 0)
+			publish_meter(s);
+		tasklet_hi_schedule(&s->period_tasklet);
+	}
+}
+
+static void pcm_period_tasklet(unsigned long data)
+{
+	struct amdtp_stream *s = (void *)data;
+	struct snd_pcm_substream *pcm = ACCESS_ONCE(s->pcm);
+
+	if (pcm)
+		snd_pcm_period_elapsed(pcm);
+}
+
+static int queue_packet(struct amdtp_stream *s,
+			unsigned int header_length,
+			unsigned int payload_length, bool skip)
+{
+	struct fw_iso_packet p = {0};
+	int err;
+
+	p.interrupt = IS_ALIGNED(s->packet_index + 1, INTERRUPT_INTERVAL);
+	p.tag = TAG_CIP;
+	p.header_length = header_length;
+	p.payload_length = (!skip) ? payload_length : 0;
+	p.skip = skip;
+	err = fw_iso_context_queue(s->context, &p, &s->buffer.iso_buffer,
 				   s->buffer.packets[s->packet_index].offset);
 	if (err < 0) {
 		dev_err(&s->unit->device, "queueing error: %d\n", err);
@@ -669,14 +1571,161 @@ static inline int queue_in_packet(struct amdtp_stream *s)
 			    amdtp_stream_get_max_payload(s), false);
 }
 
+static void write_out_payload(struct amdtp_stream *s, __be32 *buffer,
+			      unsigned int data_blocks, unsigned int dbc)
+{
+	struct snd_pcm_substream *pcm;
+
+	pcm = ACCESS_ONCE(s->pcm);
+	if (pcm)
+		s->transfer_samples(s, pcm, buffer, data_blocks);
+	else if (s->dual_wire)
+		amdtp_fill_pcm_silence_dualwire(s, buffer, data_blocks);
+	else
+		amdtp_fill_pcm_silence(s, buffer, data_blocks);
+	if (s->midi_ports)
+		amdtp_fill_midi(s, buffer, data_blocks, dbc);
+
+	if (pcm)
+		update_pcm_pointers(s, pcm, data_blocks);
+}
+
+static void read_in_payload(struct amdtp_stream *s, __be32 *buffer,
+			    unsigned int data_blocks, unsigned int dbc)
+{
+	struct snd_pcm_substream *pcm;
+
+	pcm = ACCESS_ONCE(s->pcm);
+	if (pcm)
+		s->transfer_samples(s, pcm, buffer, data_blocks);
+
+	if (s->midi_ports)
+		amdtp_pull_midi(s, buffer, data_blocks, dbc);
+
+	if (pcm)
+		update_pcm_pointers(s, pcm, data_blocks);
+}
+
+/* the buffer may keep PCM samples and MIDI bytes of the old packet */
+static void fill_empty_payload(struct amdtp_stream *s, __be32 *buffer,
+			       unsigned int data_blocks)
+{
+	unsigned int i;
+
+	if (s->dual_wire)
+		amdtp_fill_pcm_silence_dualwire(s, buffer, data_blocks);
+	else
+		amdtp_fill_pcm_silence(s, buffer, data_blocks);
+
+	if (s->midi_ports == 0)
+		return;
+	for (i = 0; i < data_blocks; i++) {
+		buffer[s->midi_position] = cpu_to_be32(0x80000000);
+		buffer += s->data_block_quadlets;
+	}
+}
+
+static bool in_left_packets(struct amdtp_stream *s, __be32 *buffer)
+{
+	void *pos = buffer;
+
+	return (pos >= s->left_packets) &&
+	       (pos < s->left_packets +
+		      amdtp_stream_get_max_payload(s) * QUEUE_LENGTH / 4);
+}
+
+/*
+ * Hand the payload to the worker. The payload should be processed before the
+ * controller transmits it or the buffer is reused for next receiving, thus
+ * the worker has the time for (QUEUE_LENGTH - INTERRUPT_INTERVAL) cycles at
+ * least. Returns 1 if the payload is handed, 0 if it should be processed in
+ * this context, or -ENOSPC if it is dropped. At -ENOSPC, the caller should
+ * abort PCM substream out of s->lock, because the trigger callback takes it.
+ */
+static int offload_payload(struct amdtp_stream *s, __be32 *buffer,
+			   unsigned int data_blocks, unsigned int dbc)
+{
+	struct amdtp_offload_entry *entry;
+	unsigned int head = s->offload.head;
+	unsigned int slot = head % OFFLOAD_ENTRIES;
+	__be32 *copy;
+
+	if (s->offload.ring == NULL)
+		return 0;
+
+	/* the worker cannot catch up with the stream */
+	if (head - ACCESS_ONCE(s->offload.tail) >= OFFLOAD_ENTRIES) {
+		s->offload.overruns++;
+		if (s->direction == AMDTP_OUT_STREAM)
+			fill_empty_payload(s, buffer, data_blocks);
+		return -ENOSPC;
+	}
+
+	entry = &s->offload.ring[slot];
+
+	/* sort_in_packets() overwrites the left packets in next callback */
+	if ((s->offload.copies != NULL) && in_left_packets(s, buffer)) {
+		copy = s->offload.copies +
+		       amdtp_stream_get_max_payload(s) * slot;
+		memcpy(copy, buffer,
+		       data_blocks * s->data_block_quadlets * sizeof(__be32));
+		buffer = copy;
+	}
+
+	entry->buffer = buffer;
+	entry->data_blocks = data_blocks;
+	entry->data_block_counter = dbc;
+	entry->queued = ktime_get();
+
+	/* the entry should be visible before the head moves */
+	smp_wmb();
+	ACCESS_ONCE(s->offload.head) = head + 1;
+
+	return 1;
+}
+
+static void offload_work(struct work_struct *work)
+{
+	struct amdtp_stream *s = container_of(work, struct amdtp_stream,
+					      offload.work);
+	struct amdtp_offload_entry *entry;
+	unsigned int tail = s->offload.tail;
+	unsigned int latency;
+
+	while (tail != ACCESS_ONCE(s->offload.head)) {
+		smp_rmb();
+		entry = &s->offload.ring[tail % OFFLOAD_ENTRIES];
+
+		if (s->direction == AMDTP_OUT_STREAM)
+			write_out_payload(s, entry->buffer, entry->data_blocks,
+					  entry->data_block_counter);
+		else
+			read_in_payload(s, entry->buffer, entry->data_blocks,
+					entry->data_block_counter);
+
+		latency = ktime_us_delta(ktime_get(), entry->queued);
+		if (latency > s->offload.latency_max)
+			s->offload.latency_max = latency;
+		s->offload.latency_avg = (s->offload.latency_avg * 7 +
+					  latency) / 8;
+
+		/* the entry should be consumed before the slot is released */
+		smp_mb();
+		ACCESS_ONCE(s->offload.tail) = ++tail;
+	}
+}
+
 static void handle_out_packet(struct amdtp_stream *s, unsigned int syt)
 {
 	__be32 *buffer;
-	unsigned int data_blocks, payload_length;
-	struct snd_pcm_substream *pcm = NULL;
+	unsigned int data_blocks, dbc, payload_length;
+	unsigned long flags;
+	int offloaded = 0;
+
+	spin_lock_irqsave(&s->lock, flags);
 
 	if (s->packet_index < 0)
-		return;
+		goto end;
 
 	/* this module generate empty packet for 'no data' */
 	if (!(s->flags & CIP_BLOCKING) || (syt != CIP_SYT_NO_INFO))
@@ -692,26 +1741,36 @@ static void handle_out_packet(struct amdtp_stream *s, unsigned int syt)
 				(s->sfc << CIP_FDF_SFC_SHIFT) | syt);
 	buffer += 2;
 
-	pcm = ACCESS_ONCE(s->pcm);
-	if (pcm)
-		s->transfer_samples(s, pcm, buffer, data_blocks);
-	else if (s->dual_wire)
-		amdtp_fill_pcm_silence_dualwire(s, buffer, data_blocks);
-	else
-		amdtp_fill_pcm_silence(s, buffer, data_blocks);
-	if (s->midi_ports)
-		amdtp_fill_midi(s, buffer, data_blocks);
+	dbc = s->data_block_counter;
+	offloaded = offload_payload(s, buffer, data_blocks, dbc);
+	if (offloaded == 0)
+		write_out_payload(s, buffer, data_blocks, dbc);
 
-	s->data_block_counter = (s->data_block_counter + data_blocks) & 0xff;
+	s->data_block_counter = (dbc + data_blocks) & 0xff;
+	s->packet_blocks[s->packet_index] = data_blocks;
 
 	payload_length = 8 + data_blocks * 4 * s->data_block_quadlets;
 	if (queue_out_packet(s, payload_length, false) < 0) {
+		spin_unlock_irqrestore(&s->lock, flags);
 		amdtp_stream_pcm_abort(s);
 		return;
 	}
+	s->pending_packets++;
+end:
+	spin_unlock_irqrestore(&s->lock, flags);
 
-	if (pcm)
-		update_pcm_pointers(s, pcm, data_blocks);
+	if (offloaded < 0)
+		amdtp_stream_pcm_abort(s);
+}
+
+/* the controller reports transmitted packets */
+static void complete_out_packets(struct amdtp_stream *s, unsigned int packets)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->pending_packets -= min(packets, s->pending_packets);
+	spin_unlock_irqrestore(&s->lock, flags);
 }
 
 static void handle_in_packet(struct amdtp_stream *s,
@@ -720,7 +1779,7 @@ static void handle_in_packet(struct amdtp_stream *s,
 {
 	u32 cip_header[2];
 	unsigned int data_blocks;
-	struct snd_pcm_substream *pcm;
+	int offloaded;
 
 	cip_header[0] = be32_to_cpu(buffer[0]);
 	cip_header[1] = be32_to_cpu(buffer[1]);
@@ -754,18 +1813,98 @@ static void handle_in_packet(struct amdtp_stream *s,
 	 * "8" at any sampling rates but actually it's different.
 	 */
 	data_blocks = (payload_quadlets - 2) / s->data_block_quadlets;
+	if (data_blocks > 0)
+		ACCESS_ONCE(s->watchdog.data) = jiffies;
 
 	buffer += 2;
 
-	pcm = ACCESS_ONCE(s->pcm);
-	if (pcm)
-		s->transfer_samples(s, pcm, buffer, data_blocks);
+	offloaded = offload_payload(s, buffer, data_blocks,
+				    s->data_block_counter);
+	if (offloaded == 0)
+		read_in_payload(s, buffer, data_blocks, s->data_block_counter);
+	else if (offloaded < 0)
+		amdtp_stream_pcm_abort(s);
+}
 
-	if (s->midi_ports)
-		amdtp_pull_midi(s, buffer, data_blocks);
+/*
+ * Add routed channels of an incoming packet into the outgoing packet which
+ * the sync slave queued for the same SYT. Both packets have the same number of
+ * data blocks in blocking mode.
+ */
+static void mix_monitor(struct amdtp_stream *s, unsigned int payload_quadlets,
+			__be32 *buffer)
+{
+	struct amdtp_stream *slave = s->sync_slave;
+	struct amdtp_monitor *monitor;
+	struct amdtp_monitor_route *route;
+	unsigned int i, r, index, data_blocks;
+	unsigned long flags;
+	__be32 *out;
+	s64 sample;
 
-	if (pcm)
-		update_pcm_pointers(s, pcm, data_blocks);
+	if ((payload_quadlets < 3) ||
+	    ((be32_to_cpu(buffer[1]) & CIP_FMT_MASK) != CIP_FMT_AM) ||
+	    s->dual_wire || slave->dual_wire || (slave->offload.ring != NULL))
+		return;
+
+	rcu_read_lock();
+	monitor = rcu_dereference(s->monitor);
+	if (monitor == NULL)
+		goto end;
+
+	spin_lock_irqsave(&slave->lock, flags);
+	if (slave->packet_index < 0)
+		goto unlock;
+
+	index = (slave->packet_index + QUEUE_LENGTH - 1) % QUEUE_LENGTH;
+	data_blocks = min((payload_quadlets - 2) / s->data_block_quadlets,
+			  slave->packet_blocks[index]);
+	out = (__be32 *)slave->buffer.packets[index].buffer + 2;
+	buffer += 2;
+
+	for (i = 0; i < data_blocks; i++) {
+		for (r = 0; r < monitor->count; r++) {
+			route = &monitor->routes[r];
+			if ((route->src >= s->pcm_channels) ||
+			    (route->dst >= slave->pcm_channels))
+				continue;
+
+			sample = sign_extend32(be32_to_cpu(
+				buffer[s->pcm_positions[route->src]]), 23);
+			sample = (sample * route->gain) >> 16;
+			sample += sign_extend32(be32_to_cpu(
+				out[slave->pcm_positions[route->dst]]), 23);
+			sample = clamp_t(s64, sample, -0x800000, 0x7fffff);
+
+			out[slave->pcm_positions[route->dst]] =
+				cpu_to_be32(((u32)sample & 0x00ffffff) |
+					    0x40000000);
+		}
+		buffer += s->data_block_quadlets;
+		out += slave->data_block_quadlets;
+	}
+unlock:
+	spin_unlock_irqrestore(&slave->lock, flags);
+end:
+	rcu_read_unlock();
+}
+
+/* capture and playback start in the packets which have the paired SYT */
+static void attach_linked_pcms(struct amdtp_stream *s)
+{
+	struct amdtp_stream *slave = s->sync_slave;
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	spin_lock(&slave->lock);
+	if (s->linked_pcm != NULL)
+		ACCESS_ONCE(s->pcm) = s->linked_pcm;
+	if (slave->linked_pcm != NULL)
+		ACCESS_ONCE(slave->pcm) = slave->linked_pcm;
+	s->linked_pcm = NULL;
+	slave->linked_pcm = NULL;
+	spin_unlock(&slave->lock);
+	spin_unlock_irqrestore(&s->lock, flags);
 }
 
 #define SWAP(tbl, m, n) \
@@ -806,12 +1945,111 @@ static void packet_sort(struct sort_table *tbl, unsigned int len)
 	} while (i < len);
 }
 
-static inline void add_transfer_delay(struct amdtp_stream *s, unsigned int *syt)
+static inline void add_transfer_delay(struct amdtp_stream *s, unsigned int *syt)
+{
+	if (*syt != CIP_SYT_NO_INFO) {
+		*syt += (s->transfer_delay / TICKS_PER_CYCLE) << 12;
+		*syt += s->transfer_delay % TICKS_PER_CYCLE;
+		*syt &= CIP_SYT_MASK;
+	}
+}
+
+static inline void kick_offload_work(struct amdtp_stream *s)
+{
+	if (s->offload.ring == NULL)
+		return;
+
+	/* the CPU may be unplugged while streaming */
+	if (cpu_online(s->offload.target))
+		queue_work_on(s->offload.target, system_highpri_wq,
+			      &s->offload.work);
+	else
+		queue_work(system_highpri_wq, &s->offload.work);
+}
+
+/* attach the PCM substream armed for this cycle, or already overdue */
+static void start_scheduled_pcm(struct amdtp_stream *s, unsigned int cycle)
+{
+	unsigned int linear, diff;
+	unsigned long flags;
+
+	if (ACCESS_ONCE(s->scheduled.pcm) == NULL)
+		return;
+
+	linear = (((cycle >> 13) & 0x07) * 8000 + (cycle & 0x1fff)) % 64000;
+	diff = (linear + 64000 - s->scheduled.cycle) % 64000;
+	if (diff >= 32000)
+		return;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (s->scheduled.pcm != NULL) {
+		if (diff > 0)
+			s->scheduled.missed++;
+		ACCESS_ONCE(s->pcm) = s->scheduled.pcm;
+		s->scheduled.pcm = NULL;
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+/*
+ * In blocking mode synchronized to the device, the slave packets are queued in
+ * the callback of the master, and sent after the packets pending in the queue.
+ */
+static void start_scheduled_slave_pcm(struct amdtp_stream *slave)
+{
+	unsigned int linear;
+
+	if ((ACCESS_ONCE(slave->scheduled.pcm) == NULL) ||
+	    !ACCESS_ONCE(slave->out_cycle.known))
+		return;
+
+	linear = (ACCESS_ONCE(slave->out_cycle.last) +
+		  ACCESS_ONCE(slave->pending_packets) + 1) % 64000;
+	start_scheduled_pcm(slave, ((linear / 8000) << 13) | (linear % 8000));
+}
+
+/*
+ * The controller stores the timestamp of each transmitted packet in the header
+ * of IT context, as the lowest three bits of second and the cycle count.
+ * Returns the number of cycles skipped just before the packet.
+ */
+static unsigned int track_out_cycle(struct amdtp_stream *s, u32 tstamp)
+{
+	unsigned int cycle, gap;
+
+	cycle = ((tstamp >> 13) & 0x07) * 8000 + (tstamp & 0x1fff);
+	gap = (cycle + 64000 - s->out_cycle.last) % 64000;
+	s->out_cycle.last = cycle;
+
+	if (!s->out_cycle.known) {
+		s->out_cycle.known = true;
+		return 0;
+	}
+
+	/* ignore a timestamp going backward */
+	if (gap <= 1 || gap >= 32000)
+		return 0;
+
+	s->out_cycle.skipped += gap - 1;
+	return gap - 1;
+}
+
+/*
+ * The packets already queued are delayed. Advance the sequences of SYT offset
+ * and data blocks as if empty packets were sent in the skipped cycles, so that
+ * the following packets keep the rate to the bus clock.
+ */
+static void skip_out_cycles(struct amdtp_stream *s, unsigned int cycles)
 {
-	if (*syt != CIP_SYT_NO_INFO) {
-		*syt += (s->transfer_delay / TICKS_PER_CYCLE) << 12;
-		*syt += s->transfer_delay % TICKS_PER_CYCLE;
-		*syt &= CIP_SYT_MASK;
+	unsigned long flags;
+
+	while (cycles-- > 0) {
+		calculate_syt(s, 0);
+		if (!(s->flags & CIP_BLOCKING)) {
+			spin_lock_irqsave(&s->lock, flags);
+			calculate_data_blocks(s);
+			spin_unlock_irqrestore(&s->lock, flags);
+		}
 	}
 }
 
@@ -820,33 +2058,102 @@ static void out_stream_callback(struct fw_iso_context *context, u32 cycle,
 				void *private_data)
 {
 	struct amdtp_stream *s = private_data;
-	unsigned int i, syt, packets = header_length / 4;
+	__be32 *headers = header;
+	unsigned int i, syt, linear, packets = header_length / 4;
 
-	/*
-	 * Compute the cycle of the last queued packet.
-	 * (We need only the four lowest bits for the SYT, so we can ignore
-	 * that bits 0-11 must wrap around at 3072.)
-	 */
-	cycle += QUEUE_LENGTH - packets;
+	ACCESS_ONCE(s->watchdog.callback) = jiffies;
+	cycle_clock_sample(s->clock);
+	complete_out_packets(s, packets);
 
 	for (i = 0; i < packets; ++i) {
-		syt = calculate_syt(s, ++cycle);
+		skip_out_cycles(s, track_out_cycle(s, be32_to_cpu(headers[i])));
+
+		/* the packet queued to the slot is sent after the queue */
+		linear = (s->out_cycle.last + QUEUE_LENGTH) % 64000;
+		cycle = ((linear / 8000) << 13) | (linear % 8000);
+
+		syt = calculate_syt(s, cycle);
+		start_scheduled_pcm(s, cycle);
 		handle_out_packet(s, syt);
 	}
 	fw_iso_context_queue_flush(s->context);
+
+	kick_offload_work(s);
 }
 
-static void in_stream_callback(struct fw_iso_context *context, u32 cycle,
-			       size_t header_length, void *header,
-			       void *private_data)
+static void process_in_packet(struct amdtp_stream *s,
+			      unsigned int payload_quadlets, __be32 *buffer)
 {
-	struct amdtp_stream *s = private_data;
-	struct sort_table *entry, *tbl = s->sort_table;
-	unsigned int i, j, k, index, packets, syt, remain_packets;
-	__be32 *buffer, *headers = header;
+	unsigned int syt;
 
-	/* The number of packets in buffer */
-	packets = header_length / IN_PACKET_HEADER_SIZE;
+	/* Process sync slave stream */
+	if ((s->flags & CIP_BLOCKING) &&
+	    (s->flags & CIP_SYNC_TO_DEVICE) &&
+	    s->sync_slave->callbacked) {
+		if (ACCESS_ONCE(s->linked_pcm) ||
+		    ACCESS_ONCE(s->sync_slave->linked_pcm))
+			attach_linked_pcms(s);
+		syt = be32_to_cpu(buffer[1]) & CIP_SYT_MASK;
+		add_transfer_delay(s, &syt);
+		start_scheduled_slave_pcm(s->sync_slave);
+		handle_out_packet(s->sync_slave, syt);
+		mix_monitor(s, payload_quadlets, buffer);
+	}
+	handle_in_packet(s, payload_quadlets, buffer);
+}
+
+/* Returns false if the packet is behind the previous one in DBC. */
+static bool check_in_order(struct amdtp_stream *s,
+			   unsigned int payload_quadlets, __be32 *buffer)
+{
+	unsigned int dbc, diff;
+	bool in_order = true;
+
+	if (payload_quadlets < 2)
+		return true;
+
+	dbc = be32_to_cpu(buffer[0]) & AMDTP_DBC_MASK;
+	if (s->last_dbc >= 0) {
+		diff = (s->last_dbc - dbc) & AMDTP_DBC_MASK;
+		in_order = (diff == 0) || (diff > DBC_THRESHOLD);
+	}
+	s->last_dbc = dbc;
+
+	return in_order;
+}
+
+/* Most devices transmit in order, then packets are handled as they come. */
+static void handle_in_packets(struct amdtp_stream *s, unsigned int packets,
+			      __be32 *headers)
+{
+	unsigned int i, index, payload_quadlets;
+	__be32 *buffer;
+
+	for (i = 0; i < packets; i++) {
+		index = s->packet_index + i;
+		if (index >= QUEUE_LENGTH)
+			index -= QUEUE_LENGTH;
+		buffer = s->buffer.packets[index].buffer;
+
+		payload_quadlets = (be32_to_cpu(headers[i]) >>
+					ISO_DATA_LENGTH_SHIFT) / 4;
+		if (!s->sorting &&
+		    !check_in_order(s, payload_quadlets, buffer)) {
+			dev_info(&s->unit->device,
+				 "packets out of order, start sorting them\n");
+			s->sorting = true;
+		}
+
+		process_in_packet(s, payload_quadlets, buffer);
+	}
+}
+
+static void sort_in_packets(struct amdtp_stream *s, unsigned int packets,
+			    __be32 *headers)
+{
+	struct sort_table *entry, *tbl = s->sort_table;
+	unsigned int i, j, k, index, remain_packets;
+	__be32 *buffer;
 
 	/* Store into sort table and sort. */
 	for (i = 0; i < packets; i++) {
@@ -881,15 +2188,7 @@ static void in_stream_callback(struct fw_iso_context *context, u32 cycle,
 				 amdtp_stream_get_max_payload(s) * j++;
 
 		if (i < remain_packets + packets - s->remain_packets) {
-			/* Process sync slave stream */
-			if ((s->flags & CIP_BLOCKING) &&
-			    (s->flags & CIP_SYNC_TO_DEVICE) &&
-			    s->sync_slave->callbacked) {
-				syt = be32_to_cpu(buffer[1]) & CIP_SYT_MASK;
-				add_transfer_delay(s, &syt);
-				handle_out_packet(s->sync_slave, syt);
-			}
-			handle_in_packet(s, tbl[i].payload_size / 4, buffer);
+			process_in_packet(s, tbl[i].payload_size / 4, buffer);
 		} else {
 			tbl[k].id = tbl[i].id + QUEUE_LENGTH;
 			tbl[k].dbc = tbl[i].dbc;
@@ -899,6 +2198,25 @@ static void in_stream_callback(struct fw_iso_context *context, u32 cycle,
 			       buffer, tbl[i].payload_size);
 		}
 	}
+}
+
+static void in_stream_callback(struct fw_iso_context *context, u32 cycle,
+			       size_t header_length, void *header,
+			       void *private_data)
+{
+	struct amdtp_stream *s = private_data;
+	unsigned int i, packets;
+
+	ACCESS_ONCE(s->watchdog.callback) = jiffies;
+	cycle_clock_sample(s->clock);
+
+	/* The number of packets in buffer */
+	packets = header_length / IN_PACKET_HEADER_SIZE;
+
+	if (s->sorting)
+		sort_in_packets(s, packets, header);
+	else
+		handle_in_packets(s, packets, header);
 
 	for (i = 0; i < packets; i++) {
 		if (queue_in_packet(s) < 0) {
@@ -909,10 +2227,14 @@ static void in_stream_callback(struct fw_iso_context *context, u32 cycle,
 
 	/* when sync to device, flush the packets for slave stream */
 	if ((s->flags & CIP_BLOCKING) &&
-	    (s->flags & CIP_SYNC_TO_DEVICE) && s->sync_slave->callbacked)
+	    (s->flags & CIP_SYNC_TO_DEVICE) && s->sync_slave->callbacked) {
 		fw_iso_context_queue_flush(s->sync_slave->context);
+		kick_offload_work(s->sync_slave);
+	}
 
 	fw_iso_context_queue_flush(s->context);
+
+	kick_offload_work(s);
 }
 
 /* processing is done by master callback */
@@ -920,7 +2242,17 @@ static void slave_stream_callback(struct fw_iso_context *context, u32 cycle,
 				  size_t header_length, void *header,
 				  void *private_data)
 {
-	return;
+	struct amdtp_stream *s = private_data;
+	__be32 *headers = header;
+	unsigned int i, packets = header_length / 4;
+
+	ACCESS_ONCE(s->watchdog.callback) = jiffies;
+	cycle_clock_sample(s->clock);
+	complete_out_packets(s, packets);
+
+	/* SYT comes from the master, thus just count skipped cycles */
+	for (i = 0; i < packets; ++i)
+		track_out_cycle(s, be32_to_cpu(headers[i]));
 }
 
 /* this is executed one time */
@@ -930,6 +2262,8 @@ static void amdtp_stream_callback(struct fw_iso_context *context, u32 cycle,
 {
 	struct amdtp_stream *s = private_data;
 
+	s->watchdog.callback = jiffies;
+	s->watchdog.data = jiffies;
 	s->callbacked = true;
 
 	if (s->direction == AMDTP_IN_STREAM)
@@ -941,9 +2275,204 @@ static void amdtp_stream_callback(struct fw_iso_context *context, u32 cycle,
 
 	context->callback.sc(context, cycle, header_length, header, s);
 
+	/* waiters in amdtp_stream_wait_callback() sleep without any locks */
+	wake_up(&s->callback_wait);
+
 	return;
 }
 
+static unsigned long watchdog_limit(void)
+{
+	unsigned int cycles = ACCESS_ONCE(stall_cycles);
+
+	return msecs_to_jiffies(DIV_ROUND_UP(cycles * 1000,
+					     CYCLES_PER_SECOND));
+}
+
+/* the interval to poll the parameter while the watchdog is disabled */
+#define WATCHDOG_IDLE_INTERVAL_MS	1000
+
+static unsigned long watchdog_interval(unsigned long limit)
+{
+	if (limit == 0)
+		return msecs_to_jiffies(WATCHDOG_IDLE_INTERVAL_MS);
+	return max(limit / 2, 1UL);
+}
+
+/*
+ * The controller can stop a context silently, and devices stop transmitting
+ * when they lose their clock source. Both are found here, then the PCM device
+ * is stopped at once instead of waiting for the timeout in ALSA PCM core.
+ */
+static void watchdog_work(struct work_struct *work)
+{
+	struct amdtp_stream *s = container_of(to_delayed_work(work),
+					      struct amdtp_stream,
+					      watchdog.work);
+	unsigned long limit = watchdog_limit();
+	const char *cause = NULL;
+
+	/* disabled, but keep polling in case it is enabled again */
+	if (limit == 0) {
+		s->watchdog.stalled = false;
+		goto end;
+	}
+
+	/* the first callback is waited for by amdtp_stream_wait_callback() */
+	if (!s->callbacked)
+		goto end;
+
+	if (time_after(jiffies, ACCESS_ONCE(s->watchdog.callback) + limit))
+		cause = "no callbacks";
+	else if ((s->direction == AMDTP_IN_STREAM) &&
+		 time_after(jiffies, ACCESS_ONCE(s->watchdog.data) + limit))
+		cause = "no incoming data";
+
+	if (cause == NULL) {
+		s->watchdog.stalled = false;
+	} else if (!s->watchdog.stalled) {
+		/* only on the transition into the stall */
+		s->watchdog.stalled = true;
+		s->watchdog.stalls++;
+		dev_err(&s->unit->device,
+			"stream stalled: %s for %u ms\n",
+			cause, jiffies_to_msecs(limit));
+		if (ACCESS_ONCE(stall_restart))
+			ACCESS_ONCE(s->watchdog.error) = true;
+		amdtp_stream_pcm_abort(s);
+	}
+end:
+	schedule_delayed_work(&s->watchdog.work, watchdog_interval(limit));
+}
+
+static void watchdog_start(struct amdtp_stream *s)
+{
+	unsigned long limit = watchdog_limit();
+
+	s->watchdog.callback = jiffies;
+	s->watchdog.data = jiffies;
+	s->watchdog.stalled = false;
+	s->watchdog.error = false;
+
+	schedule_delayed_work(&s->watchdog.work, watchdog_interval(limit));
+}
+
+static int offload_init(struct amdtp_stream *s)
+{
+	int cpu;
+
+	cpu = (s->offload.cpu >= 0) ? s->offload.cpu : offload_cpu;
+	if (cpu < 0)
+		return 0;
+	if ((cpu >= nr_cpu_ids) || !cpu_online(cpu)) {
+		dev_warn(&s->unit->device,
+			 "CPU %d is not available for offloading\n", cpu);
+		return 0;
+	}
+
+	/* the index of the ring wraps around as unsigned int */
+	BUILD_BUG_ON(OFFLOAD_ENTRIES & (OFFLOAD_ENTRIES - 1));
+	BUILD_BUG_ON(OFFLOAD_ENTRIES > QUEUE_LENGTH - INTERRUPT_INTERVAL);
+
+	s->offload.ring = kcalloc(OFFLOAD_ENTRIES,
+				  sizeof(struct amdtp_offload_entry),
+				  GFP_KERNEL);
+	if (s->offload.ring == NULL)
+		return -ENOMEM;
+
+	if (s->direction == AMDTP_IN_STREAM) {
+		s->offload.copies = kcalloc(OFFLOAD_ENTRIES,
+					    amdtp_stream_get_max_payload(s),
+					    GFP_KERNEL);
+		if (s->offload.copies == NULL) {
+			kfree(s->offload.ring);
+			s->offload.ring = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	s->offload.target = cpu;
+	s->offload.head = 0;
+	s->offload.tail = 0;
+	s->offload.latency_max = 0;
+	s->offload.latency_avg = 0;
+	s->offload.overruns = 0;
+
+	return 0;
+}
+
+/* Call after the isochronous context is stopped. */
+static void offload_destroy(struct amdtp_stream *s)
+{
+	if (s->offload.ring == NULL)
+		return;
+
+	cancel_work_sync(&s->offload.work);
+	kfree(s->offload.copies);
+	s->offload.copies = NULL;
+	kfree(s->offload.ring);
+	s->offload.ring = NULL;
+}
+
+/**
+ * amdtp_stream_set_offload - process PCM/MIDI data in a worker
+ * @s: the AMDTP stream
+ * @cpu: the CPU for the worker, or -1 to follow 'offload_cpu' option
+ *
+ * By default, PCM samples and MIDI bytes are converted in the isochronous
+ * callback, on the CPU which handles interrupts from the controller. With the
+ * offloading, the callback just hands payloads to a worker bound to the CPU.
+ * This adds some latency, which is measured and reported by
+ * amdtp_stream_proc_read().
+ *
+ * The payloads of outgoing packets are written after queueing them, thus this
+ * should not be used on platforms without cache-coherent DMA. Returns -EBUSY
+ * if the stream is running, or -EINVAL if the CPU is not online.
+ */
+int amdtp_stream_set_offload(struct amdtp_stream *s, int cpu)
+{
+	if (amdtp_stream_running(s))
+		return -EBUSY;
+	if ((cpu >= 0) && ((cpu >= nr_cpu_ids) || !cpu_online(cpu)))
+		return -EINVAL;
+
+	s->offload.cpu = cpu;
+	return 0;
+}
+EXPORT_SYMBOL(amdtp_stream_set_offload);
+
+static void thru_register(struct amdtp_stream *s)
+{
+	mutex_lock(&thru_mutex);
+	list_add_tail(&s->thru_list, &thru_streams);
+	mutex_unlock(&thru_mutex);
+}
+
+/* disconnect MIDI thru from/toward this stream, then wait for the callbacks */
+static void thru_unregister(struct amdtp_stream *s)
+{
+	struct amdtp_stream *t;
+	unsigned int p;
+	bool disconnected = false;
+
+	mutex_lock(&thru_mutex);
+	list_del_init(&s->thru_list);
+	for (p = 0; p < ARRAY_SIZE(s->midi_thru); p++)
+		RCU_INIT_POINTER(s->midi_thru[p].stream, NULL);
+	list_for_each_entry(t, &thru_streams, thru_list) {
+		for (p = 0; p < ARRAY_SIZE(t->midi_thru); p++) {
+			if (rcu_access_pointer(t->midi_thru[p].stream) != s)
+				continue;
+			RCU_INIT_POINTER(t->midi_thru[p].stream, NULL);
+			disconnected = true;
+		}
+	}
+	mutex_unlock(&thru_mutex);
+
+	if (disconnected)
+		synchronize_rcu();
+}
+
 /**
  * amdtp_stream_start - start transferring packets
  * @s: the AMDTP stream to start
@@ -968,7 +2497,7 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 		[CIP_SFC_88200]  = {  0,   67 },
 		[CIP_SFC_176400] = {  0,   67 },
 	};
-	unsigned int header_size;
+	unsigned int header_size, i;
 	enum dma_data_direction dir;
 	int type, err;
 
@@ -984,6 +2513,11 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 	s->syt_offset_state = initial_state[s->sfc].syt_offset;
 	s->last_syt_offset = TICKS_PER_CYCLE;
 
+	/* discard MIDI thru bytes queued while stopping */
+	spin_lock_irq(&s->thru_fifo.lock);
+	memcpy(s->thru_fifo.tail, s->thru_fifo.head, sizeof(s->thru_fifo.tail));
+	spin_unlock_irq(&s->thru_fifo.lock);
+
 	/* initialize packet buffer */
 	if (s->direction == AMDTP_IN_STREAM) {
 		dir = DMA_FROM_DEVICE;
@@ -999,17 +2533,57 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 	if (err < 0)
 		goto err_unlock;
 
+	/*
+	 * The pages are allocated by firewire-core without any hint, thus just
+	 * count them. The other buffers are placed near to the controller.
+	 */
+	s->node = dev_to_node(fw_parent_device(s->unit)->card->device);
+	s->local_pages = 0;
+	for (i = 0; i < s->buffer.iso_buffer.page_count; i++) {
+		if (page_to_nid(s->buffer.iso_buffer.pages[i]) == s->node)
+			s->local_pages++;
+	}
+
 	/* for sorting transmitted packets */
 	if (s->direction == AMDTP_IN_STREAM) {
+		s->sorting = !!(s->flags & CIP_OUT_OF_ORDER);
+		s->last_dbc = -1;
 		s->remain_packets = 0;
-		s->sort_table = kzalloc(sizeof(struct sort_table) *
-					QUEUE_LENGTH, GFP_KERNEL);
-		if (s->sort_table == NULL)
-			return -ENOMEM;
-		s->left_packets = kzalloc(amdtp_stream_get_max_payload(s) *
-					  QUEUE_LENGTH / 4, GFP_KERNEL);
+		s->sort_table = kzalloc_node(sizeof(struct sort_table) *
+					     QUEUE_LENGTH, GFP_KERNEL, s->node);
+		s->left_packets = kzalloc_node(amdtp_stream_get_max_payload(s) *
+					       QUEUE_LENGTH / 4, GFP_KERNEL,
+					       s->node);
+		if ((s->sort_table == NULL) || (s->left_packets == NULL)) {
+			err = -ENOMEM;
+			goto err_sort;
+		}
+	} else {
+		s->packet_blocks = kzalloc_node(sizeof(unsigned int) *
+						QUEUE_LENGTH, GFP_KERNEL,
+						s->node);
+		s->monitor_mix = kmalloc_node(amdtp_stream_get_max_payload(s),
+					      GFP_KERNEL, s->node);
+		s->midi_lanes = kzalloc_node(sizeof(struct amdtp_midi_lane) *
+					     ARRAY_SIZE(s->midi), GFP_KERNEL,
+					     s->node);
+		if ((s->packet_blocks == NULL) || (s->monitor_mix == NULL) ||
+		    (s->midi_lanes == NULL)) {
+			err = -ENOMEM;
+			goto err_sort;
+		}
+	}
+
+	s->clock = cycle_clock_get(fw_parent_device(s->unit)->card);
+	if (IS_ERR(s->clock)) {
+		err = PTR_ERR(s->clock);
+		goto err_sort;
 	}
 
+	err = offload_init(s);
+	if (err < 0)
+		goto err_clock;
+
 	s->context = fw_iso_context_create(fw_parent_device(s->unit)->card,
 					   type, channel, speed, header_size,
 					   amdtp_stream_callback, s);
@@ -1018,7 +2592,7 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 		if (err == -EBUSY)
 			dev_err(&s->unit->device,
 				"no free stream on this controller\n");
-		goto err_buffer;
+		goto err_offload;
 	}
 
 	amdtp_stream_update(s);
@@ -1032,6 +2606,7 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 		if (err < 0)
 			goto err_context;
 	} while (s->packet_index > 0);
+	s->pending_packets = QUEUE_LENGTH;
 
 	/*
 	 * NOTE: TAG1 matches CIP. This just affects in stream.
@@ -1039,11 +2614,16 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 	 */
 	s->data_block_counter = 0;
 	s->callbacked = false;
+	s->out_cycle.known = false;
+	s->out_cycle.skipped = 0;
 	err = fw_iso_context_start(s->context, -1, 0,
 			FW_ISO_CONTEXT_MATCH_TAG0 | FW_ISO_CONTEXT_MATCH_TAG1);
 	if (err < 0)
 		goto err_context;
 
+	thru_register(s);
+	watchdog_start(s);
+
 	mutex_unlock(&s->mutex);
 
 	return 0;
@@ -1051,7 +2631,21 @@ int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed)
 err_context:
 	fw_iso_context_destroy(s->context);
 	s->context = ERR_PTR(-1);
-err_buffer:
+err_offload:
+	offload_destroy(s);
+err_clock:
+	cycle_clock_put(s->clock);
+err_sort:
+	kfree(s->sort_table);
+	s->sort_table = NULL;
+	kfree(s->left_packets);
+	s->left_packets = NULL;
+	kfree(s->packet_blocks);
+	s->packet_blocks = NULL;
+	kfree(s->monitor_mix);
+	s->monitor_mix = NULL;
+	kfree(s->midi_lanes);
+	s->midi_lanes = NULL;
 	iso_packets_buffer_destroy(&s->buffer, s->unit);
 err_unlock:
 	mutex_unlock(&s->mutex);
@@ -1074,53 +2668,360 @@ unsigned long amdtp_stream_pcm_pointer(struct amdtp_stream *s)
 	else
 		s->pointer_flush = true;
 
-	return ACCESS_ONCE(s->pcm_buffer_pointer);
+	return ACCESS_ONCE(s->pcm_buffer_pointer);
+}
+EXPORT_SYMBOL(amdtp_stream_pcm_pointer);
+
+/**
+ * amdtp_stream_pcm_reattachable - check whether PCM can be attached again
+ * @s: the AMDTP stream
+ * @rate: the sampling rate of the PCM substream, or 0 for any rate
+ *
+ * After an XRUN, the PCM substream is detached but the isochronous stream
+ * keeps running and transfers silence. If this function returns true, the
+ * PCM device's .prepare callback can skip restarting the stream and just call
+ * amdtp_stream_pcm_prepare().
+ */
+bool amdtp_stream_pcm_reattachable(struct amdtp_stream *s, unsigned int rate)
+{
+	unsigned int curr_rate;
+
+	if (!amdtp_stream_running(s) || amdtp_streaming_error(s))
+		return false;
+
+	if (rate == 0)
+		return true;
+
+	curr_rate = amdtp_rate_table[s->sfc];
+	if (s->dual_wire)
+		curr_rate *= 2;
+
+	return rate == curr_rate;
+}
+EXPORT_SYMBOL(amdtp_stream_pcm_reattachable);
+
+/**
+ * amdtp_stream_update - update the stream after a bus reset
+ * @s: the AMDTP stream
+ */
+void amdtp_stream_update(struct amdtp_stream *s)
+{
+	ACCESS_ONCE(s->source_node_id_field) =
+		(fw_parent_device(s->unit)->card->node_id & 0x3f) << 24;
+}
+EXPORT_SYMBOL(amdtp_stream_update);
+
+/**
+ * amdtp_stream_stop - stop sending packets
+ * @s: the AMDTP stream to stop
+ *
+ * All PCM and MIDI devices of the stream must be stopped before the stream
+ * itself can be stopped.
+ */
+void amdtp_stream_stop(struct amdtp_stream *s)
+{
+	mutex_lock(&s->mutex);
+
+	if (!amdtp_stream_running(s)) {
+		mutex_unlock(&s->mutex);
+		return;
+	}
+
+	thru_unregister(s);
+	cancel_delayed_work_sync(&s->watchdog.work);
+
+	fw_iso_context_stop(s->context);
+	offload_destroy(s);
+	tasklet_kill(&s->period_tasklet);
+	fw_iso_context_destroy(s->context);
+	s->context = ERR_PTR(-1);
+	iso_packets_buffer_destroy(&s->buffer, s->unit);
+
+	kfree(s->sort_table);
+	s->sort_table = NULL;
+	kfree(s->left_packets);
+	s->left_packets = NULL;
+	kfree(s->packet_blocks);
+	s->packet_blocks = NULL;
+	kfree(s->monitor_mix);
+	s->monitor_mix = NULL;
+	/* flushed, the bytes not sent yet are still in rawmidi */
+	kfree(s->midi_lanes);
+	s->midi_lanes = NULL;
+	cycle_clock_put(s->clock);
+
+	s->callbacked = false;
+
+	mutex_unlock(&s->mutex);
+}
+EXPORT_SYMBOL(amdtp_stream_stop);
+
+/*
+ * Until the PCM device starts, PCM channels in queued packets carry silence
+ * and the monitor mix only. Add the mix back onto the rewritten samples.
+ */
+static void restore_monitor_mix(struct amdtp_stream *s, __be32 *buffer,
+				const __be32 *mix, unsigned int data_blocks)
+{
+	unsigned int i, c, pos;
+	s32 monitored;
+	s64 sample;
+
+	for (i = 0; i < data_blocks; i++) {
+		for (c = 0; c < s->pcm_channels; c++) {
+			pos = s->pcm_positions[c];
+			monitored = sign_extend32(be32_to_cpu(mix[pos]), 23);
+			if (monitored == 0)
+				continue;
+
+			sample = sign_extend32(be32_to_cpu(buffer[pos]), 23);
+			sample = clamp_t(s64, sample + monitored,
+					 -0x800000, 0x7fffff);
+			buffer[pos] = cpu_to_be32(((u32)sample & 0x00ffffff) |
+						  0x40000000);
+		}
+		buffer += s->data_block_quadlets;
+		mix += s->data_block_quadlets;
+	}
+}
+
+/*
+ * Fill PCM samples into the newest packets in the queue, as many as the
+ * application has written. The headers are kept as they are, thus DBC and SYT
+ * stay continuous, and the monitor mix is kept as well.
+ */
+static void rewrite_queued_packets(struct amdtp_stream *s,
+				   struct snd_pcm_substream *pcm)
+{
+	snd_pcm_uframes_t avail, frames;
+	unsigned int i, index, packets, data_blocks;
+	__be32 *buffer;
+
+	if (s->pending_packets <= IMMEDIATE_START_MARGIN)
+		return;
+
+	avail = snd_pcm_playback_hw_avail(pcm->runtime);
+	frames = 0;
+	for (packets = 0;
+	     packets < s->pending_packets - IMMEDIATE_START_MARGIN;
+	     packets++) {
+		index = (s->packet_index + QUEUE_LENGTH - 1 - packets) %
+								QUEUE_LENGTH;
+		data_blocks = s->packet_blocks[index];
+		if (s->dual_wire)
+			data_blocks *= 2;
+		if (frames + data_blocks > avail)
+			break;
+		frames += data_blocks;
+	}
+
+	for (i = packets; i > 0; i--) {
+		index = (s->packet_index + QUEUE_LENGTH - i) % QUEUE_LENGTH;
+		data_blocks = s->packet_blocks[index];
+		if (data_blocks == 0)
+			continue;
+
+		buffer = (__be32 *)s->buffer.packets[index].buffer + 2;
+		if (!s->dual_wire)
+			memcpy(s->monitor_mix, buffer,
+			       data_blocks * s->data_block_quadlets * 4);
+
+		s->transfer_samples(s, pcm, buffer, data_blocks);
+		update_pcm_pointers(s, pcm, data_blocks);
+
+		/* mix_monitor() skips streams in dual wire mode */
+		if (!s->dual_wire)
+			restore_monitor_mix(s, buffer, s->monitor_mix,
+					    data_blocks);
+	}
+}
+
+/**
+ * amdtp_stream_pcm_trigger - start/stop playback from a PCM device
+ * @s: the AMDTP stream
+ * @pcm: the PCM device to be started, or %NULL to stop the current device
+ *
+ * Call this function on a running isochronous stream to enable the actual
+ * transmission of PCM data.  This function should be called from the PCM
+ * device's .trigger callback.
+ *
+ * For playback, the samples are also written into the packets which are
+ * already queued but not transmitted yet, thus the first sample goes out
+ * within a few cycles instead of after the whole queue. Like the offloading,
+ * this writes payloads after queueing and relies on cache-coherent DMA.
+ *
+ * If the start is armed by amdtp_stream_schedule_pcm_start(), the PCM device
+ * is attached at the scheduled cycle instead.
+ */
+void amdtp_stream_pcm_trigger(struct amdtp_stream *s,
+			      struct snd_pcm_substream *pcm)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->linked_pcm = NULL;
+	if (s->direction == AMDTP_OUT_STREAM) {
+		s->scheduled.pcm = NULL;
+		if (pcm && s->scheduled.armed) {
+			s->scheduled.armed = false;
+			s->scheduled.pcm = pcm;
+			spin_unlock_irqrestore(&s->lock, flags);
+			return;
+		}
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (!pcm || (s->direction == AMDTP_IN_STREAM) ||
+	    !amdtp_stream_running(s) || (s->offload.ring != NULL)) {
+		ACCESS_ONCE(s->pcm) = pcm;
+		return;
+	}
+
+	/* update the number of packets which the controller has not sent */
+	fw_iso_context_flush_completions(s->context);
+
+	spin_lock_irqsave(&s->lock, flags);
+	/* set before period tasklet is scheduled */
+	ACCESS_ONCE(s->pcm) = pcm;
+	if (!amdtp_streaming_error(s))
+		rewrite_queued_packets(s, pcm);
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+EXPORT_SYMBOL(amdtp_stream_pcm_trigger);
+
+/**
+ * amdtp_stream_pcm_link_trigger - start capture and playback at paired packets
+ * @in: the AMDTP stream to capture
+ * @capture: the PCM device for capture, or %NULL
+ * @out: the AMDTP stream to playback
+ * @playback: the PCM device for playback, or %NULL
+ *
+ * Call this function from .trigger callback for substreams linked by
+ * snd_pcm_link(). When @out is the sync slave of @in in blocking mode, both
+ * PCM devices are attached in the callback of @in just before processing the
+ * same incoming packet, thus the first playback frame has the SYT of the first
+ * capture frame plus the transfer delay. In the other modes, the PCM devices
+ * are attached immediately.
+ */
+void amdtp_stream_pcm_link_trigger(struct amdtp_stream *in,
+				   struct snd_pcm_substream *capture,
+				   struct amdtp_stream *out,
+				   struct snd_pcm_substream *playback)
+{
+	unsigned long flags;
+
+	if (!amdtp_stream_running(in) || !amdtp_stream_running(out) ||
+	    !(in->flags & CIP_BLOCKING) || !(in->flags & CIP_SYNC_TO_DEVICE) ||
+	    (in->sync_slave != out) ||
+	    (in->offload.ring != NULL) || (out->offload.ring != NULL)) {
+		in->link_aligned = false;
+		amdtp_stream_pcm_trigger(in, capture);
+		amdtp_stream_pcm_trigger(out, playback);
+		return;
+	}
+
+	spin_lock_irqsave(&in->lock, flags);
+	spin_lock(&out->lock);
+	in->linked_pcm = capture;
+	out->linked_pcm = playback;
+	in->link_ticks = in->transfer_delay;
+	in->link_aligned = true;
+	spin_unlock(&out->lock);
+	spin_unlock_irqrestore(&in->lock, flags);
 }
-EXPORT_SYMBOL(amdtp_stream_pcm_pointer);
+EXPORT_SYMBOL(amdtp_stream_pcm_link_trigger);
 
 /**
- * amdtp_stream_update - update the stream after a bus reset
- * @s: the AMDTP stream
+ * amdtp_stream_get_link_offset - get the offset at the last linked start
+ * @in: the AMDTP stream to capture
+ * @ticks: the difference of SYT between the first frames, in 24.576 MHz ticks
+ * @frames: the difference in PCM frames
+ *
+ * Returns -ENODATA if the last linked start was not aligned.
  */
-void amdtp_stream_update(struct amdtp_stream *s)
+int amdtp_stream_get_link_offset(struct amdtp_stream *in,
+				 unsigned int *ticks, unsigned int *frames)
 {
-	ACCESS_ONCE(s->source_node_id_field) =
-		(fw_parent_device(s->unit)->card->node_id & 0x3f) << 24;
+	unsigned int rate;
+
+	if (!in->link_aligned)
+		return -ENODATA;
+
+	rate = amdtp_rate_table[in->sfc];
+	if (in->dual_wire)
+		rate *= 2;
+
+	*ticks = in->link_ticks;
+	*frames = div_u64((u64)in->link_ticks * rate + 12288000, 24576000);
+
+	return 0;
 }
-EXPORT_SYMBOL(amdtp_stream_update);
+EXPORT_SYMBOL(amdtp_stream_get_link_offset);
 
 /**
- * amdtp_stream_stop - stop sending packets
- * @s: the AMDTP stream to stop
+ * amdtp_stream_schedule_pcm_start - arm the next PCM start at a bus cycle
+ * @s: the AMDTP stream to transmit packets
+ * @cycle_time: the cycle in the format of CYCLE_TIME register. The lowest
+ *		three bits of the second field and the cycle field are used.
  *
- * All PCM and MIDI devices of the stream must be stopped before the stream
- * itself can be stopped.
+ * The next trigger after this call doesn't attach the PCM device immediately.
+ * The first sample goes in the first data block of the packet transmitted at
+ * the cycle. The trigger should come earlier than the cycle by the depth of
+ * queue, otherwise PCM starts in the next packet and it's counted as missed.
+ * The arm is cleared when the PCM device is prepared.
  */
-void amdtp_stream_stop(struct amdtp_stream *s)
+int amdtp_stream_schedule_pcm_start(struct amdtp_stream *s, u32 cycle_time)
 {
-	mutex_lock(&s->mutex);
+	unsigned int cycle = (cycle_time >> 12) & 0x1fff;
+	unsigned long flags;
 
-	if (!amdtp_stream_running(s)) {
-		mutex_unlock(&s->mutex);
-		return;
-	}
+	if ((s->direction != AMDTP_OUT_STREAM) || (cycle >= 8000))
+		return -EINVAL;
+	if (!amdtp_stream_running(s))
+		return -EBADFD;
+	if (s->offload.ring != NULL)
+		return -EOPNOTSUPP;
 
-	tasklet_kill(&s->period_tasklet);
-	fw_iso_context_stop(s->context);
-	fw_iso_context_destroy(s->context);
-	s->context = ERR_PTR(-1);
-	iso_packets_buffer_destroy(&s->buffer, s->unit);
+	spin_lock_irqsave(&s->lock, flags);
+	s->scheduled.cycle = ((cycle_time >> 25) & 0x07) * 8000 + cycle;
+	s->scheduled.armed = true;
+	spin_unlock_irqrestore(&s->lock, flags);
 
-	if (s->sort_table != NULL)
-		kfree(s->sort_table);
-	if (s->left_packets != NULL)
-		kfree(s->left_packets);
+	return 0;
+}
+EXPORT_SYMBOL(amdtp_stream_schedule_pcm_start);
 
-	s->callbacked = false;
+/**
+ * amdtp_stream_alloc_pcm_buffer - allocate the buffer of a PCM substream
+ * @s: the AMDTP stream which transfers the substream
+ * @pcm: the PCM substream
+ * @size: the size of buffer, in bytes
+ *
+ * This can replace snd_pcm_lib_alloc_vmalloc_buffer(). The buffer is
+ * allocated on the NUMA node of the FireWire controller, where the packets
+ * are processed, and released by snd_pcm_lib_free_vmalloc_buffer().
+ */
+int amdtp_stream_alloc_pcm_buffer(struct amdtp_stream *s,
+				  struct snd_pcm_substream *pcm, size_t size)
+{
+	struct snd_pcm_runtime *runtime = pcm->runtime;
 
-	mutex_unlock(&s->mutex);
+	if (!local_pcm_buffer)
+		return snd_pcm_lib_alloc_vmalloc_buffer(pcm, size);
+
+	if (runtime->dma_area != NULL) {
+		if (runtime->dma_bytes >= size)
+			return 0;	/* already large enough */
+		vfree(runtime->dma_area);
+	}
+	runtime->dma_area = vzalloc_node(PAGE_ALIGN(size),
+			dev_to_node(fw_parent_device(s->unit)->card->device));
+	if (runtime->dma_area == NULL)
+		return -ENOMEM;
+	runtime->dma_bytes = size;
+	return 1;
 }
-EXPORT_SYMBOL(amdtp_stream_stop);
+EXPORT_SYMBOL(amdtp_stream_alloc_pcm_buffer);
 
 /**
  * amdtp_stream_pcm_abort - abort the running PCM device
@@ -1134,6 +3035,10 @@ void amdtp_stream_pcm_abort(struct amdtp_stream *s)
 	struct snd_pcm_substream *pcm;
 
 	pcm = ACCESS_ONCE(s->pcm);
+	if (pcm == NULL)
+		pcm = ACCESS_ONCE(s->scheduled.pcm);
+	if (pcm == NULL)
+		pcm = ACCESS_ONCE(s->linked_pcm);
 	if (pcm) {
 		snd_pcm_stream_lock_irq(pcm);
 		if (snd_pcm_running(pcm))
@@ -1158,6 +3063,117 @@ bool amdtp_stream_wait_callback(struct amdtp_stream *s)
 }
 EXPORT_SYMBOL(amdtp_stream_wait_callback);
 
+/**
+ * amdtp_duplex_init - initialize the state of duplex streams
+ * @d: the duplex streams
+ * @tx: the stream transmitted by the device
+ * @rx: the stream received by the device
+ * @mutex: the driver's mutex to serialize starting and stopping the streams
+ */
+void amdtp_duplex_init(struct amdtp_duplex *d, struct amdtp_stream *tx,
+		       struct amdtp_stream *rx, struct mutex *mutex)
+{
+	d->tx = tx;
+	d->rx = rx;
+	d->mutex = mutex;
+	d->starting = 0;
+	init_waitqueue_head(&d->started);
+	seqcount_init(&d->seq);
+	memset(&d->status, 0, sizeof(d->status));
+}
+EXPORT_SYMBOL(amdtp_duplex_init);
+
+/**
+ * amdtp_duplex_lock - take the driver's mutex to start the streams
+ * @d: the duplex streams
+ *
+ * This waits, without the mutex, till the other thread finishes starting the
+ * streams. Use this to start the streams or to destroy the connections.
+ */
+void amdtp_duplex_lock(struct amdtp_duplex *d)
+{
+	mutex_lock(d->mutex);
+	while (d->starting > 0) {
+		mutex_unlock(d->mutex);
+		wait_event(d->started, ACCESS_ONCE(d->starting) == 0);
+		mutex_lock(d->mutex);
+	}
+}
+EXPORT_SYMBOL(amdtp_duplex_lock);
+
+/**
+ * amdtp_duplex_wait_callback - wait for the first callback without the mutex
+ * @d: the duplex streams
+ * @s: the started stream, one of the duplex streams
+ *
+ * Call this with the driver's mutex held. The mutex is released during the
+ * wait, thus the other threads can handle bus reset or read the state.
+ *
+ * Returns zero on success, -ETIMEDOUT if the stream is not callbacked, or
+ * -EBUSY if the stream has been stopped by the other thread. In both cases
+ * the caller should stop the streams and break the connections.
+ */
+int amdtp_duplex_wait_callback(struct amdtp_duplex *d, struct amdtp_stream *s)
+{
+	d->starting++;
+	amdtp_duplex_publish(d, amdtp_rate_table[s->sfc]);
+	mutex_unlock(d->mutex);
+
+	amdtp_stream_wait_callback(s);
+
+	mutex_lock(d->mutex);
+	d->starting--;
+	amdtp_duplex_publish(d, 0);
+	if (d->starting == 0)
+		wake_up(&d->started);
+
+	if (!amdtp_stream_running(s))
+		return -EBUSY;
+	if (!s->callbacked)
+		return -ETIMEDOUT;
+	return 0;
+}
+EXPORT_SYMBOL(amdtp_duplex_wait_callback);
+
+/**
+ * amdtp_duplex_publish - update the snapshot of duplex streams
+ * @d: the duplex streams
+ * @rate: the sampling rate of the started streams, or zero to keep it
+ *
+ * Call this with the driver's mutex held.
+ */
+void amdtp_duplex_publish(struct amdtp_duplex *d, unsigned int rate)
+{
+	write_seqcount_begin(&d->seq);
+	if (rate > 0)
+		d->status.rate = rate;
+	d->status.starting = d->starting > 0;
+	d->status.tx_running = amdtp_stream_running(d->tx);
+	d->status.rx_running = amdtp_stream_running(d->rx);
+	write_seqcount_end(&d->seq);
+}
+EXPORT_SYMBOL(amdtp_duplex_publish);
+
+/**
+ * amdtp_duplex_read_status - get a snapshot of duplex streams
+ * @d: the duplex streams
+ * @status: the buffer to store the snapshot
+ *
+ * This never blocks even if the other thread is starting streams. The rate is
+ * the one used at the last start and zero if streams have never started.
+ */
+void amdtp_duplex_read_status(struct amdtp_duplex *d,
+			      struct amdtp_duplex_status *status)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&d->seq);
+		*status = d->status;
+	} while (read_seqcount_retry(&d->seq, seq));
+}
+EXPORT_SYMBOL(amdtp_duplex_read_status);
+
 /**
  * amdtp_stream_midi_running - check any MIDI streams are running or not
  * @s: the AMDTP stream
@@ -1173,3 +3189,535 @@ bool amdtp_stream_midi_running(struct amdtp_stream *s)
 	return false;
 }
 EXPORT_SYMBOL(amdtp_stream_midi_running);
+
+/**
+ * amdtp_stream_proc_read - print the state of stream
+ * @s: the AMDTP stream
+ * @buffer: the buffer of proc node
+ */
+void amdtp_stream_proc_read(struct amdtp_stream *s,
+			    struct snd_info_buffer *buffer)
+{
+	if (!amdtp_stream_running(s)) {
+		snd_iprintf(buffer, "\tstopped\n");
+		return;
+	}
+
+	snd_iprintf(buffer, "\tmode: %s\n",
+		    (s->flags & CIP_BLOCKING) ? "blocking" : "non-blocking");
+	snd_iprintf(buffer, "\tPCM: %s, MIDI: %s\n",
+		    amdtp_stream_pcm_running(s) ? "running" : "stopped",
+		    amdtp_stream_midi_running(s) ? "running" : "stopped");
+	if (s->direction == AMDTP_OUT_STREAM) {
+		snd_iprintf(buffer, "\tMIDI thru overruns: %u\n",
+			    s->thru_fifo.overruns);
+		snd_iprintf(buffer, "\tmissed scheduled starts: %u\n",
+			    s->scheduled.missed);
+		snd_iprintf(buffer, "\tskipped cycles: %u\n",
+			    s->out_cycle.skipped);
+	}
+
+	if (s->direction == AMDTP_IN_STREAM)
+		snd_iprintf(buffer, "\tpackets: %s\n",
+			    s->sorting ? "sorted" : "in order");
+
+	snd_iprintf(buffer, "\tstalls: %u%s\n", s->watchdog.stalls,
+		    s->watchdog.stalled ? " (stalled now)" : "");
+
+	snd_iprintf(buffer, "\tNUMA node: %d, packet pages on it: %u/%u\n",
+		    s->node, s->local_pages, s->buffer.iso_buffer.page_count);
+
+	if (s->offload.ring == NULL)
+		return;
+	snd_iprintf(buffer, "\toffload CPU: %d\n", s->offload.target);
+	snd_iprintf(buffer, "\toffload latency: %u us (avg), %u us (max)\n",
+		    s->offload.latency_avg, s->offload.latency_max);
+	snd_iprintf(buffer, "\toffload overruns: %u\n", s->offload.overruns);
+}
+EXPORT_SYMBOL(amdtp_stream_proc_read);
+
+/**
+ * amdtp_stream_read_meter - read the software meters of PCM channels
+ * @s: the AMDTP stream
+ * @meter: the buffer to store the peak and RMS of each channel
+ *
+ * The meters are measured while transferring PCM samples if 'software_meter'
+ * option is enabled, and updated at every period.
+ */
+void amdtp_stream_read_meter(struct amdtp_stream *s, struct amdtp_meter *meter)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&s->meter.seq);
+		*meter = s->meter.snapshot;
+	} while (read_seqcount_retry(&s->meter.seq, seq));
+}
+EXPORT_SYMBOL(amdtp_stream_read_meter);
+
+static int meter_ctl_info(struct snd_kcontrol *kctl,
+			  struct snd_ctl_elem_info *einf)
+{
+	einf->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	einf->count = AMDTP_MAX_CHANNELS_FOR_PCM * 2;
+	einf->value.integer.min = 0;
+	einf->value.integer.max = 0x800000;
+
+	return 0;
+}
+static int meter_ctl_get(struct snd_kcontrol *kctl,
+			 struct snd_ctl_elem_value *uval)
+{
+	struct amdtp_stream *s = snd_kcontrol_chip(kctl);
+	struct amdtp_meter *meter;
+	unsigned int c;
+
+	meter = kmalloc(sizeof(struct amdtp_meter), GFP_KERNEL);
+	if (meter == NULL)
+		return -ENOMEM;
+
+	amdtp_stream_read_meter(s, meter);
+	for (c = 0; c < AMDTP_MAX_CHANNELS_FOR_PCM; c++) {
+		uval->value.integer.value[c * 2] = meter->peak[c];
+		uval->value.integer.value[c * 2 + 1] = meter->rms[c];
+	}
+
+	kfree(meter);
+	return 0;
+}
+static struct snd_kcontrol_new meter_ctl = {
+	.iface	= SNDRV_CTL_ELEM_IFACE_PCM,
+	.access	= SNDRV_CTL_ELEM_ACCESS_READ |
+		  SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info	= meter_ctl_info,
+	.get	= meter_ctl_get
+};
+
+/**
+ * amdtp_stream_add_meter_ctl - add a control element for software meters
+ * @s: the AMDTP stream
+ * @card: the sound card
+ * @name: the name of the element
+ *
+ * The element has peak and RMS pairs of each PCM channel, in 24 bit scale.
+ */
+int amdtp_stream_add_meter_ctl(struct amdtp_stream *s, struct snd_card *card,
+			       const char *name)
+{
+	struct snd_kcontrol *kctl;
+
+	kctl = snd_ctl_new1(&meter_ctl, s);
+	if (kctl == NULL)
+		return -ENOMEM;
+	strlcpy(kctl->id.name, name, sizeof(kctl->id.name));
+
+	return snd_ctl_add(card, kctl);
+}
+EXPORT_SYMBOL(amdtp_stream_add_meter_ctl);
+
+/**
+ * amdtp_stream_set_monitor - replace routes for direct monitoring
+ * @s: the AMDTP stream to capture from
+ * @routes: an array of routes, or NULL
+ * @count: the number of routes, or zero to disable monitoring
+ *
+ * Each route adds a captured PCM channel, multiplied by 16.16 fixed point
+ * gain, into a PCM channel of the sync slave. This works only when the slave
+ * is driven by @s, in blocking mode with CIP_SYNC_TO_DEVICE.
+ */
+int amdtp_stream_set_monitor(struct amdtp_stream *s,
+			     const struct amdtp_monitor_route *routes,
+			     unsigned int count)
+{
+	struct amdtp_monitor *new, *old;
+	unsigned int i;
+
+	if ((s->direction != AMDTP_IN_STREAM) ||
+	    (count > AMDTP_MAX_MONITOR_ROUTES))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if ((routes[i].src >= AMDTP_MAX_CHANNELS_FOR_PCM) ||
+		    (routes[i].dst >= AMDTP_MAX_CHANNELS_FOR_PCM) ||
+		    (routes[i].gain > AMDTP_MONITOR_GAIN_UNITY * 16))
+			return -EINVAL;
+	}
+
+	if (count > 0) {
+		new = kmalloc(sizeof(struct amdtp_monitor) +
+			      sizeof(struct amdtp_monitor_route) * count,
+			      GFP_KERNEL);
+		if (new == NULL)
+			return -ENOMEM;
+		new->count = count;
+		memcpy(new->routes, routes,
+		       sizeof(struct amdtp_monitor_route) * count);
+	} else {
+		new = NULL;
+	}
+
+	mutex_lock(&s->mutex);
+	old = rcu_dereference_protected(s->monitor,
+					lockdep_is_held(&s->mutex));
+	rcu_assign_pointer(s->monitor, new);
+	mutex_unlock(&s->mutex);
+
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+EXPORT_SYMBOL(amdtp_stream_set_monitor);
+
+/**
+ * amdtp_stream_set_midi_thru - route a MIDI port to a port of another stream
+ * @s: the AMDTP stream to receive MIDI messages
+ * @port: the port of @s
+ * @dst_name: the name of FireWire device which has the destination, or NULL
+ *	      to disconnect
+ * @dst_port: the port of the destination
+ *
+ * Bytes received on @port are queued into the FIFO for @dst_port of the
+ * outgoing stream to the device named @dst_name, in packet callbacks. They are
+ * transmitted prior to bytes from rawmidi. Both streams should be running,
+ * and the route is disconnected when either of them stops.
+ */
+int amdtp_stream_set_midi_thru(struct amdtp_stream *s, unsigned int port,
+			       const char *dst_name, unsigned int dst_port)
+{
+	struct amdtp_stream *t, *dst = NULL;
+	int err = 0;
+
+	if ((s->direction != AMDTP_IN_STREAM) ||
+	    (port >= ARRAY_SIZE(s->midi_thru)) ||
+	    (dst_port >= ARRAY_SIZE(s->midi_thru)))
+		return -EINVAL;
+
+	mutex_lock(&thru_mutex);
+
+	if (list_empty(&s->thru_list)) {
+		err = -EBADFD;
+		goto end;
+	}
+
+	if (dst_name != NULL) {
+		list_for_each_entry(t, &thru_streams, thru_list) {
+			if ((t->direction == AMDTP_OUT_STREAM) &&
+			    !strcmp(dev_name(&fw_parent_device(t->unit)->device),
+				    dst_name)) {
+				dst = t;
+				break;
+			}
+		}
+		if (dst == NULL) {
+			err = -ENODEV;
+			goto end;
+		}
+		ACCESS_ONCE(s->midi_thru[port].port) = dst_port;
+	}
+	rcu_assign_pointer(s->midi_thru[port].stream, dst);
+end:
+	mutex_unlock(&thru_mutex);
+	return err;
+}
+EXPORT_SYMBOL(amdtp_stream_set_midi_thru);
+
+/**
+ * amdtp_stream_set_midi_clock - generate MIDI clock and MTC on a port
+ * @s: the AMDTP stream to transmit MIDI messages
+ * @port: the port of @s
+ * @params: the tempo and the time code to start at
+ *
+ * The messages are generated at the data block which they belong to. Clock,
+ * Start and Stop are sent in the next slot of @port, ahead of bytes from MIDI
+ * thru and rawmidi. MTC quarter frames are sent between messages, after the
+ * rawmidi bytes peeked before them. Start is sent when the clock is enabled,
+ * and Stop when it is disabled. MTC starts from the given time again each time
+ * this is called.
+ *
+ * Returns -EINVAL if the ticks and quarter frames do not fit into the slots of
+ * @port at the current sampling rate.
+ */
+int amdtp_stream_set_midi_clock(struct amdtp_stream *s, unsigned int port,
+				const struct amdtp_midi_clock_params *params)
+{
+	struct amdtp_midi_clock *new = NULL, *old;
+	unsigned int slots;
+	bool running;
+	u32 rem;
+	int err = 0;
+
+	if ((s->direction != AMDTP_OUT_STREAM) ||
+	    (port >= ARRAY_SIZE(s->midi_clock)))
+		return -EINVAL;
+
+	if (params->clock &&
+	    ((params->ppqn == 0) ||
+	     (params->ppqn > AMDTP_MIDI_CLOCK_PPQN_MAX) ||
+	     (params->tempo < AMDTP_MIDI_CLOCK_TEMPO_MIN) ||
+	     (params->tempo > AMDTP_MIDI_CLOCK_TEMPO_MAX)))
+		return -EINVAL;
+
+	if (params->mtc &&
+	    ((params->mtc_type >= ARRAY_SIZE(mtc_rates)) ||
+	     (params->mtc_start[0] >= 24) ||
+	     (params->mtc_start[1] >= 60) ||
+	     (params->mtc_start[2] >= 60) ||
+	     (params->mtc_start[3] >= mtc_rates[params->mtc_type].fps)))
+		return -EINVAL;
+
+	mutex_lock(&s->mutex);
+
+	/* each port has one of eight data blocks which can carry MIDI */
+	slots = amdtp_rate_table[s->sfc];
+	if (s->blocks_for_midi < slots / 8000)
+		slots = s->blocks_for_midi * 8000;
+	slots /= 8;
+	if (params->mtc)
+		slots -= DIV_ROUND_UP(8 * mtc_rates[params->mtc_type].num,
+				      mtc_rates[params->mtc_type].den);
+	if (params->clock &&
+	    ((u64)params->ppqn * 1000000 > (u64)slots * params->tempo)) {
+		err = -EINVAL;
+		goto end;
+	}
+
+	old = rcu_dereference_protected(s->midi_clock[port],
+					lockdep_is_held(&s->mutex));
+	running = (old != NULL) && old->clock;
+
+	if (params->clock || params->mtc || running) {
+		new = kzalloc(sizeof(struct amdtp_midi_clock), GFP_KERNEL);
+		if (new == NULL) {
+			err = -ENOMEM;
+			goto end;
+		}
+
+		new->clock = params->clock;
+		new->tempo = params->tempo;
+		new->ppqn = params->ppqn;
+		if (params->clock && !running) {
+			new->transport = 0xfa;
+		} else if (!params->clock && running) {
+			new->transport = 0xfc;
+		} else if (running) {
+			/* keep the position in the current tick */
+			new->clock_phase = div_u64_rem(
+					ACCESS_ONCE(old->clock_phase),
+					old->tempo, &rem) * new->tempo;
+			new->clock_phase += div_u64((u64)rem * new->tempo,
+						    old->tempo);
+		}
+
+		new->mtc = params->mtc;
+		new->mtc_type = params->mtc_type;
+		memcpy(new->time, params->mtc_start, sizeof(new->time));
+	}
+
+	rcu_assign_pointer(s->midi_clock[port], new);
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+end:
+	mutex_unlock(&s->mutex);
+	return err;
+}
+EXPORT_SYMBOL(amdtp_stream_set_midi_clock);
+
+static int hwdep_set_monitor(struct amdtp_stream *tx, void __user *arg)
+{
+	struct snd_firewire_monitor *monitor;
+	struct amdtp_monitor_route *routes = NULL;
+	unsigned int i;
+	int err;
+
+	monitor = memdup_user(arg, sizeof(struct snd_firewire_monitor));
+	if (IS_ERR(monitor))
+		return PTR_ERR(monitor);
+
+	if (monitor->count > SNDRV_FIREWIRE_MONITOR_ROUTES) {
+		err = -EINVAL;
+		goto end;
+	}
+
+	if (monitor->count > 0) {
+		routes = kcalloc(monitor->count,
+				 sizeof(struct amdtp_monitor_route),
+				 GFP_KERNEL);
+		if (routes == NULL) {
+			err = -ENOMEM;
+			goto end;
+		}
+	}
+	for (i = 0; i < monitor->count; i++) {
+		routes[i].src = monitor->routes[i].src;
+		routes[i].dst = monitor->routes[i].dst;
+		routes[i].gain = monitor->routes[i].gain;
+	}
+
+	err = amdtp_stream_set_monitor(tx, routes, monitor->count);
+	kfree(routes);
+end:
+	kfree(monitor);
+	return err;
+}
+
+static int hwdep_set_midi_thru(struct amdtp_stream *tx, void __user *arg)
+{
+	struct snd_firewire_midi_thru thru;
+	const char *dst_name = NULL;
+
+	if (copy_from_user(&thru, arg, sizeof(thru)))
+		return -EFAULT;
+
+	thru.device_name[sizeof(thru.device_name) - 1] = '\0';
+	if (thru.device_name[0] != '\0')
+		dst_name = thru.device_name;
+
+	return amdtp_stream_set_midi_thru(tx, thru.port,
+					  dst_name, thru.dst_port);
+}
+
+static int hwdep_set_midi_clock(struct amdtp_stream *rx, void __user *arg)
+{
+	struct snd_firewire_midi_clock clock;
+	struct amdtp_midi_clock_params params;
+
+	if (copy_from_user(&clock, arg, sizeof(clock)))
+		return -EFAULT;
+
+	if (clock.flags & ~(SNDRV_FIREWIRE_MIDI_CLOCK_TICK |
+			    SNDRV_FIREWIRE_MIDI_CLOCK_MTC))
+		return -EINVAL;
+
+	params.clock = !!(clock.flags & SNDRV_FIREWIRE_MIDI_CLOCK_TICK);
+	params.tempo = clock.tempo;
+	params.ppqn = clock.ppqn;
+	params.mtc = !!(clock.flags & SNDRV_FIREWIRE_MIDI_CLOCK_MTC);
+	params.mtc_type = clock.mtc_type;
+	memcpy(params.mtc_start, clock.mtc_start, sizeof(params.mtc_start));
+
+	return amdtp_stream_set_midi_clock(rx, clock.port, &params);
+}
+
+static int hwdep_get_cycle_clock(struct amdtp_stream *s, void __user *arg)
+{
+	struct snd_firewire_cycle_clock info;
+	struct cycle_clock_model model;
+	struct cycle_clock *clock;
+	int err;
+
+	clock = cycle_clock_get(fw_parent_device(s->unit)->card);
+	if (IS_ERR(clock))
+		return PTR_ERR(clock);
+	err = cycle_clock_read(clock, &model);
+	cycle_clock_put(clock);
+	if (err < 0)
+		return err;
+
+	memset(&info, 0, sizeof(info));
+	info.monotonic = model.ns;
+	info.cycle_time = model.cycle_time;
+	info.period = model.period;
+
+	if (copy_to_user(arg, &info, sizeof(info)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int hwdep_schedule_start(struct amdtp_stream *rx, void __user *arg)
+{
+	struct snd_firewire_schedule_start start;
+
+	if (copy_from_user(&start, arg, sizeof(start)))
+		return -EFAULT;
+
+	return amdtp_stream_schedule_pcm_start(rx, start.cycle_time);
+}
+
+static int hwdep_get_link_offset(struct amdtp_stream *tx, void __user *arg)
+{
+	struct snd_firewire_link_offset offset;
+	int err;
+
+	memset(&offset, 0, sizeof(offset));
+	err = amdtp_stream_get_link_offset(tx, &offset.ticks, &offset.frames);
+	if (err < 0)
+		return err;
+
+	if (copy_to_user(arg, &offset, sizeof(offset)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int hwdep_set_offload(struct amdtp_stream *tx, struct amdtp_stream *rx,
+			     struct mutex *mutex, void __user *arg)
+{
+	struct snd_firewire_offload offload;
+	struct amdtp_stream *s;
+	int err;
+
+	if (copy_from_user(&offload, arg, sizeof(offload)))
+		return -EFAULT;
+
+	if (offload.stream == SNDRV_FIREWIRE_OFFLOAD_CAPTURE)
+		s = tx;
+	else if (offload.stream == SNDRV_FIREWIRE_OFFLOAD_PLAYBACK)
+		s = rx;
+	else
+		return -EINVAL;
+
+	/* the stream does not start meanwhile */
+	mutex_lock(mutex);
+	err = amdtp_stream_set_offload(s, offload.cpu);
+	mutex_unlock(mutex);
+
+	return err;
+}
+
+/**
+ * amdtp_stream_hwdep_ioctl - handle the hwdep ioctls for a pair of streams
+ * @tx: the AMDTP stream to capture
+ * @rx: the AMDTP stream to playback
+ * @mutex: the mutex which the driver holds to start and stop the streams
+ * @cmd: the ioctl command
+ * @arg: the argument in user space
+ *
+ * Handles the ioctls which operate on the streams, SET_MONITOR, SET_MIDI_THRU,
+ * SET_MIDI_CLOCK, GET_CYCLE_CLOCK, SCHEDULE_START, GET_LINK_OFFSET and
+ * SET_OFFLOAD. SET_MONITOR and GET_LINK_OFFSET need the captured and the
+ * played packets to be paired, thus they are not available when @rx is in
+ * non-blocking mode. Returns -ENOIOCTLCMD for the others, then the driver
+ * handles them.
+ */
+int amdtp_stream_hwdep_ioctl(struct amdtp_stream *tx, struct amdtp_stream *rx,
+			     struct mutex *mutex, unsigned int cmd,
+			     void __user *arg)
+{
+	bool paired = rx->flags & CIP_BLOCKING;
+
+	switch (cmd) {
+	case SNDRV_FIREWIRE_IOCTL_SET_MONITOR:
+		if (!paired)
+			return -ENOIOCTLCMD;
+		return hwdep_set_monitor(tx, arg);
+	case SNDRV_FIREWIRE_IOCTL_SET_MIDI_THRU:
+		return hwdep_set_midi_thru(tx, arg);
+	case SNDRV_FIREWIRE_IOCTL_SET_MIDI_CLOCK:
+		return hwdep_set_midi_clock(rx, arg);
+	case SNDRV_FIREWIRE_IOCTL_GET_CYCLE_CLOCK:
+		return hwdep_get_cycle_clock(tx, arg);
+	case SNDRV_FIREWIRE_IOCTL_SCHEDULE_START:
+		return hwdep_schedule_start(rx, arg);
+	case SNDRV_FIREWIRE_IOCTL_GET_LINK_OFFSET:
+		if (!paired)
+			return -ENOIOCTLCMD;
+		return hwdep_get_link_offset(tx, arg);
+	case SNDRV_FIREWIRE_IOCTL_SET_OFFLOAD:
+		return hwdep_set_offload(tx, rx, mutex, arg);
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+EXPORT_SYMBOL(amdtp_stream_hwdep_ioctl);
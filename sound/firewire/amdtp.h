@@ -3,9 +3,14 @@
 
 #include <linux/err.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <sound/asound.h>
 #include "packets-buffer.h"
+#include "cycle-clock.h"
 
 /**
  * enum cip_flags - describes details of the streaming protocol
@@ -22,12 +27,17 @@
  *	Requires blocking mode and SYT_INTERVAL-aligned PCM buffer size.
  * @CIP_SYNC_TO_DEVICE: In sync to device mode, time stamp in out packets is
  *	generated by in packets. Defaultly this driver generates timestamp.
+ * @CIP_OUT_OF_ORDER: The device transmits packets out of order. Incoming
+ *	packets are sorted by data block counter, holding back a quarter of
+ *	them till the next callback. Without this, sorting starts when a packet
+ *	is found behind the previous one.
  */
 enum cip_flags {
 	CIP_NONBLOCKING		= 0x00,
 	CIP_BLOCKING		= 0x01,
 	CIP_HI_DUALWIRE		= 0x02,
-	CIP_SYNC_TO_DEVICE	= 0x04
+	CIP_SYNC_TO_DEVICE	= 0x04,
+	CIP_OUT_OF_ORDER	= 0x08,
 };
 
 /**
@@ -45,7 +55,12 @@ enum cip_sfc {
 };
 
 #define AMDTP_OUT_PCM_FORMAT_BITS	(SNDRV_PCM_FMTBIT_S16 | \
-					 SNDRV_PCM_FMTBIT_S32)
+					 SNDRV_PCM_FMTBIT_S32 | \
+					 SNDRV_PCM_FMTBIT_FLOAT | \
+					 SNDRV_PCM_FMTBIT_FLOAT64)
+
+#define AMDTP_IN_PCM_FORMAT_BITS	(SNDRV_PCM_FMTBIT_S32 | \
+					 SNDRV_PCM_FMTBIT_FLOAT)
 
 
 /*
@@ -68,12 +83,89 @@ struct fw_unit;
 struct fw_iso_context;
 struct snd_pcm_substream;
 struct snd_rawmidi_substream;
+struct snd_info_buffer;
+struct snd_card;
 
 enum amdtp_stream_direction {
 	AMDTP_OUT_STREAM = 0,
 	AMDTP_IN_STREAM
 };
 
+/* software meters of PCM channels, in 24 bit scale */
+struct amdtp_meter {
+	u32 peak[AMDTP_MAX_CHANNELS_FOR_PCM];
+	u32 rms[AMDTP_MAX_CHANNELS_FOR_PCM];
+};
+
+/* a route from a captured channel to a playback channel, for monitoring */
+#define AMDTP_MAX_MONITOR_ROUTES	64
+#define AMDTP_MONITOR_GAIN_UNITY	0x10000
+struct amdtp_monitor_route {
+	unsigned int src;
+	unsigned int dst;
+	unsigned int gain;	/* 16.16 fixed point */
+};
+struct amdtp_monitor;
+
+/* MIDI clock and MTC generated on an outgoing port, locked to data blocks */
+#define AMDTP_MIDI_CLOCK_PPQN_MAX	960
+#define AMDTP_MIDI_CLOCK_TEMPO_MIN	60000
+#define AMDTP_MIDI_CLOCK_TEMPO_MAX	0xffffff
+struct amdtp_midi_clock_params {
+	bool clock;
+	unsigned int tempo;	/* micro seconds per quarter note */
+	unsigned int ppqn;
+	bool mtc;
+	unsigned int mtc_type;	/* 0-3, as the rate bits in MTC */
+	u8 mtc_start[4];	/* hours, minutes, seconds, frames */
+};
+struct amdtp_midi_clock;
+
+/* the size of FIFO for MIDI thru, per port, power of two */
+#define AMDTP_MIDI_THRU_BYTES	64
+
+/*
+ * MIDI bytes peeked from rawmidi, per port. They are acknowledged when placed
+ * into packets, thus bytes still in the lane at stop are left in rawmidi.
+ * Realtime messages among them are queued apart and sent ahead of bulk bytes.
+ * Generated System Common messages are sent after the bulk bytes peeked before
+ * them. The sizes of both queues are power of two.
+ */
+#define AMDTP_MIDI_BULK_BYTES		1024
+#define AMDTP_MIDI_REALTIME_BYTES	16
+#define AMDTP_MIDI_COMMON_BYTES		16
+
+struct amdtp_midi_lane {
+	struct snd_rawmidi_substream *substream;
+	u8 bulk[AMDTP_MIDI_BULK_BYTES];
+	unsigned int bulk_head;		/* peeked */
+	unsigned int bulk_scan;		/* searched for realtime bytes */
+	unsigned int bulk_tail;		/* acknowledged */
+	unsigned int bulk_offset;	/* of bulk[0] in all of peeked bytes */
+	u8 realtime[AMDTP_MIDI_REALTIME_BYTES];
+	bool realtime_peeked[AMDTP_MIDI_REALTIME_BYTES];
+	unsigned int realtime_head;
+	unsigned int realtime_tail;
+	/* peeked realtime bytes sent ahead, not acknowledged yet */
+	unsigned int realtime_sent;
+	u8 common[AMDTP_MIDI_COMMON_BYTES];
+	unsigned int common_mark[AMDTP_MIDI_COMMON_BYTES];
+	unsigned int common_head;
+	unsigned int common_tail;
+	/* the message in progress, data_left is negative in SysEx */
+	u8 running_status;
+	bool restore_status;
+	int data_left;
+};
+
+/* the payload of one packet, handed from isochronous callback to worker */
+struct amdtp_offload_entry {
+	__be32 *buffer;
+	unsigned int data_blocks;
+	unsigned int data_block_counter;
+	ktime_t queued;
+};
+
 struct amdtp_stream {
 	struct fw_unit *unit;
 	enum cip_flags flags;
@@ -113,6 +205,9 @@ struct amdtp_stream {
 	bool pointer_flush;
 
 	struct snd_rawmidi_substream *midi[AMDTP_MAX_CHANNELS_FOR_MIDI * 8];
+	struct amdtp_midi_clock __rcu
+			*midi_clock[AMDTP_MAX_CHANNELS_FOR_MIDI * 8];
+	struct amdtp_midi_lane *midi_lanes;
 	/* quirk: the first count of data blocks in an AMDTP packet for MIDI */
 	unsigned int blocks_for_midi;
 
@@ -120,9 +215,118 @@ struct amdtp_stream {
 	wait_queue_head_t callback_wait;
 	struct amdtp_stream *sync_slave;
 
+	bool sorting;
+	int last_dbc;
 	void *sort_table;
 	void *left_packets;
 	unsigned int remain_packets;
+
+	/* for rewriting outgoing packets, queued but not transmitted yet */
+	spinlock_t lock;
+	unsigned int *packet_blocks;
+	unsigned int pending_packets;
+	__be32 *monitor_mix;
+
+	/* accumulated in transfer_samples, published once per period */
+	struct {
+		u32 peak[AMDTP_MAX_CHANNELS_FOR_PCM];
+		u64 squares[AMDTP_MAX_CHANNELS_FOR_PCM];
+		unsigned int frames;
+		seqcount_t seq;
+		struct amdtp_meter snapshot;
+	} meter;
+
+	/* mixed into packets of sync slave, in the same cycle */
+	struct amdtp_monitor __rcu *monitor;
+
+	/* PCM playback armed to start at a cycle, 0 - 63999 in eight seconds */
+	struct {
+		bool armed;
+		unsigned int cycle;
+		struct snd_pcm_substream *pcm;
+		unsigned int missed;
+	} scheduled;
+
+	/* the cycle of the last sent packet, 0 - 63999 in eight seconds */
+	struct {
+		bool known;
+		unsigned int last;
+		unsigned int skipped;
+	} out_cycle;
+
+	/* attached together with the sync slave's one, in the same packet */
+	struct snd_pcm_substream *linked_pcm;
+	bool link_aligned;
+	unsigned int link_ticks;
+
+	/* shared with other streams on the same card, while running */
+	struct cycle_clock *clock;
+
+	/* MIDI thru: routes of incoming ports, FIFOs of outgoing ports */
+	struct list_head thru_list;
+	struct {
+		struct amdtp_stream __rcu *stream;
+		unsigned int port;
+	} midi_thru[AMDTP_MAX_CHANNELS_FOR_MIDI * 8];
+	struct {
+		spinlock_t lock;
+		u8 buf[AMDTP_MAX_CHANNELS_FOR_MIDI * 8][AMDTP_MIDI_THRU_BYTES];
+		unsigned int head[AMDTP_MAX_CHANNELS_FOR_MIDI * 8];
+		unsigned int tail[AMDTP_MAX_CHANNELS_FOR_MIDI * 8];
+		unsigned int overruns;
+	} thru_fifo;
+
+	/* single-producer/single-consumer ring for PCM/MIDI processing */
+	struct {
+		int cpu;
+		int target;
+		struct work_struct work;
+		struct amdtp_offload_entry *ring;
+		/* capture payloads which sorting overwrites in next callback */
+		void *copies;
+		unsigned int head;
+		unsigned int tail;
+		/* statistics, in micro seconds */
+		unsigned int latency_max;
+		unsigned int latency_avg;
+		unsigned int overruns;
+	} offload;
+
+	/* checks callbacks and incoming data in jiffies, while running */
+	struct {
+		struct delayed_work work;
+		unsigned long callback;
+		unsigned long data;
+		bool stalled;
+		bool error;
+		unsigned int stalls;
+	} watchdog;
+
+	/* NUMA node of the controller, and packet pages placed on it */
+	int node;
+	unsigned int local_pages;
+};
+
+/* a snapshot of duplex streams, readable without the driver's mutex */
+struct amdtp_duplex_status {
+	unsigned int rate;
+	bool starting;
+	bool tx_running;
+	bool rx_running;
+};
+
+/*
+ * The state of a pair of streams. The driver updates it with its mutex held,
+ * and drops the mutex while waiting for the first callback of a stream.
+ */
+struct amdtp_duplex {
+	struct amdtp_stream *tx;
+	struct amdtp_stream *rx;
+	struct mutex *mutex;
+	unsigned int starting;
+	wait_queue_head_t started;
+	seqcount_t seq;
+	struct amdtp_duplex_status status;
 };
 
 int amdtp_stream_init(struct amdtp_stream *s, struct fw_unit *unit,
@@ -139,13 +343,50 @@ unsigned int amdtp_stream_get_max_payload(struct amdtp_stream *s);
 int amdtp_stream_start(struct amdtp_stream *s, int channel, int speed);
 void amdtp_stream_update(struct amdtp_stream *s);
 void amdtp_stream_stop(struct amdtp_stream *s);
+int amdtp_stream_set_offload(struct amdtp_stream *s, int cpu);
 
 void amdtp_stream_set_pcm_format(struct amdtp_stream *s,
 				 snd_pcm_format_t format);
 void amdtp_stream_pcm_prepare(struct amdtp_stream *s);
 unsigned long amdtp_stream_pcm_pointer(struct amdtp_stream *s);
+void amdtp_stream_pcm_trigger(struct amdtp_stream *s,
+			      struct snd_pcm_substream *pcm);
 void amdtp_stream_pcm_abort(struct amdtp_stream *s);
+int amdtp_stream_alloc_pcm_buffer(struct amdtp_stream *s,
+				  struct snd_pcm_substream *pcm, size_t size);
+int amdtp_stream_schedule_pcm_start(struct amdtp_stream *s, u32 cycle_time);
+void amdtp_stream_pcm_link_trigger(struct amdtp_stream *in,
+				   struct snd_pcm_substream *capture,
+				   struct amdtp_stream *out,
+				   struct snd_pcm_substream *playback);
+int amdtp_stream_get_link_offset(struct amdtp_stream *in,
+				 unsigned int *ticks, unsigned int *frames);
+bool amdtp_stream_pcm_reattachable(struct amdtp_stream *s, unsigned int rate);
 bool amdtp_stream_wait_callback(struct amdtp_stream *s);
+void amdtp_duplex_init(struct amdtp_duplex *d, struct amdtp_stream *tx,
+		       struct amdtp_stream *rx, struct mutex *mutex);
+void amdtp_duplex_lock(struct amdtp_duplex *d);
+int amdtp_duplex_wait_callback(struct amdtp_duplex *d,
+			       struct amdtp_stream *s);
+void amdtp_duplex_publish(struct amdtp_duplex *d, unsigned int rate);
+void amdtp_duplex_read_status(struct amdtp_duplex *d,
+			      struct amdtp_duplex_status *status);
+void amdtp_stream_proc_read(struct amdtp_stream *s,
+			    struct snd_info_buffer *buffer);
+void amdtp_stream_read_meter(struct amdtp_stream *s,
+			     struct amdtp_meter *meter);
+int amdtp_stream_add_meter_ctl(struct amdtp_stream *s, struct snd_card *card,
+			       const char *name);
+int amdtp_stream_set_monitor(struct amdtp_stream *s,
+			     const struct amdtp_monitor_route *routes,
+			     unsigned int count);
+int amdtp_stream_set_midi_thru(struct amdtp_stream *s, unsigned int port,
+			       const char *dst_name, unsigned int dst_port);
+int amdtp_stream_set_midi_clock(struct amdtp_stream *s, unsigned int port,
+			const struct amdtp_midi_clock_params *params);
+int amdtp_stream_hwdep_ioctl(struct amdtp_stream *tx, struct amdtp_stream *rx,
+			     struct mutex *mutex, unsigned int cmd,
+			     void __user *arg);
 
 extern const unsigned int amdtp_syt_intervals[CIP_SFC_COUNT];
 extern const unsigned int amdtp_rate_table[CIP_SFC_COUNT];
@@ -168,37 +409,25 @@ bool amdtp_stream_midi_running(struct amdtp_stream *s);
  * @s: the AMDTP stream
  *
  * If this function returns true, the stream's packet queue has stopped due to
- * an asynchronous error.
+ * an asynchronous error, or the stream has stalled and should be restarted.
  */
 static inline bool amdtp_streaming_error(struct amdtp_stream *s)
 {
-	return s->packet_index < 0;
+	return s->packet_index < 0 || ACCESS_ONCE(s->watchdog.error);
 }
 
 /**
  * amdtp_stream_pcm_running - check PCM stream is running or not
  * @s: the AMDTP stream
  *
- * If this function returns true, PCM stream in the stream is running.
+ * If this function returns true, PCM stream in the stream is running, or
+ * waiting for the scheduled cycle or the linked stream.
  */
 static inline bool amdtp_stream_pcm_running(struct amdtp_stream *s)
 {
-	return !IS_ERR_OR_NULL(s->pcm);
-}
-
-/**
- * amdtp_stream_pcm_trigger - start/stop playback from a PCM device
- * @s: the AMDTP stream
- * @pcm: the PCM device to be started, or %NULL to stop the current device
- *
- * Call this function on a running isochronous stream to enable the actual
- * transmission of PCM data.  This function should be called from the PCM
- * device's .trigger callback.
- */
-static inline void amdtp_stream_pcm_trigger(struct amdtp_stream *s,
-					    struct snd_pcm_substream *pcm)
-{
-	ACCESS_ONCE(s->pcm) = pcm;
+	return !IS_ERR_OR_NULL(s->pcm) ||
+	       (ACCESS_ONCE(s->scheduled.pcm) != NULL) ||
+	       (ACCESS_ONCE(s->linked_pcm) != NULL);
 }
 
 /**
@@ -219,6 +448,18 @@ static inline void amdtp_stream_midi_trigger(struct amdtp_stream *s,
 		ACCESS_ONCE(s->midi[port]) = midi;
 }
 
+/**
+ * amdtp_duplex_starting - check any stream is waiting for its first callback
+ * @d: the duplex streams
+ *
+ * Call this with the driver's mutex held. While this returns true, the streams
+ * and connections belong to the thread in amdtp_duplex_wait_callback().
+ */
+static inline bool amdtp_duplex_starting(struct amdtp_duplex *d)
+{
+	return d->starting > 0;
+}
+
 static inline bool cip_sfc_is_base_44100(enum cip_sfc sfc)
 {
 	return sfc & 1;
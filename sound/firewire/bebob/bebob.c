@@ -21,6 +21,7 @@ MODULE_LICENSE("GPL v2");
 static int index[SNDRV_CARDS]	= SNDRV_DEFAULT_IDX;
 static char *id[SNDRV_CARDS]	= SNDRV_DEFAULT_STR;
 static bool enable[SNDRV_CARDS]	= SNDRV_DEFAULT_ENABLE_PNP;
+static int nonblocking[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = -1};
 
 module_param_array(index, int, NULL, 0444);
 MODULE_PARM_DESC(index, "card index");
@@ -28,9 +29,12 @@ module_param_array(id, charp, NULL, 0444);
 MODULE_PARM_DESC(id, "ID string");
 module_param_array(enable, bool, NULL, 0444);
 MODULE_PARM_DESC(enable, "enable BeBoB sound card");
+module_param_array(nonblocking, int, NULL, 0444);
+MODULE_PARM_DESC(nonblocking,
+		 "non-blocking transmission (-1 = model default, 0/1 = off/on)");
 
 static DEFINE_MUTEX(devices_mutex);
-static unsigned int devices_used;
+static DEFINE_IDR(devices_idr);
 
 /* Offsets from information register. */
 #define INFO_OFFSET_GUID		0x10
@@ -123,11 +127,12 @@ bebob_card_free(struct snd_card *card)
 
 	if (bebob->card_index >= 0) {
 		mutex_lock(&devices_mutex);
-		devices_used &= ~BIT(bebob->card_index);
+		idr_remove(&devices_idr, bebob->card_index);
 		mutex_unlock(&devices_mutex);
 	}
 
 	mutex_destroy(&bebob->mutex);
+	mutex_destroy(&bebob->avc_mutex);
 
 	return;
 }
@@ -157,6 +162,18 @@ check_audiophile_booted(struct fw_unit *unit)
 	return strncmp(name, "FW Audiophile Bootloader", 15) != 0;
 }
 
+/* called in a worker after bus resets settle */
+static void
+bebob_recover(struct fw_unit *unit)
+{
+	struct snd_bebob *bebob = dev_get_drvdata(&unit->device);
+
+	if (bebob == NULL)
+		return;
+
+	snd_bebob_stream_update_duplex(bebob);
+}
+
 static int
 bebob_probe(struct fw_unit *unit,
 	    const struct ieee1394_device_id *entry)
@@ -164,20 +181,10 @@ bebob_probe(struct fw_unit *unit,
 	struct snd_card *card;
 	struct snd_bebob *bebob;
 	const struct snd_bebob_spec *spec;
-	unsigned int card_index;
-	int err;
+	int card_index, err;
 
 	mutex_lock(&devices_mutex);
 
-	for (card_index = 0; card_index < SNDRV_CARDS; card_index++) {
-		if (!(devices_used & BIT(card_index)) && enable[card_index])
-			break;
-	}
-	if (card_index >= SNDRV_CARDS) {
-		err = -ENOENT;
-		goto end;
-	}
-
 	if ((entry->vendor_id == VEN_FOCUSRITE) &&
 	    (entry->model_id == MODEL_FOCUSRITE_SAFFIRE_BOTH))
 		spec = get_saffire_spec(unit);
@@ -197,10 +204,24 @@ bebob_probe(struct fw_unit *unit,
 		goto end;
 	}
 
-	err = snd_card_create(index[card_index], id[card_index],
-			THIS_MODULE, sizeof(struct snd_bebob), &card);
-	if (err < 0)
+	/* disabled indexes are reserved at module init */
+	card_index = idr_alloc(&devices_idr, NULL, 0, 0, GFP_KERNEL);
+	if (card_index < 0) {
+		err = card_index;
+		goto end;
+	}
+
+	/* the module parameters are for the first SNDRV_CARDS devices */
+	if (card_index < SNDRV_CARDS)
+		err = snd_card_create(index[card_index], id[card_index],
+				THIS_MODULE, sizeof(struct snd_bebob), &card);
+	else
+		err = snd_card_create(SNDRV_DEFAULT_IDX1, SNDRV_DEFAULT_STR1,
+				THIS_MODULE, sizeof(struct snd_bebob), &card);
+	if (err < 0) {
+		idr_remove(&devices_idr, card_index);
 		goto end;
+	}
 	card->private_free = bebob_card_free;
 
 	bebob = card->private_data;
@@ -209,9 +230,18 @@ bebob_probe(struct fw_unit *unit,
 	bebob->unit = unit;
 	bebob->card_index = -1;
 	bebob->spec = spec;
+	/* the module parameter overrides the model default */
+	if ((card_index < SNDRV_CARDS) && (nonblocking[card_index] >= 0))
+		bebob->nonblocking = nonblocking[card_index] > 0;
+	else
+		bebob->nonblocking = spec->nonblocking;
 	mutex_init(&bebob->mutex);
+	mutex_init(&bebob->avc_mutex);
 	spin_lock_init(&bebob->lock);
+	amdtp_duplex_init(&bebob->duplex, &bebob->tx_stream, &bebob->rx_stream,
+			  &bebob->mutex);
 	init_waitqueue_head(&bebob->hwdep_wait);
+	snd_fw_recovery_init(&bebob->recovery, unit, bebob_recover);
 
 	err = name_device(bebob, entry->vendor_id);
 	if (err < 0)
@@ -256,13 +286,14 @@ bebob_probe(struct fw_unit *unit,
 		goto error;
 	}
 	dev_set_drvdata(&unit->device, bebob);
-	devices_used |= BIT(card_index);
+	idr_replace(&devices_idr, bebob, card_index);
 	bebob->card_index = card_index;
 end:
 	mutex_unlock(&devices_mutex);
 	return err;
 error:
 	snd_card_free(card);
+	idr_remove(&devices_idr, card_index);
 	mutex_unlock(&devices_mutex);
 	return err;
 }
@@ -276,7 +307,7 @@ bebob_update(struct fw_unit *unit)
 		return;
 
 	fcp_bus_reset(bebob->unit);
-	snd_bebob_stream_update_duplex(bebob);
+	snd_fw_recovery_schedule(&bebob->recovery);
 }
 
 
@@ -287,6 +318,7 @@ static void bebob_remove(struct fw_unit *unit)
 	if (bebob == NULL)
 		return;
 
+	snd_fw_recovery_cancel(&bebob->recovery);
 	snd_bebob_stream_destroy_duplex(bebob);
 	snd_card_disconnect(bebob->card);
 	snd_card_free_when_closed(bebob->card);
@@ -301,6 +333,13 @@ static const struct snd_bebob_spec spec_normal = {
 	.rate	= &normal_rate_spec,
 	.meter	= NULL
 };
+/* the reference designs run the unmodified SDK firmware */
+static const struct snd_bebob_spec spec_nonblocking = {
+	.clock		= NULL,
+	.rate		= &normal_rate_spec,
+	.meter		= NULL,
+	.nonblocking	= true
+};
 
 static const struct ieee1394_device_id bebob_id_table[] = {
 	/* Edirol, FA-66 */
@@ -314,9 +353,9 @@ static const struct ieee1394_device_id bebob_id_table[] = {
 	/* PreSonus, Inspire1394 */
 	SND_BEBOB_DEV_ENTRY(VEN_PRESONUS, 0x00010001, &spec_normal),
 	/* BridgeCo, RDAudio1 */
-	SND_BEBOB_DEV_ENTRY(VEN_BRIDGECO, 0x00010048, &spec_normal),
+	SND_BEBOB_DEV_ENTRY(VEN_BRIDGECO, 0x00010048, &spec_nonblocking),
 	/* BridgeCo, Audio5 */
-	SND_BEBOB_DEV_ENTRY(VEN_BRIDGECO, 0x00010049, &spec_normal),
+	SND_BEBOB_DEV_ENTRY(VEN_BRIDGECO, 0x00010049, &spec_nonblocking),
 	/* Mackie, Onyx 1220/1620/1640 (Firewire I/O Card) */
 	SND_BEBOB_DEV_ENTRY(VEN_MACKIE, 0x00010065, &spec_normal),
 	/* Mackie, d.2 (Firewire Option) */
@@ -437,13 +476,33 @@ static struct fw_driver bebob_driver = {
 static int __init
 snd_bebob_init(void)
 {
-	return driver_register(&bebob_driver.driver);
+	unsigned int i;
+	int err;
+
+	/* never assign the indexes disabled by the module parameter */
+	for (i = 0; i < SNDRV_CARDS; i++) {
+		if (enable[i])
+			continue;
+		err = idr_alloc(&devices_idr, NULL, i, i + 1, GFP_KERNEL);
+		if (err < 0)
+			goto error;
+	}
+
+	err = driver_register(&bebob_driver.driver);
+	if (err < 0)
+		goto error;
+
+	return 0;
+error:
+	idr_destroy(&devices_idr);
+	return err;
 }
 
 static void __exit
 snd_bebob_exit(void)
 {
 	driver_unregister(&bebob_driver.driver);
+	idr_destroy(&devices_idr);
 	mutex_destroy(&devices_mutex);
 }
 
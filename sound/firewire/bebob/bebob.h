@@ -17,6 +17,8 @@
 #include <linux/mod_devicetable.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/seqlock.h>
+#include <linux/idr.h>
 
 /* TODO: when mering to upstream, this path should be changed. */
 #include "../../../include/uapi/sound/asound.h"
@@ -71,8 +73,12 @@ struct snd_bebob_spec {
 	struct snd_bebob_clock_spec *clock;
 	struct snd_bebob_rate_spec *rate;
 	struct snd_bebob_meter_spec *meter;
+	/* the firmware accepts non-blocking transmission */
+	bool nonblocking;
 };
 
+#define SND_BEBOB_AVC_RESP_SIZE	8192
+
 struct snd_bebob {
 	struct snd_card *card;
 	struct fw_device *device;
@@ -99,11 +105,25 @@ struct snd_bebob {
 
 	int sync_input_plug;
 
+	struct snd_fw_recovery recovery;
+
+	/* quirk: the device accepts non-blocking transmission */
+	bool nonblocking;
+
+	/* updated under mutex, read locklessly */
+	struct amdtp_duplex duplex;
+
 	/* for uapi */
 	int dev_lock_count;
 	bool dev_lock_changed;
 	wait_queue_head_t hwdep_wait;
 
+	/* serializes batches of AV/C commands, apart from streaming */
+	struct mutex avc_mutex;
+	/* AV/C responses to hwdep, as struct snd_firewire_avc_frame */
+	u8 avc_resp[SND_BEBOB_AVC_RESP_SIZE];
+	unsigned int avc_resp_len;
+
 	/* for M-Audio special devices */
 	bool maudio_special_quirk;
 	bool maudio_is1814;
@@ -7,15 +7,39 @@
  */
 
 /*
- * This codes give three functionality.
+ * This codes give four functionality.
  *
  * 1.get firewire node infomation
  * 2.get notification about starting/stopping stream
  * 3.lock/unlock stream
+ * 4.transmit AV/C commands and receive their responses
  */
 
 #include "bebob.h"
 
+/* pulls as many whole frames as @size, call with lock held */
+static unsigned int
+pull_avc_resp(struct snd_bebob *bebob, u8 *buf, unsigned int size)
+{
+	struct snd_firewire_avc_frame *f;
+	unsigned int length = 0, frame_size;
+
+	while (length < bebob->avc_resp_len) {
+		f = (struct snd_firewire_avc_frame *)(bebob->avc_resp + length);
+		frame_size = sizeof(*f) + ALIGN(f->length, 4);
+		if (length + frame_size > size)
+			break;
+		length += frame_size;
+	}
+
+	memcpy(buf, bebob->avc_resp, length);
+	bebob->avc_resp_len -= length;
+	memmove(bebob->avc_resp, bebob->avc_resp + length,
+		bebob->avc_resp_len);
+
+	return length;
+}
+
 static long
 hwdep_read(struct snd_hwdep *hwdep, char __user *buf,  long count,
 	   loff_t *offset)
@@ -23,16 +47,24 @@ hwdep_read(struct snd_hwdep *hwdep, char __user *buf,  long count,
 	struct snd_bebob *bebob = hwdep->private_data;
 	DEFINE_WAIT(wait);
 	union snd_firewire_event event;
+	unsigned int length;
+	u8 *resp;
+
+	resp = kmalloc(SND_BEBOB_AVC_RESP_SIZE, GFP_KERNEL);
+	if (resp == NULL)
+		return -ENOMEM;
 
 	spin_lock_irq(&bebob->lock);
 
-	while (!bebob->dev_lock_changed) {
+	while (!bebob->dev_lock_changed && bebob->avc_resp_len == 0) {
 		prepare_to_wait(&bebob->hwdep_wait, &wait, TASK_INTERRUPTIBLE);
 		spin_unlock_irq(&bebob->lock);
 		schedule();
 		finish_wait(&bebob->hwdep_wait, &wait);
-		if (signal_pending(current))
-			return -ERESTARTSYS;
+		if (signal_pending(current)) {
+			count = -ERESTARTSYS;
+			goto end;
+		}
 		spin_lock_irq(&bebob->lock);
 	}
 
@@ -41,15 +73,119 @@ hwdep_read(struct snd_hwdep *hwdep, char __user *buf,  long count,
 		event.lock_status.type = SNDRV_FIREWIRE_EVENT_LOCK_STATUS;
 		event.lock_status.status = (bebob->dev_lock_count > 0);
 		bebob->dev_lock_changed = false;
+		spin_unlock_irq(&bebob->lock);
 
 		count = min_t(long, count, sizeof(event.lock_status));
+		if (copy_to_user(buf, &event, count))
+			count = -EFAULT;
+		goto end;
 	}
 
+	event.avc_response.type = SNDRV_FIREWIRE_EVENT_AVC_RESPONSE;
+	length = 0;
+	if (count > sizeof(event.avc_response))
+		length = pull_avc_resp(bebob, resp,
+			min_t(long, count - sizeof(event.avc_response),
+			      SND_BEBOB_AVC_RESP_SIZE));
 	spin_unlock_irq(&bebob->lock);
 
-	if (copy_to_user(buf, &event, count))
-		return -EFAULT;
+	if (length == 0) {
+		count = -ENOSPC;
+		goto end;
+	}
+
+	count = sizeof(event.avc_response) + length;
+	if (copy_to_user(buf, &event, sizeof(event.avc_response)) ||
+	    copy_to_user(buf + sizeof(event.avc_response), resp, length))
+		count = -EFAULT;
+end:
+	kfree(resp);
+	return count;
+}
+
+static long
+hwdep_write(struct snd_hwdep *hwdep, const char __user *data, long count,
+	    loff_t *offset)
+{
+	struct snd_bebob *bebob = hwdep->private_data;
+	struct snd_firewire_avc_frame *cmd, *resp;
+	unsigned int pos, length, space;
+	u8 *cmds, *resps;
+	int err;
+
+	if (count < sizeof(struct snd_firewire_avc_frame))
+		return -EINVAL;
+	count = min_t(long, count, SND_BEBOB_AVC_RESP_SIZE);
+
+	cmds = memdup_user(data, count);
+	if (IS_ERR(cmds))
+		return PTR_ERR(cmds);
+
+	resps = kmalloc(SND_BEBOB_AVC_RESP_SIZE, GFP_KERNEL);
+	if (resps == NULL) {
+		count = -ENOMEM;
+		goto end;
+	}
 
+	/* the mutex serializes writers, then the space can only increase */
+	err = mutex_lock_interruptible(&bebob->avc_mutex);
+	if (err < 0) {
+		count = err;
+		goto end;
+	}
+
+	spin_lock_irq(&bebob->lock);
+	space = SND_BEBOB_AVC_RESP_SIZE - bebob->avc_resp_len;
+	spin_unlock_irq(&bebob->lock);
+
+	/* commands are executed in order, one of them at a time */
+	pos = 0;
+	length = 0;
+	while (count - pos >= sizeof(*cmd)) {
+		cmd = (struct snd_firewire_avc_frame *)(cmds + pos);
+		if (cmd->length == 0 ||
+		    cmd->length > SND_FIREWIRE_AVC_FRAME_MAX ||
+		    sizeof(*cmd) + ALIGN(cmd->length, 4) > count - pos)
+			break;
+		if (length + sizeof(*resp) + SND_FIREWIRE_AVC_FRAME_MAX > space)
+			break;
+
+		resp = (struct snd_firewire_avc_frame *)(resps + length);
+		resp->seqnum = cmd->seqnum;
+		memcpy(resp->frame, cmd->frame, cmd->length);
+
+		/* the response is detected by subunit and opcode */
+		err = fcp_avc_transaction(bebob->unit,
+					  resp->frame, cmd->length,
+					  resp->frame,
+					  SND_FIREWIRE_AVC_FRAME_MAX,
+					  BIT(1) | BIT(2));
+		resp->error = min(err, 0);
+		resp->length = max(err, 0);
+
+		pos += sizeof(*cmd) + ALIGN(cmd->length, 4);
+		length += sizeof(*resp) + ALIGN(resp->length, 4);
+	}
+
+	if (length > 0) {
+		spin_lock_irq(&bebob->lock);
+		memcpy(bebob->avc_resp + bebob->avc_resp_len, resps, length);
+		bebob->avc_resp_len += length;
+		spin_unlock_irq(&bebob->lock);
+		wake_up(&bebob->hwdep_wait);
+	}
+
+	mutex_unlock(&bebob->avc_mutex);
+
+	if (pos > 0)
+		count = pos;
+	else if (space < sizeof(*resp) + SND_FIREWIRE_AVC_FRAME_MAX)
+		count = -EAGAIN;
+	else
+		count = -EINVAL;
+end:
+	kfree(resps);
+	kfree(cmds);
 	return count;
 }
 
@@ -62,13 +198,13 @@ hwdep_poll(struct snd_hwdep *hwdep, struct file *file, poll_table *wait)
 	poll_wait(file, &bebob->hwdep_wait, wait);
 
 	spin_lock_irq(&bebob->lock);
-	if (bebob->dev_lock_changed)
+	if (bebob->dev_lock_changed || (bebob->avc_resp_len > 0))
 		events = POLLIN | POLLRDNORM;
 	else
 		events = 0;
 	spin_unlock_irq(&bebob->lock);
 
-	return events;
+	return events | POLLOUT;
 }
 
 static int
@@ -154,7 +290,10 @@ hwdep_ioctl(struct snd_hwdep *hwdep, struct file *file,
 	case SNDRV_FIREWIRE_IOCTL_UNLOCK:
 		return hwdep_unlock(bebob);
 	default:
-		return -ENOIOCTLCMD;
+		return amdtp_stream_hwdep_ioctl(&bebob->tx_stream,
+						&bebob->rx_stream,
+						&bebob->mutex,
+						cmd, (void __user *)arg);
 	}
 }
 
@@ -172,6 +311,7 @@ hwdep_compat_ioctl(struct snd_hwdep *hwdep, struct file *file,
 
 static const struct snd_hwdep_ops hwdep_ops = {
 	.read		= hwdep_read,
+	.write		= hwdep_write,
 	.release	= hwdep_release,
 	.poll		= hwdep_poll,
 	.ioctl		= hwdep_ioctl,
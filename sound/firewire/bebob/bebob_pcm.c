@@ -180,7 +180,7 @@ pcm_init_hw_params(struct snd_bebob *bebob,
 			      bebob->tx_stream_formations);
 		prepare_channels(&substream->runtime->hw,
 				 bebob->tx_stream_formations);
-		substream->runtime->hw.formats = SNDRV_PCM_FMTBIT_S32_LE;
+		substream->runtime->hw.formats = AMDTP_IN_PCM_FORMAT_BITS;
 		snd_pcm_hw_rule_add(substream->runtime, 0,
 				SNDRV_PCM_HW_PARAM_CHANNELS,
 				hw_rule_capture_channels, bebob,
@@ -236,6 +236,7 @@ pcm_open(struct snd_pcm_substream *substream)
 {
 	struct snd_bebob *bebob = substream->private_data;
 	struct snd_bebob_rate_spec *spec = bebob->spec->rate;
+	struct amdtp_duplex_status status;
 	unsigned int sampling_rate;
 	bool internal;
 	int err;
@@ -256,9 +257,13 @@ pcm_open(struct snd_pcm_substream *substream)
 	 * When source of clock is internal or any PCM stream are running,
 	 * the available sampling rate is limited at current sampling rate.
 	 */
-	if (!internal ||
-	    amdtp_stream_pcm_running(&bebob->tx_stream) ||
+	if (amdtp_stream_pcm_running(&bebob->tx_stream) ||
 	    amdtp_stream_pcm_running(&bebob->rx_stream)) {
+		/* streams keep the rate published at starting */
+		amdtp_duplex_read_status(&bebob->duplex, &status);
+		substream->runtime->hw.rate_min = status.rate;
+		substream->runtime->hw.rate_max = status.rate;
+	} else if (!internal) {
 		err = spec->get(bebob, &sampling_rate);
 		if (err < 0)
 			goto err_locked;
@@ -287,8 +292,16 @@ static int
 pcm_hw_params(struct snd_pcm_substream *substream,
 	      struct snd_pcm_hw_params *hw_params)
 {
-	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
-						params_buffer_bytes(hw_params));
+	struct snd_bebob *bebob = substream->private_data;
+	struct amdtp_stream *stream;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		stream = &bebob->tx_stream;
+	else
+		stream = &bebob->rx_stream;
+
+	return amdtp_stream_alloc_pcm_buffer(stream, substream,
+					     params_buffer_bytes(hw_params));
 }
 
 static int
@@ -336,14 +349,37 @@ end:
 	return err;
 }
 
+/* the substream in the other direction, linked by snd_pcm_link() */
+static struct snd_pcm_substream *
+linked_substream(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream *s;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if ((s->pcm == substream->pcm) &&
+		    (s->stream != substream->stream))
+			return s;
+	}
+
+	return NULL;
+}
+
 static int
 pcm_capture_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_bebob *bebob = substream->private_data;
+	struct snd_pcm_substream *link;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(&bebob->tx_stream, substream);
+		link = linked_substream(substream);
+		if (link == NULL) {
+			amdtp_stream_pcm_trigger(&bebob->tx_stream, substream);
+			break;
+		}
+		amdtp_stream_pcm_link_trigger(&bebob->tx_stream, substream,
+					      &bebob->rx_stream, link);
+		snd_pcm_trigger_done(link, substream);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		amdtp_stream_pcm_trigger(&bebob->tx_stream, NULL);
@@ -358,10 +394,18 @@ static int
 pcm_playback_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_bebob *bebob = substream->private_data;
+	struct snd_pcm_substream *link;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(&bebob->rx_stream, substream);
+		link = linked_substream(substream);
+		if (link == NULL) {
+			amdtp_stream_pcm_trigger(&bebob->rx_stream, substream);
+			break;
+		}
+		amdtp_stream_pcm_link_trigger(&bebob->tx_stream, link,
+					      &bebob->rx_stream, substream);
+		snd_pcm_trigger_done(link, substream);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		amdtp_stream_pcm_trigger(&bebob->rx_stream, NULL);
@@ -425,6 +469,12 @@ int snd_bebob_create_pcm_devices(struct snd_bebob *bebob)
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_playback_ops);
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_capture_ops);
 
+	err = amdtp_stream_add_meter_ctl(&bebob->tx_stream, bebob->card,
+					 "PCM Capture Meter");
+	if (err < 0)
+		goto end;
+	err = amdtp_stream_add_meter_ctl(&bebob->rx_stream, bebob->card,
+					 "PCM Playback Meter");
 end:
 	return err;
 }
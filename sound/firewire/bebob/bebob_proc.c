@@ -142,13 +142,22 @@ proc_read_clock(struct snd_info_entry *entry,
 {
 	struct snd_bebob *bebob = entry->private_data;
 	struct snd_bebob_clock_spec *clk_spec = bebob->spec->clock;
+	struct amdtp_duplex_status status;
 	unsigned int rate;
 	bool internal;
 	unsigned int id;
 
-	if (snd_bebob_stream_get_rate(bebob, &rate) < 0)
+	/* the rate is fixed during streaming, thus no need to ask the device */
+	amdtp_duplex_read_status(&bebob->duplex, &status);
+	if (status.tx_running || status.rx_running)
+		rate = status.rate;
+	else if (snd_bebob_stream_get_rate(bebob, &rate) < 0)
 		return;
 	snd_iprintf(buffer, "Sampling rate: %d\n", rate);
+	snd_iprintf(buffer, "Streaming: %s/%s (tx/rx)%s\n",
+		    (status.tx_running) ? "running" : "stopped",
+		    (status.rx_running) ? "running" : "stopped",
+		    (status.starting) ? ", starting" : "");
 
 	if (!clk_spec) {
 		if (snd_bebob_stream_check_internal_clock(bebob, &internal) < 0)
@@ -163,6 +172,18 @@ proc_read_clock(struct snd_info_entry *entry,
 	}
 }
 
+static void
+proc_read_stream(struct snd_info_entry *entry,
+		 struct snd_info_buffer *buffer)
+{
+	struct snd_bebob *bebob = entry->private_data;
+
+	snd_iprintf(buffer, "Output Stream from device:\n");
+	amdtp_stream_proc_read(&bebob->tx_stream, buffer);
+	snd_iprintf(buffer, "Input Stream to device:\n");
+	amdtp_stream_proc_read(&bebob->rx_stream, buffer);
+}
+
 void snd_bebob_proc_init(struct snd_bebob *bebob)
 {
 	struct snd_info_entry *entry;
@@ -176,6 +197,9 @@ void snd_bebob_proc_init(struct snd_bebob *bebob)
 	if (!snd_card_proc_new(bebob->card, "#clock", &entry))
 		snd_info_set_text_ops(entry, bebob, proc_read_clock);
 
+	if (!snd_card_proc_new(bebob->card, "#stream", &entry))
+		snd_info_set_text_ops(entry, bebob, proc_read_stream);
+
 	if (bebob->spec->meter != NULL) {
 		if (!snd_card_proc_new(bebob->card, "#meter", &entry))
 			snd_info_set_text_ops(entry, bebob, proc_read_meters);
@@ -289,7 +289,7 @@ check_connection_used_by_others(struct snd_bebob *bebob,
 static int
 make_both_connections(struct snd_bebob *bebob, unsigned int rate)
 {
-	int index, pcm_channels, midi_channels, err;
+	int index, pcm_channels, midi_channels;
 
 	/* confirm params for both streams */
 	index = get_formation_index(rate);
@@ -302,17 +302,11 @@ make_both_connections(struct snd_bebob *bebob, unsigned int rate)
 	amdtp_stream_set_parameters(&bebob->rx_stream,
 				    rate, pcm_channels, midi_channels * 8);
 
-	/* establish connections for both streams */
-	err = cmp_connection_establish(&bebob->out_conn,
-			amdtp_stream_get_max_payload(&bebob->tx_stream));
-	if (err < 0)
-		goto end;
-	err = cmp_connection_establish(&bebob->in_conn,
+	/* establish connections for both streams at the same time */
+	return cmp_connection_establish_pair(&bebob->out_conn,
+			amdtp_stream_get_max_payload(&bebob->tx_stream),
+			&bebob->in_conn,
 			amdtp_stream_get_max_payload(&bebob->rx_stream));
-	if (err < 0)
-		cmp_connection_break(&bebob->out_conn);
-end:
-	return err;
 }
 
 static void
@@ -377,21 +371,31 @@ end:
 
 int snd_bebob_stream_init_duplex(struct snd_bebob *bebob)
 {
+	enum cip_flags flags;
 	int err;
 
 	err = init_both_connections(bebob);
 	if (err < 0)
 		goto end;
 
+	/*
+	 * In blocking mode, the device needs additional buffering for one
+	 * SYT_INTERVAL, and empty packets and full packets come alternately.
+	 */
+	if (bebob->nonblocking)
+		flags = CIP_NONBLOCKING;
+	else
+		flags = CIP_BLOCKING;
+
 	err = amdtp_stream_init(&bebob->tx_stream, bebob->unit,
-				AMDTP_IN_STREAM, CIP_BLOCKING);
+				AMDTP_IN_STREAM, flags);
 	if (err < 0) {
 		destroy_both_connections(bebob);
 		goto end;
 	}
 
 	err = amdtp_stream_init(&bebob->rx_stream, bebob->unit,
-				AMDTP_OUT_STREAM, CIP_BLOCKING);
+				AMDTP_OUT_STREAM, flags);
 	if (err < 0) {
 		amdtp_stream_destroy(&bebob->tx_stream);
 		destroy_both_connections(bebob);
@@ -408,10 +412,10 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 	struct amdtp_stream *master, *slave;
 	enum cip_flags sync_mode;
 	unsigned int curr_rate;
-	bool slave_flag, used;
+	bool slave_flag, used, shared;
 	int err;
 
-	mutex_lock(&bebob->mutex);
+	amdtp_duplex_lock(&bebob->duplex);
 
 	err = get_roles(bebob, &sync_mode, &master, &slave);
 	if (err < 0)
@@ -422,6 +426,20 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 	else
 		slave_flag = false;
 
+	/* the streams keep running after XRUN, thus just attach PCM again */
+	if (amdtp_stream_pcm_reattachable(request, rate) &&
+	    !amdtp_streaming_error(master))
+		goto end;
+
+	/* the packet queue has stopped, thus restart the streams */
+	if (amdtp_streaming_error(slave))
+		amdtp_stream_stop(slave);
+	if (amdtp_streaming_error(master)) {
+		amdtp_stream_stop(slave);
+		amdtp_stream_stop(master);
+		break_both_connections(bebob);
+	}
+
 	/*
 	 * Considering JACK/FFADO streaming:
 	 * TODO: This can be removed hwdep functionality becomes popular.
@@ -437,12 +455,23 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 		goto end;
 	}
 
+	/* others receive the stream of the device at current rate */
+	err = cmp_connection_check_shared(&bebob->out_conn, &shared);
+	if (err < 0)
+		goto end;
+
 	/* get current rate */
 	err = rate_spec->get(bebob, &curr_rate);
 	if (err < 0)
 		goto end;
 	if (rate == 0)
 		rate = curr_rate;
+	if (shared && (rate != curr_rate)) {
+		dev_err(&bebob->unit->device,
+			"sampling rate is fixed by others: %d\n", curr_rate);
+		err = -EBUSY;
+		goto end;
+	}
 
 	/* change sampling rate if needed */
 	if (rate != curr_rate) {
@@ -468,9 +497,11 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 		 * If establishing connections at first, Yamaha GO46
 		 * (and maybe Terratec X24) don't generate sound.
 		 */
-		err = rate_spec->set(bebob, rate);
-		if (err < 0)
-			goto end;
+		if (!shared) {
+			err = rate_spec->set(bebob, rate);
+			if (err < 0)
+				goto end;
+		}
 
 		err = make_both_connections(bebob, rate);
 		if (err < 0)
@@ -489,7 +520,7 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 		 * The firmware customized by M-Audio uses this cue to start
 		 * transmit stream. This is not usual way.
 		 */
-		if (bebob->maudio_special_quirk) {
+		if (bebob->maudio_special_quirk && !shared) {
 			err = rate_spec->set(bebob, rate);
 			if (err < 0) {
 				amdtp_stream_stop(master);
@@ -499,10 +530,10 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 		}
 
 		/* wait first callback */
-		if (!amdtp_stream_wait_callback(master)) {
+		err = amdtp_duplex_wait_callback(&bebob->duplex, master);
+		if (err < 0) {
 			amdtp_stream_stop(master);
 			break_both_connections(bebob);
-			err = -ETIMEDOUT;
 			goto end;
 		}
 	}
@@ -519,15 +550,15 @@ int snd_bebob_stream_start_duplex(struct snd_bebob *bebob,
 		}
 
 		/* wait first callback */
-		if (!amdtp_stream_wait_callback(slave)) {
+		err = amdtp_duplex_wait_callback(&bebob->duplex, slave);
+		if (err < 0) {
 			amdtp_stream_stop(slave);
 			amdtp_stream_stop(master);
 			break_both_connections(bebob);
-			err = -ETIMEDOUT;
-			goto end;
 		}
 	}
 end:
+	amdtp_duplex_publish(&bebob->duplex, (err < 0) ? 0 : rate);
 	mutex_unlock(&bebob->mutex);
 	return err;
 }
@@ -544,6 +575,10 @@ int snd_bebob_stream_stop_duplex(struct snd_bebob *bebob)
 	if (err < 0)
 		goto end;
 
+	/* the starting thread stops them by itself when failing */
+	if (amdtp_duplex_starting(&bebob->duplex))
+		goto end;
+
 	if (amdtp_stream_pcm_running(slave) ||
 	    amdtp_stream_midi_running(slave))
 		goto end;
@@ -557,6 +592,7 @@ int snd_bebob_stream_stop_duplex(struct snd_bebob *bebob)
 	amdtp_stream_stop(master);
 	break_both_connections(bebob);
 end:
+	amdtp_duplex_publish(&bebob->duplex, 0);
 	mutex_unlock(&bebob->mutex);
 	return err;
 }
@@ -569,6 +605,7 @@ void snd_bebob_stream_update_duplex(struct snd_bebob *bebob)
 		amdtp_stream_pcm_abort(&bebob->rx_stream);
 		amdtp_stream_pcm_abort(&bebob->tx_stream);
 		break_both_connections(bebob);
+		amdtp_duplex_publish(&bebob->duplex, 0);
 		mutex_unlock(&bebob->mutex);
 	}
 
@@ -578,7 +615,7 @@ void snd_bebob_stream_update_duplex(struct snd_bebob *bebob)
 
 void snd_bebob_stream_destroy_duplex(struct snd_bebob *bebob)
 {
-	mutex_lock(&bebob->mutex);
+	amdtp_duplex_lock(&bebob->duplex);
 
 	if (amdtp_stream_pcm_running(&bebob->rx_stream))
 		amdtp_stream_pcm_abort(&bebob->rx_stream);
@@ -589,6 +626,7 @@ void snd_bebob_stream_destroy_duplex(struct snd_bebob *bebob)
 	amdtp_stream_stop(&bebob->tx_stream);
 	destroy_both_connections(bebob);
 
+	amdtp_duplex_publish(&bebob->duplex, 0);
 	mutex_unlock(&bebob->mutex);
 }
 
@@ -5,11 +5,13 @@
  * Licensed under the terms of the GNU General Public License, version 2.
  */
 
+#include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/firewire.h>
 #include <linux/firewire-constants.h>
 #include <linux/module.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
 #include "lib.h"
 #include "iso-resources.h"
 #include "cmp.h"
@@ -39,6 +41,10 @@
 #define OPCR_PAYLOAD_MASK	0x000003FF
 #define OPCR_PAYLOAD_SHIFT	0
 
+/* connections are restored in a second after bus reset, in IEC 61883-1 */
+#define RESTORE_TIMEOUT_MS	1000
+#define RESTORE_INTERVAL_MS	100
+
 enum bus_reset_handling {
 	ABORT_ON_BUS_RESET,
 	SUCCEED_ON_BUS_RESET,
@@ -115,6 +121,14 @@ static int pcr_modify(struct cmp_connection *c,
 }
 
 
+static void establish_work(struct work_struct *work)
+{
+	struct cmp_connection *c =
+		container_of(work, struct cmp_connection, establish_work);
+
+	c->establish_err = cmp_connection_establish(c, c->establish_payload);
+}
+
 /**
  * cmp_connection_init - initializes a connection manager
  * @c: the connection manager to initialize
@@ -144,6 +158,7 @@ int cmp_connection_init(struct cmp_connection *c,
 		return err;
 
 	c->connected = false;
+	c->overlaid = false;
 	mutex_init(&c->mutex);
 	c->last_pcr_value = cpu_to_be32(0x80000000);
 	c->pcr_index = pcr_index;
@@ -151,6 +166,7 @@ int cmp_connection_init(struct cmp_connection *c,
 	if (c->max_speed == SCODE_BETA)
 		c->max_speed += (mpr & MPR_XSPEED_MASK) >> MPR_XSPEED_SHIFT;
 	c->direction = direction;
+	INIT_WORK(&c->establish_work, establish_work);
 
 	return 0;
 }
@@ -159,6 +175,9 @@ EXPORT_SYMBOL(cmp_connection_init);
 /**
  * cmp_connection_check_used - check connection is already esablished or not
  * @c: the connection manager to be checked
+ *
+ * An oPCR connected by others is not reported as used, because a connection
+ * can be overlaid on it unless the point-to-point counter is saturated.
  */
 int cmp_connection_check_used(struct cmp_connection *c, bool *used)
 {
@@ -168,18 +187,63 @@ int cmp_connection_check_used(struct cmp_connection *c, bool *used)
 	err = snd_fw_transaction(
 			c->resources.unit, TCODE_READ_QUADLET_REQUEST,
 			get_offset(c, false), &pcr, 4, 0);
-	if (err >= 0)
-		*used = (pcr & cpu_to_be32(PCR_BCAST_CONN | PCR_P2P_CONN_MASK));
+	if (err < 0)
+		return err;
+
+	if (c->direction == CMP_OUTPUT)
+		*used = ((pcr & cpu_to_be32(PCR_P2P_CONN_MASK)) ==
+			 cpu_to_be32(PCR_P2P_CONN_MASK));
+	else
+		*used = (pcr & cpu_to_be32(PCR_BCAST_CONN |
+					    PCR_P2P_CONN_MASK));
 	return err;
 }
 EXPORT_SYMBOL(cmp_connection_check_used);
 
+/**
+ * cmp_connection_check_shared - check others receive from the output plug
+ * @c: the connection manager to be checked
+ * @shared: the result
+ *
+ * When others have point-to-point or broadcast connections to the oPCR, they
+ * receive the stream in current format, thus the caller should not change the
+ * sampling rate. The connection of @c itself is not counted.
+ */
+int cmp_connection_check_shared(struct cmp_connection *c, bool *shared)
+{
+	unsigned int count;
+	__be32 pcr;
+	int err;
+
+	*shared = false;
+	if (c->direction != CMP_OUTPUT)
+		return 0;
+
+	err = snd_fw_transaction(
+			c->resources.unit, TCODE_READ_QUADLET_REQUEST,
+			get_offset(c, false), &pcr, 4, 0);
+	if (err < 0)
+		return err;
+
+	count = (be32_to_cpu(pcr) & PCR_P2P_CONN_MASK) >> PCR_P2P_CONN_SHIFT;
+
+	mutex_lock(&c->mutex);
+	if (c->connected)
+		count--;
+	mutex_unlock(&c->mutex);
+
+	*shared = (count > 0) || (pcr & cpu_to_be32(PCR_BCAST_CONN));
+	return 0;
+}
+EXPORT_SYMBOL(cmp_connection_check_shared);
+
 /**
  * cmp_connection_destroy - free connection manager resources
  * @c: the connection manager
  */
 void cmp_connection_destroy(struct cmp_connection *c)
 {
+	flush_work(&c->establish_work);
 	WARN_ON(c->connected);
 	mutex_destroy(&c->mutex);
 	fw_iso_resources_destroy(&c->resources);
@@ -230,14 +294,21 @@ static __be32 opcr_set_modify(struct cmp_connection *c, __be32 opcr)
 		xspd = 0;
 	}
 
+	/*
+	 * bus reset clears the counter, then each connection is restored by
+	 * the node which established it, as well as the ones overlaid by others
+	 */
+	if ((opcr & cpu_to_be32(PCR_P2P_CONN_MASK)) !=
+						cpu_to_be32(PCR_P2P_CONN_MASK))
+		opcr = cpu_to_be32(be32_to_cpu(opcr) +
+				   (1 << PCR_P2P_CONN_SHIFT));
+
 	opcr &= ~cpu_to_be32(PCR_BCAST_CONN |
-			     PCR_P2P_CONN_MASK |
 			     OPCR_XSPEED_MASK |
 			     PCR_CHANNEL_MASK |
 			     OPCR_SPEED_MASK |
 			     OPCR_OVERHEAD_ID_MASK |
 			     OPCR_PAYLOAD_MASK);
-	opcr |= cpu_to_be32(1 << PCR_P2P_CONN_SHIFT);
 	opcr |= cpu_to_be32(xspd << OPCR_XSPEED_SHIFT);
 	opcr |= cpu_to_be32(c->resources.channel << PCR_CHANNEL_SHIFT);
 	opcr |= cpu_to_be32(spd << OPCR_SPEED_SHIFT);
@@ -269,6 +340,133 @@ static int pcr_set_check(struct cmp_connection *c, __be32 pcr)
 	return 0;
 }
 
+static int pcr_online_check(struct cmp_connection *c, __be32 pcr)
+{
+	if (!(pcr & cpu_to_be32(PCR_ONLINE))) {
+		cmp_error(c, "plug is not on-line\n");
+		return -ECONNREFUSED;
+	}
+
+	return 0;
+}
+
+static __be32 pcr_overlay_modify(struct cmp_connection *c, __be32 pcr)
+{
+	return cpu_to_be32(be32_to_cpu(pcr) + (1 << PCR_P2P_CONN_SHIFT));
+}
+
+static int pcr_overlay_check(struct cmp_connection *c, __be32 pcr)
+{
+	/* the connection has been broken, then retry to establish it */
+	if (!(pcr & cpu_to_be32(PCR_BCAST_CONN | PCR_P2P_CONN_MASK)))
+		return -EAGAIN;
+	if ((pcr & cpu_to_be32(PCR_P2P_CONN_MASK)) ==
+	    cpu_to_be32(PCR_P2P_CONN_MASK)) {
+		cmp_error(c, "no more connections can be overlaid\n");
+		return -EBUSY;
+	}
+
+	return pcr_online_check(c, pcr);
+}
+
+static void update_generation(struct cmp_connection *c)
+{
+	struct fw_device *device = fw_parent_device(c->resources.unit);
+
+	c->resources.generation = device->generation;
+	smp_rmb(); /* node_id vs. generation */
+}
+
+/*
+ * Returns 1 when a connection is overlaid on the one established by others,
+ * 0 when the oPCR is not connected, or a negative error code.
+ */
+static int overlay_connection(struct cmp_connection *c)
+{
+	__be32 pcr;
+	u32 value;
+	int err;
+
+	update_generation(c);
+
+	err = snd_fw_transaction(c->resources.unit, TCODE_READ_QUADLET_REQUEST,
+				 get_offset(c, false), &pcr, 4,
+				 FW_FIXED_GENERATION | c->resources.generation);
+	if (err < 0)
+		return err;
+	c->last_pcr_value = pcr;
+	if (!(pcr & cpu_to_be32(PCR_BCAST_CONN | PCR_P2P_CONN_MASK)))
+		return 0;
+
+	err = pcr_overlay_check(c, pcr);
+	if (err < 0)
+		return err;
+
+	err = pcr_modify(c, pcr_overlay_modify, pcr_overlay_check,
+			 ABORT_ON_BUS_RESET);
+	if (err < 0)
+		return err;
+
+	/* receive packets in the channel and speed which the talker uses */
+	value = be32_to_cpu(c->last_pcr_value);
+	c->resources.channel = (value & PCR_CHANNEL_MASK) >> PCR_CHANNEL_SHIFT;
+	c->speed = (value & OPCR_SPEED_MASK) >> OPCR_SPEED_SHIFT;
+	if (c->speed == SCODE_800)
+		c->speed += (value & OPCR_XSPEED_MASK) >> OPCR_XSPEED_SHIFT;
+	c->overlaid = true;
+
+	return 1;
+}
+
+/*
+ * After bus reset, the owner of resources restores its connection at first,
+ * then the overlaid one is restored by incrementing the counter again. When
+ * the owner does not restore it in time, the overlaid one is broken as well.
+ */
+static int restore_overlaid_connection(struct cmp_connection *c)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(RESTORE_TIMEOUT_MS);
+	unsigned int channel;
+	__be32 pcr;
+	int err;
+
+	for (;;) {
+		update_generation(c);
+
+		err = snd_fw_transaction(c->resources.unit,
+					 TCODE_READ_QUADLET_REQUEST,
+					 get_offset(c, false), &pcr, 4,
+					 FW_FIXED_GENERATION |
+					 c->resources.generation);
+		if (err == -EAGAIN)
+			return 0;	/* restored after the next bus reset */
+		if (err < 0)
+			return err;
+		c->last_pcr_value = pcr;
+
+		if (pcr & cpu_to_be32(PCR_BCAST_CONN | PCR_P2P_CONN_MASK)) {
+			channel = (be32_to_cpu(pcr) & PCR_CHANNEL_MASK) >>
+							PCR_CHANNEL_SHIFT;
+			if (channel != c->resources.channel) {
+				cmp_error(c, "channel is changed by others\n");
+				return -ECONNRESET;
+			}
+
+			err = pcr_modify(c, pcr_overlay_modify,
+					 pcr_overlay_check,
+					 SUCCEED_ON_BUS_RESET);
+			if (err != -EAGAIN)
+				return err;
+		}
+
+		if (time_after(jiffies, timeout)) {
+			cmp_error(c, "connection is not restored by others\n");
+			return -ECONNRESET;
+		}
+		msleep(RESTORE_INTERVAL_MS);
+	}
+}
+
 /**
  * cmp_connection_establish - establish a connection to the target
  * @c: the connection manager
@@ -279,6 +477,11 @@ static int pcr_set_check(struct cmp_connection *c, __be32 pcr)
  * bandwidth) and setting the target's input/output plug control register.
  * When this function succeeds, the caller is responsible for starting
  * transmitting packets.
+ *
+ * When the target's oPCR is already connected by others, the connection is
+ * overlaid on the existing one by incrementing its point-to-point counter.
+ * Then no resources are allocated, and the caller should receive packets in
+ * the channel and speed of the existing connection.
  */
 int cmp_connection_establish(struct cmp_connection *c,
 			     unsigned int max_payload_bytes)
@@ -294,6 +497,16 @@ int cmp_connection_establish(struct cmp_connection *c,
 	mutex_lock(&c->mutex);
 
 retry_after_bus_reset:
+	if (c->direction == CMP_OUTPUT) {
+		err = overlay_connection(c);
+		if (err == -EAGAIN)
+			goto retry_after_bus_reset;
+		if (err < 0)
+			goto err_mutex;
+		if (err > 0)
+			goto connected;
+	}
+
 	err = fw_iso_resources_allocate(&c->resources,
 					max_payload_bytes, c->speed);
 	if (err < 0)
@@ -312,7 +525,7 @@ retry_after_bus_reset:
 	}
 	if (err < 0)
 		goto err_resources;
-
+connected:
 	c->connected = true;
 
 	mutex_unlock(&c->mutex);
@@ -328,12 +541,76 @@ err_mutex:
 }
 EXPORT_SYMBOL(cmp_connection_establish);
 
+/**
+ * cmp_connection_establish_async - start establishing a connection
+ * @c: the connection manager
+ * @max_payload_bytes: the amount of data (including CIP headers) per packet
+ *
+ * This function runs cmp_connection_establish() in a workqueue and returns
+ * at once, so that transactions for several connections are in flight
+ * together. The caller must retrieve the result by
+ * cmp_connection_establish_wait().
+ */
+void cmp_connection_establish_async(struct cmp_connection *c,
+				    unsigned int max_payload_bytes)
+{
+	c->establish_payload = max_payload_bytes;
+	c->establish_err = -EINPROGRESS;
+	queue_work(system_unbound_wq, &c->establish_work);
+}
+EXPORT_SYMBOL(cmp_connection_establish_async);
+
+/**
+ * cmp_connection_establish_wait - wait for asynchronous establishment
+ * @c: the connection manager
+ *
+ * Returns zero when the connection is established, or a negative error code.
+ */
+int cmp_connection_establish_wait(struct cmp_connection *c)
+{
+	flush_work(&c->establish_work);
+	return c->establish_err;
+}
+EXPORT_SYMBOL(cmp_connection_establish_wait);
+
+/**
+ * cmp_connection_establish_pair - establish two connections concurrently
+ * @a: the connection manager for one connection
+ * @a_max_payload: the amount of data per packet for @a
+ * @b: the connection manager for the other connection
+ * @b_max_payload: the amount of data per packet for @b
+ *
+ * IRM transactions and PCR updates for both connections are in flight at the
+ * same time. Both connections are established, or both are broken when
+ * either of them fails.
+ */
+int cmp_connection_establish_pair(struct cmp_connection *a,
+				  unsigned int a_max_payload,
+				  struct cmp_connection *b,
+				  unsigned int b_max_payload)
+{
+	int a_err, b_err;
+
+	cmp_connection_establish_async(a, a_max_payload);
+	b_err = cmp_connection_establish(b, b_max_payload);
+	a_err = cmp_connection_establish_wait(a);
+
+	if (a_err < 0 || b_err < 0) {
+		cmp_connection_break(b);
+		cmp_connection_break(a);
+	}
+
+	return (a_err < 0) ? a_err : b_err;
+}
+EXPORT_SYMBOL(cmp_connection_establish_pair);
+
 /**
  * cmp_connection_update - update the connection after a bus reset
  * @c: the connection manager
  *
  * This function must be called from the driver's .update handler to
- * reestablish any connection that might have been active.
+ * reestablish any connection that might have been active. An overlaid
+ * connection waits up to a second for the owner to restore its connection.
  *
  * Returns zero on success, or a negative error code.  On an error, the
  * connection is broken and the caller must stop transmitting iso packets.
@@ -349,12 +626,21 @@ int cmp_connection_update(struct cmp_connection *c)
 		return 0;
 	}
 
+	if (c->overlaid) {
+		err = restore_overlaid_connection(c);
+		if (err < 0)
+			goto err_unconnect;
+		mutex_unlock(&c->mutex);
+		return 0;
+	}
+
 	err = fw_iso_resources_update(&c->resources);
 	if (err < 0)
 		goto err_unconnect;
 
+	/* the plug can be connected by others which overlay on this */
 	if (c->direction == CMP_OUTPUT)
-		err = pcr_modify(c, opcr_set_modify, pcr_set_check,
+		err = pcr_modify(c, opcr_set_modify, pcr_online_check,
 				 SUCCEED_ON_BUS_RESET);
 	else
 		err = pcr_modify(c, ipcr_set_modify, pcr_set_check,
@@ -371,15 +657,20 @@ err_resources:
 	fw_iso_resources_free(&c->resources);
 err_unconnect:
 	c->connected = false;
+	c->overlaid = false;
 	mutex_unlock(&c->mutex);
 
 	return err;
 }
 EXPORT_SYMBOL(cmp_connection_update);
 
+/* connections overlaid by others are kept */
 static __be32 pcr_break_modify(struct cmp_connection *c, __be32 pcr)
 {
-	return pcr & ~cpu_to_be32(PCR_BCAST_CONN | PCR_P2P_CONN_MASK);
+	if (pcr & cpu_to_be32(PCR_P2P_CONN_MASK))
+		pcr = cpu_to_be32(be32_to_cpu(pcr) - (1 << PCR_P2P_CONN_SHIFT));
+
+	return pcr;
 }
 
 /**
@@ -389,6 +680,12 @@ static __be32 pcr_break_modify(struct cmp_connection *c, __be32 pcr)
  * This function deactives the connection in the target's input/output plug
  * control register, and frees the isochronous resources of the connection.
  * Before calling this function, the caller should cease transmitting packets.
+ * An overlaid connection just decrements the point-to-point counter.
+ *
+ * When connections overlaid by others remain on the oPCR, the resources are
+ * left allocated for them, and released by the IRM at the next bus reset
+ * because nobody reallocates them. Then the overlaid connections are broken
+ * because the owner does not restore the connection.
  */
 void cmp_connection_break(struct cmp_connection *c)
 {
@@ -401,13 +698,24 @@ void cmp_connection_break(struct cmp_connection *c)
 		return;
 	}
 
+	if (c->overlaid)
+		update_generation(c);
+
 	err = pcr_modify(c, pcr_break_modify, NULL, SUCCEED_ON_BUS_RESET);
 	if (err < 0)
 		cmp_error(c, "plug is still connected\n");
 
-	fw_iso_resources_free(&c->resources);
+	if (!c->overlaid) {
+		/* connections overlaid by others still use the resources */
+		if (err == 0 &&
+		    (c->last_pcr_value & cpu_to_be32(PCR_P2P_CONN_MASK)))
+			fw_iso_resources_abandon(&c->resources);
+		else
+			fw_iso_resources_free(&c->resources);
+	}
 
 	c->connected = false;
+	c->overlaid = false;
 
 	mutex_unlock(&c->mutex);
 }
@@ -3,6 +3,7 @@
 
 #include <linux/mutex.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include "iso-resources.h"
 
 struct fw_unit;
@@ -20,18 +21,24 @@ enum cmp_direction {
  * computer and a device's input plug (iPCR) and output plug (oPCR).
  *
  * There is no corresponding oPCR created on the local computer, so it is not
- * possible to overlay connections on top of this one.
+ * possible to overlay connections on top of this one. Instead, a connection
+ * to a device's oPCR can be overlaid on the one established by others.
  */
 struct cmp_connection {
 	int speed;
 	/* private: */
 	bool connected;
+	bool overlaid;
 	struct mutex mutex;
 	struct fw_iso_resources resources;
 	__be32 last_pcr_value;
 	unsigned int pcr_index;
 	unsigned int max_speed;
 	enum cmp_direction direction;
+
+	struct work_struct establish_work;
+	unsigned int establish_payload;
+	int establish_err;
 };
 
 int cmp_connection_init(struct cmp_connection *connection,
@@ -39,10 +46,19 @@ int cmp_connection_init(struct cmp_connection *connection,
 			enum cmp_direction direction,
 			unsigned int pcr_index);
 int cmp_connection_check_used(struct cmp_connection *connection, bool *used);
+int cmp_connection_check_shared(struct cmp_connection *connection,
+				bool *shared);
 void cmp_connection_destroy(struct cmp_connection *connection);
 
 int cmp_connection_establish(struct cmp_connection *connection,
 			     unsigned int max_payload);
+void cmp_connection_establish_async(struct cmp_connection *connection,
+				    unsigned int max_payload);
+int cmp_connection_establish_wait(struct cmp_connection *connection);
+int cmp_connection_establish_pair(struct cmp_connection *a,
+				  unsigned int a_max_payload,
+				  struct cmp_connection *b,
+				  unsigned int b_max_payload);
 int cmp_connection_update(struct cmp_connection *connection);
 void cmp_connection_break(struct cmp_connection *connection);
 
@@ -0,0 +1,261 @@
+/*
+ * correlation between isochronous cycle time and CLOCK_MONOTONIC
+ *
+ * Licensed under the terms of the GNU General Public License, version 2.
+ */
+
+#include <linux/export.h>
+#include <linux/firewire.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include "cycle-clock.h"
+
+#define CYCLES_PER_SECOND	8000
+#define TICKS_PER_CYCLE		3072
+/* isochronous contexts report the lowest three bits of seconds */
+#define CYCLES_IN_WRAP		(8 * CYCLES_PER_SECOND)
+#define TICKS_IN_WRAP		(CYCLES_IN_WRAP * TICKS_PER_CYCLE)
+
+/* in picoseconds, and the tolerance for both of crystals */
+#define NOMINAL_PERIOD		125000000
+#define MAX_PERIOD_DEVIATION	(NOMINAL_PERIOD / 1000)
+
+/* the register is read at this rate, and the slow reads are dropped */
+#define SAMPLE_INTERVAL_MS	10
+#define MAX_READ_NS		20000
+
+/* the model is reset when a sample is too far from the prediction */
+#define MAX_ERROR_NS		1000000
+#define MAX_INTERVAL_NS		NSEC_PER_SEC
+
+static LIST_HEAD(clocks);
+static DEFINE_MUTEX(clocks_mutex);
+
+/**
+ * cycle_clock_get - get the cycle clock of a FireWire card
+ * @card: the card
+ *
+ * The clock is shared by all of the callers for the same card, and released
+ * when all of them call cycle_clock_put().
+ */
+struct cycle_clock *cycle_clock_get(struct fw_card *card)
+{
+	struct cycle_clock *clock;
+
+	mutex_lock(&clocks_mutex);
+
+	list_for_each_entry(clock, &clocks, list) {
+		if (clock->card == card)
+			goto end;
+	}
+
+	clock = kzalloc(sizeof(struct cycle_clock), GFP_KERNEL);
+	if (clock == NULL) {
+		clock = ERR_PTR(-ENOMEM);
+		goto unlock;
+	}
+	clock->card = card;
+	spin_lock_init(&clock->lock);
+	seqcount_init(&clock->seq);
+	list_add_tail(&clock->list, &clocks);
+end:
+	clock->refs++;
+unlock:
+	mutex_unlock(&clocks_mutex);
+	return clock;
+}
+EXPORT_SYMBOL(cycle_clock_get);
+
+/**
+ * cycle_clock_put - release the cycle clock
+ * @clock: the clock returned by cycle_clock_get()
+ */
+void cycle_clock_put(struct cycle_clock *clock)
+{
+	mutex_lock(&clocks_mutex);
+	if (--clock->refs == 0) {
+		list_del(&clock->list);
+		kfree(clock);
+	}
+	mutex_unlock(&clocks_mutex);
+}
+EXPORT_SYMBOL(cycle_clock_put);
+
+static inline u32 cycle_time_to_ticks(u32 cycle_time)
+{
+	return (((cycle_time >> 25) & 0x07) * CYCLES_PER_SECOND +
+		((cycle_time >> 12) & 0x1fff)) * TICKS_PER_CYCLE +
+	       (cycle_time & 0x0fff);
+}
+
+static inline u32 ticks_to_cycle_time(u32 ticks)
+{
+	unsigned int cycles = ticks / TICKS_PER_CYCLE;
+
+	return ((cycles / CYCLES_PER_SECOND) << 25) |
+	       ((cycles % CYCLES_PER_SECOND) << 12) |
+	       (ticks % TICKS_PER_CYCLE);
+}
+
+/**
+ * cycle_clock_sample - sample the cycle timer together with the system time
+ * @clock: the cycle clock
+ *
+ * This is called in isochronous callbacks, but reads the CYCLE_TIME register
+ * at most once per SAMPLE_INTERVAL_MS. The register is read between two
+ * readings of the system time, and the pair is dropped when the read takes
+ * long. The model is filtered as a delay-locked loop. Several streams on the
+ * same card can feed the clock.
+ */
+void cycle_clock_sample(struct cycle_clock *clock)
+{
+	unsigned int ticks, elapsed;
+	u64 before, now, predicted;
+	s64 err, period;
+	u32 cycle_time;
+	unsigned long flags;
+
+	if (time_before(jiffies, ACCESS_ONCE(clock->next_sample)))
+		return;
+
+	spin_lock_irqsave(&clock->lock, flags);
+
+	if (time_before(jiffies, clock->next_sample))
+		goto end;
+	clock->next_sample = jiffies + msecs_to_jiffies(SAMPLE_INTERVAL_MS);
+
+	before = ktime_to_ns(ktime_get());
+	if (fw_card_read_cycle_time(clock->card, &cycle_time) < 0)
+		goto end;
+	now = ktime_to_ns(ktime_get());
+	if (now - before > MAX_READ_NS)
+		goto end;
+	now = before + (now - before) / 2;
+	ticks = cycle_time_to_ticks(cycle_time);
+
+	if (!clock->valid || (s64)(now - clock->base_ns) > MAX_INTERVAL_NS)
+		goto reset;
+
+	elapsed = (ticks + TICKS_IN_WRAP - clock->base_ticks) % TICKS_IN_WRAP;
+	if ((elapsed == 0) || (elapsed >= TICKS_IN_WRAP / 2))
+		goto end;
+
+	predicted = clock->base_ns +
+		    div_u64((u64)elapsed * clock->period,
+			    TICKS_PER_CYCLE * 1000);
+	err = (s64)(now - predicted);
+	if ((err > MAX_ERROR_NS) || (err < -MAX_ERROR_NS))
+		goto reset;
+
+	period = clock->period +
+		 div_s64(div_s64(err * 1000 * TICKS_PER_CYCLE, elapsed), 64);
+	clock->period = clamp_t(s64, period,
+				NOMINAL_PERIOD - MAX_PERIOD_DEVIATION,
+				NOMINAL_PERIOD + MAX_PERIOD_DEVIATION);
+	clock->base_ns = predicted + div_s64(err, 8);
+	clock->base_ticks = ticks;
+	goto publish;
+reset:
+	clock->valid = true;
+	clock->base_ticks = ticks;
+	clock->base_ns = now;
+	clock->period = NOMINAL_PERIOD;
+publish:
+	write_seqcount_begin(&clock->seq);
+	clock->model.cycle_time = ticks_to_cycle_time(clock->base_ticks);
+	clock->model.period = clock->period;
+	clock->model.ns = clock->base_ns;
+	write_seqcount_end(&clock->seq);
+end:
+	spin_unlock_irqrestore(&clock->lock, flags);
+}
+EXPORT_SYMBOL(cycle_clock_sample);
+
+/**
+ * cycle_clock_read - read the current model
+ * @clock: the cycle clock
+ * @model: the buffer to store the model
+ *
+ * Returns -ENODATA if no isochronous context has fed the clock yet. This never
+ * blocks and never touches the hardware.
+ */
+int cycle_clock_read(struct cycle_clock *clock,
+		     struct cycle_clock_model *model)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&clock->seq);
+		*model = clock->model;
+	} while (read_seqcount_retry(&clock->seq, seq));
+
+	return (model->period > 0) ? 0 : -ENODATA;
+}
+EXPORT_SYMBOL(cycle_clock_read);
+
+/**
+ * cycle_clock_to_ktime - convert a cycle time to CLOCK_MONOTONIC
+ * @clock: the cycle clock
+ * @cycle_time: the cycle time in the format of CYCLE_TIME register
+ * @time: the buffer to store the converted time
+ *
+ * The cycle time is regarded as the nearest one to the reference point within
+ * eight seconds.
+ */
+int cycle_clock_to_ktime(struct cycle_clock *clock, u32 cycle_time,
+			 ktime_t *time)
+{
+	struct cycle_clock_model model;
+	s64 delta;
+	int err;
+
+	err = cycle_clock_read(clock, &model);
+	if (err < 0)
+		return err;
+
+	delta = (cycle_time_to_ticks(cycle_time) + TICKS_IN_WRAP -
+		 cycle_time_to_ticks(model.cycle_time)) % TICKS_IN_WRAP;
+	if (delta >= TICKS_IN_WRAP / 2)
+		delta -= TICKS_IN_WRAP;
+
+	*time = ns_to_ktime(model.ns +
+			    div_s64(delta * model.period,
+				    TICKS_PER_CYCLE * 1000));
+	return 0;
+}
+EXPORT_SYMBOL(cycle_clock_to_ktime);
+
+/**
+ * cycle_clock_from_ktime - convert CLOCK_MONOTONIC to a cycle time
+ * @clock: the cycle clock
+ * @time: the system time, within four seconds from the reference point
+ * @cycle_time: the buffer to store the cycle time
+ */
+int cycle_clock_from_ktime(struct cycle_clock *clock, ktime_t time,
+			   u32 *cycle_time)
+{
+	struct cycle_clock_model model;
+	s64 delta;
+	int err;
+
+	err = cycle_clock_read(clock, &model);
+	if (err < 0)
+		return err;
+
+	delta = ktime_to_ns(time) - (s64)model.ns;
+	if ((delta > 4LL * NSEC_PER_SEC) || (delta < -4LL * NSEC_PER_SEC))
+		return -ERANGE;
+
+	delta = div_s64(delta * TICKS_PER_CYCLE * 1000, model.period) +
+		cycle_time_to_ticks(model.cycle_time);
+	if (delta < 0)
+		delta += TICKS_IN_WRAP;
+	else if (delta >= TICKS_IN_WRAP)
+		delta -= TICKS_IN_WRAP;
+
+	*cycle_time = ticks_to_cycle_time(delta);
+	return 0;
+}
+EXPORT_SYMBOL(cycle_clock_from_ktime);
@@ -0,0 +1,60 @@
+#ifndef SOUND_FIREWIRE_CYCLE_CLOCK_H_INCLUDED
+#define SOUND_FIREWIRE_CYCLE_CLOCK_H_INCLUDED
+
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct fw_card;
+
+/**
+ * struct cycle_clock_model - a linear model between bus and system time
+ * @cycle_time: the reference point, in the format of CYCLE_TIME register.
+ *		Only the lowest three bits of the second field are valid.
+ * @period: the length of one isochronous cycle, in picoseconds
+ * @ns: CLOCK_MONOTONIC at the reference point, in nanoseconds
+ */
+struct cycle_clock_model {
+	u32 cycle_time;
+	u32 period;
+	u64 ns;
+};
+
+/**
+ * struct cycle_clock - correlates bus cycle time with CLOCK_MONOTONIC
+ *
+ * This structure is shared by all of streams on the same FireWire card. The
+ * model is updated in isochronous callbacks and can be read without locks.
+ */
+struct cycle_clock {
+	/* private: */
+	struct fw_card *card;
+	struct list_head list;
+	unsigned int refs;
+
+	spinlock_t lock;
+	unsigned long next_sample;	/* in jiffies */
+	bool valid;
+	u32 base_ticks;			/* in eight seconds */
+	u64 base_ns;
+	u32 period;
+
+	seqcount_t seq;
+	struct cycle_clock_model model;
+};
+
+struct cycle_clock *cycle_clock_get(struct fw_card *card);
+void cycle_clock_put(struct cycle_clock *clock);
+
+void cycle_clock_sample(struct cycle_clock *clock);
+
+int cycle_clock_read(struct cycle_clock *clock,
+		     struct cycle_clock_model *model);
+int cycle_clock_to_ktime(struct cycle_clock *clock, u32 cycle_time,
+			 ktime_t *time);
+int cycle_clock_from_ktime(struct cycle_clock *clock, ktime_t time,
+			   u32 *cycle_time);
+
+#endif
@@ -41,11 +41,14 @@ struct dice {
 	struct fw_unit *unit;
 	spinlock_t lock;
 	struct mutex mutex;
+	struct snd_fw_recovery recovery;
 	unsigned int global_offset;
 	unsigned int rx_offset;
 	unsigned int clock_caps;
 	unsigned int rx_channels[3];
 	unsigned int rx_midi_ports[3];
+	unsigned int known_modes;
+	unsigned int offered_modes;
 	struct fw_address_handler notification_handler;
 	int owner_generation;
 	int dev_lock_count; /* > 0 driver, < 0 userspace */
@@ -62,6 +65,17 @@ MODULE_DESCRIPTION("DICE driver");
 MODULE_AUTHOR("Clemens Ladisch <clemens@ladisch.de>");
 MODULE_LICENSE("GPL v2");
 
+/* the parameters of each mode, kept over reconnection */
+struct dice_params_cache {
+	u64 guid;
+	unsigned int known_modes;
+	unsigned int rx_channels[3];
+	unsigned int rx_midi_ports[3];
+};
+static struct dice_params_cache params_cache[8];
+static unsigned int params_cache_next;
+static DEFINE_MUTEX(params_cache_mutex);
+
 static const unsigned int dice_rates[] = {
 	/* mode 0 */
 	[0] =  32000,
@@ -318,6 +332,205 @@ static void dice_notification(struct fw_card *card, struct fw_request *request,
 	wake_up(&dice->hwdep_wait);
 }
 
+static int dice_change_rate(struct dice *dice, unsigned int clock_rate)
+{
+	__be32 value;
+	int err;
+
+	INIT_COMPLETION(dice->clock_accepted);
+
+	value = cpu_to_be32(clock_rate | CLOCK_SOURCE_ARX1);
+	err = snd_fw_transaction(dice->unit, TCODE_WRITE_QUADLET_REQUEST,
+				 global_address(dice, GLOBAL_CLOCK_SELECT),
+				 &value, 4, 0);
+	if (err < 0)
+		return err;
+
+	if (!wait_for_completion_timeout(&dice->clock_accepted,
+					 msecs_to_jiffies(100)))
+		dev_warn(&dice->unit->device, "clock change timed out\n");
+
+	return 0;
+}
+
+/* the rate is supported, and the parameters of its mode have been read */
+static bool dice_rate_known(struct dice *dice, unsigned int rate_index)
+{
+	return (dice->clock_caps & (1 << rate_index)) &&
+	       (dice->known_modes & (1 << rate_index_to_mode(rate_index)));
+}
+
+static int highest_supported_mode_rate(struct dice *dice, unsigned int mode)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(dice_rates) - 1; i >= 0; --i)
+		if ((dice->clock_caps & (1 << i)) &&
+		    rate_index_to_mode(i) == mode)
+			return i;
+
+	return -1;
+}
+
+/* reads the parameters of the mode, in which the device should be now */
+static int dice_read_mode_params(struct dice *dice, unsigned int mode)
+{
+	__be32 values[2];
+	int err;
+
+	err = snd_fw_transaction(dice->unit, TCODE_READ_BLOCK_REQUEST,
+				 rx_address(dice, RX_NUMBER_AUDIO),
+				 values, 2 * 4, 0);
+	if (err < 0)
+		return err;
+
+	dice->rx_channels[mode]   = be32_to_cpu(values[0]);
+	dice->rx_midi_ports[mode] = be32_to_cpu(values[1]);
+	dice->known_modes |= 1 << mode;
+
+	return 0;
+}
+
+static u64 dice_guid(struct dice *dice)
+{
+	struct fw_device *dev = fw_parent_device(dice->unit);
+
+	return ((u64)dev->config_rom[3] << 32) | dev->config_rom[4];
+}
+
+/* call with params_cache_mutex held */
+static struct dice_params_cache *find_params_cache(u64 guid)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(params_cache); ++i)
+		if (params_cache[i].known_modes != 0 &&
+		    params_cache[i].guid == guid)
+			return &params_cache[i];
+
+	return NULL;
+}
+
+static void dice_load_params(struct dice *dice)
+{
+	struct dice_params_cache *cache;
+	unsigned int mode;
+
+	mutex_lock(&params_cache_mutex);
+
+	cache = find_params_cache(dice_guid(dice));
+	if (cache != NULL) {
+		for (mode = 0; mode < 3; ++mode) {
+			if (!(cache->known_modes & (1 << mode)))
+				continue;
+			dice->rx_channels[mode] = cache->rx_channels[mode];
+			dice->rx_midi_ports[mode] = cache->rx_midi_ports[mode];
+		}
+		dice->known_modes |= cache->known_modes;
+	}
+
+	mutex_unlock(&params_cache_mutex);
+}
+
+static void dice_save_params(struct dice *dice)
+{
+	struct dice_params_cache *cache;
+	u64 guid = dice_guid(dice);
+
+	mutex_lock(&params_cache_mutex);
+
+	cache = find_params_cache(guid);
+	if (cache == NULL) {
+		cache = &params_cache[params_cache_next];
+		params_cache_next = (params_cache_next + 1) %
+						ARRAY_SIZE(params_cache);
+		cache->guid = guid;
+	}
+	memcpy(cache->rx_channels, dice->rx_channels,
+	       sizeof(cache->rx_channels));
+	memcpy(cache->rx_midi_ports, dice->rx_midi_ports,
+	       sizeof(cache->rx_midi_ports));
+	cache->known_modes = dice->known_modes;
+
+	mutex_unlock(&params_cache_mutex);
+}
+
+/*
+ * The clock may be used by another host, which owns the device or has enabled
+ * its streams, even if this driver streams nothing.
+ */
+static bool dice_clock_in_use(struct dice *dice)
+{
+	struct fw_device *device = fw_parent_device(dice->unit);
+	__be64 *owner;
+	__be32 enable;
+	bool in_use = true;
+	int err;
+
+	if (dice->owner_generation == -1)
+		return true;
+
+	owner = kmalloc(8, GFP_KERNEL);
+	if (!owner)
+		return true;
+
+	err = snd_fw_transaction(dice->unit, TCODE_READ_BLOCK_REQUEST,
+				 global_address(dice, GLOBAL_OWNER),
+				 owner, 8,
+				 FW_FIXED_GENERATION | dice->owner_generation);
+	if (err < 0 ||
+	    *owner != cpu_to_be64(
+			((u64)device->card->node_id << OWNER_NODE_SHIFT) |
+			dice->notification_handler.offset))
+		goto end;
+
+	err = snd_fw_transaction(dice->unit, TCODE_READ_QUADLET_REQUEST,
+				 global_address(dice, GLOBAL_ENABLE),
+				 &enable, 4,
+				 FW_FIXED_GENERATION | dice->owner_generation);
+	if (err < 0 || enable != 0)
+		goto end;
+
+	in_use = false;
+end:
+	kfree(owner);
+	return in_use;
+}
+
+/*
+ * Reading the parameters of a mode requires to switch the clock of the device,
+ * thus an unknown mode is read in hw_params for the requested rate only. While
+ * the clock is in use, only the known modes are offered.
+ */
+static void dice_update_offered_modes(struct dice *dice)
+{
+	mutex_lock(&dice->mutex);
+	dice->offered_modes = dice->known_modes;
+	if (dice->known_modes != 0x7 && !dice_clock_in_use(dice))
+		dice->offered_modes = 0x7;
+	mutex_unlock(&dice->mutex);
+}
+
+static bool dice_rate_offered(struct dice *dice, unsigned int rate_index)
+{
+	return (dice->clock_caps & (1 << rate_index)) &&
+	       (dice->offered_modes & (1 << rate_index_to_mode(rate_index)));
+}
+
+/* any number of channels is allowed until the mode is read */
+static void dice_mode_channels(struct dice *dice, unsigned int mode,
+			       struct snd_interval *channels)
+{
+	if (dice->known_modes & (1 << mode)) {
+		channels->min = min(channels->min, dice->rx_channels[mode]);
+		channels->max = max(channels->max, dice->rx_channels[mode]);
+	} else {
+		channels->min = 1;
+		channels->max = max(channels->max,
+				    (unsigned int)AMDTP_MAX_CHANNELS_FOR_PCM);
+	}
+}
+
 static int dice_rate_constraint(struct snd_pcm_hw_params *params,
 				struct snd_pcm_hw_rule *rule)
 {
@@ -333,7 +546,9 @@ static int dice_rate_constraint(struct snd_pcm_hw_params *params,
 
 	for (i = 0; i < ARRAY_SIZE(dice_rates); ++i) {
 		mode = rate_index_to_mode(i);
-		if ((dice->clock_caps & (1 << i)) &&
+		if (!dice_rate_offered(dice, i))
+			continue;
+		if (!dice_rate_known(dice, i) ||
 		    snd_interval_test(channels, dice->rx_channels[mode])) {
 			allowed_rates.min = min(allowed_rates.min,
 						dice_rates[i]);
@@ -356,17 +571,13 @@ static int dice_channels_constraint(struct snd_pcm_hw_params *params,
 	struct snd_interval allowed_channels = {
 		.min = UINT_MAX, .max = 0, .integer = 1
 	};
-	unsigned int i, mode;
+	unsigned int i;
 
 	for (i = 0; i < ARRAY_SIZE(dice_rates); ++i)
-		if ((dice->clock_caps & (1 << i)) &&
-		    snd_interval_test(rate, dice_rates[i])) {
-			mode = rate_index_to_mode(i);
-			allowed_channels.min = min(allowed_channels.min,
-						   dice->rx_channels[mode]);
-			allowed_channels.max = max(allowed_channels.max,
-						   dice->rx_channels[mode]);
-		}
+		if (dice_rate_offered(dice, i) &&
+		    snd_interval_test(rate, dice_rates[i]))
+			dice_mode_channels(dice, rate_index_to_mode(i),
+					   &allowed_channels);
 
 	return snd_interval_refine(channels, &allowed_channels);
 }
@@ -390,6 +601,9 @@ static int dice_open(struct snd_pcm_substream *substream)
 	};
 	struct dice *dice = substream->private_data;
 	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_interval channels = {
+		.min = UINT_MAX, .max = 0, .integer = 1
+	};
 	unsigned int i;
 	int err;
 
@@ -397,21 +611,20 @@ static int dice_open(struct snd_pcm_substream *substream)
 	if (err < 0)
 		goto error;
 
+	dice_update_offered_modes(dice);
+
 	runtime->hw = hardware;
 
 	for (i = 0; i < ARRAY_SIZE(dice_rates); ++i)
-		if (dice->clock_caps & (1 << i))
+		if (dice_rate_offered(dice, i)) {
 			runtime->hw.rates |=
 				snd_pcm_rate_to_rate_bit(dice_rates[i]);
-	snd_pcm_limit_hw_rates(runtime);
-
-	for (i = 0; i < 3; ++i)
-		if (dice->rx_channels[i]) {
-			runtime->hw.channels_min = min(runtime->hw.channels_min,
-						       dice->rx_channels[i]);
-			runtime->hw.channels_max = max(runtime->hw.channels_max,
-						       dice->rx_channels[i]);
+			dice_mode_channels(dice, rate_index_to_mode(i),
+					   &channels);
 		}
+	snd_pcm_limit_hw_rates(runtime);
+	runtime->hw.channels_min = channels.min;
+	runtime->hw.channels_max = channels.max;
 
 	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
 				  dice_rate_constraint, dice,
@@ -542,27 +755,6 @@ static void dice_stream_stop(struct dice *dice)
 	fw_iso_resources_free(&dice->resources);
 }
 
-static int dice_change_rate(struct dice *dice, unsigned int clock_rate)
-{
-	__be32 value;
-	int err;
-
-	INIT_COMPLETION(dice->clock_accepted);
-
-	value = cpu_to_be32(clock_rate | CLOCK_SOURCE_ARX1);
-	err = snd_fw_transaction(dice->unit, TCODE_WRITE_QUADLET_REQUEST,
-				 global_address(dice, GLOBAL_CLOCK_SELECT),
-				 &value, 4, 0);
-	if (err < 0)
-		return err;
-
-	if (!wait_for_completion_timeout(&dice->clock_accepted,
-					 msecs_to_jiffies(100)))
-		dev_warn(&dice->unit->device, "clock change timed out\n");
-
-	return 0;
-}
-
 static int dice_hw_params(struct snd_pcm_substream *substream,
 			  struct snd_pcm_hw_params *hw_params)
 {
@@ -584,7 +776,19 @@ static int dice_hw_params(struct snd_pcm_substream *substream,
 	if (err < 0)
 		return err;
 
+	/* the device is in the mode now, thus it can be read */
 	mode = rate_index_to_mode(rate_index);
+	if (!(dice->known_modes & (1 << mode))) {
+		mutex_lock(&dice->mutex);
+		err = dice_read_mode_params(dice, mode);
+		if (err >= 0)
+			dice_save_params(dice);
+		mutex_unlock(&dice->mutex);
+		if (err < 0)
+			return err;
+	}
+	if (params_channels(hw_params) != dice->rx_channels[mode])
+		return -EINVAL;
 	amdtp_stream_set_parameters(&dice->stream,
 				    params_rate(hw_params),
 				    params_channels(hw_params),
@@ -1203,51 +1407,12 @@ static int dice_interface_check(struct fw_unit *unit)
 	return 0;
 }
 
-static int highest_supported_mode_rate(struct dice *dice, unsigned int mode)
-{
-	int i;
-
-	for (i = ARRAY_SIZE(dice_rates) - 1; i >= 0; --i)
-		if ((dice->clock_caps & (1 << i)) &&
-		    rate_index_to_mode(i) == mode)
-			return i;
-
-	return -1;
-}
-
-static int dice_read_mode_params(struct dice *dice, unsigned int mode)
-{
-	__be32 values[2];
-	int rate_index, err;
-
-	rate_index = highest_supported_mode_rate(dice, mode);
-	if (rate_index < 0) {
-		dice->rx_channels[mode] = 0;
-		dice->rx_midi_ports[mode] = 0;
-		return 0;
-	}
-
-	err = dice_change_rate(dice, rate_index << CLOCK_RATE_SHIFT);
-	if (err < 0)
-		return err;
-
-	err = snd_fw_transaction(dice->unit, TCODE_READ_BLOCK_REQUEST,
-				 rx_address(dice, RX_NUMBER_AUDIO),
-				 values, 2 * 4, 0);
-	if (err < 0)
-		return err;
-
-	dice->rx_channels[mode]   = be32_to_cpu(values[0]);
-	dice->rx_midi_ports[mode] = be32_to_cpu(values[1]);
-
-	return 0;
-}
-
 static int dice_read_params(struct dice *dice)
 {
 	__be32 pointers[6];
 	__be32 value;
-	int mode, err;
+	unsigned int mode, rate_index;
+	int err;
 
 	err = snd_fw_transaction(dice->unit, TCODE_READ_BLOCK_REQUEST,
 				 DICE_PRIVATE_SPACE,
@@ -1275,12 +1440,30 @@ static int dice_read_params(struct dice *dice)
 				   CLOCK_CAP_SOURCE_INTERNAL;
 	}
 
-	for (mode = 2; mode >= 0; --mode) {
+	/* modes without any supported rate have nothing to read */
+	for (mode = 0; mode < 3; ++mode)
+		if (highest_supported_mode_rate(dice, mode) < 0)
+			dice->known_modes |= 1 << mode;
+
+	dice_load_params(dice);
+
+	/* the parameters of current mode can be read without disturbance */
+	err = snd_fw_transaction(dice->unit, TCODE_READ_QUADLET_REQUEST,
+				 global_address(dice, GLOBAL_CLOCK_SELECT),
+				 &value, 4, 0);
+	if (err < 0)
+		return err;
+	rate_index = (be32_to_cpu(value) & CLOCK_RATE_MASK) >> CLOCK_RATE_SHIFT;
+	if (rate_index < ARRAY_SIZE(dice_rates) &&
+	    (dice->clock_caps & (1 << rate_index))) {
+		mode = rate_index_to_mode(rate_index);
 		err = dice_read_mode_params(dice, mode);
 		if (err < 0)
 			return err;
 	}
 
+	dice_save_params(dice);
+
 	return 0;
 }
 
@@ -1319,6 +1502,23 @@ static void dice_card_strings(struct dice *dice)
 	strcpy(card->mixername, "DICE");
 }
 
+/* called in a worker after bus resets settle */
+static void dice_recover(struct fw_unit *unit)
+{
+	struct dice *dice = dev_get_drvdata(&unit->device);
+
+	mutex_lock(&dice->mutex);
+
+	dice->global_enabled = false;
+	dice_stream_stop_packets(dice);
+
+	dice_owner_update(dice);
+
+	fw_iso_resources_update(&dice->resources);
+
+	mutex_unlock(&dice->mutex);
+}
+
 static int dice_probe(struct fw_unit *unit, const struct ieee1394_device_id *id)
 {
 	struct snd_card *card;
@@ -1342,6 +1542,7 @@ static int dice_probe(struct fw_unit *unit, const struct ieee1394_device_id *id)
 	dice->unit = unit;
 	init_completion(&dice->clock_accepted);
 	init_waitqueue_head(&dice->hwdep_wait);
+	snd_fw_recovery_init(&dice->recovery, unit, dice_recover);
 
 	dice->notification_handler.length = 4;
 	dice->notification_handler.address_callback = dice_notification;
@@ -1421,6 +1622,7 @@ static void dice_remove(struct fw_unit *unit)
 {
 	struct dice *dice = dev_get_drvdata(&unit->device);
 
+	snd_fw_recovery_cancel(&dice->recovery);
 	amdtp_stream_pcm_abort(&dice->stream);
 
 	snd_card_disconnect(dice->card);
@@ -1449,16 +1651,10 @@ static void dice_bus_reset(struct fw_unit *unit)
 	 */
 	amdtp_stream_pcm_abort(&dice->stream);
 
-	mutex_lock(&dice->mutex);
+	/* transactions holding the mutex may wait for the new generation */
+	snd_fw_notify_bus_reset();
 
-	dice->global_enabled = false;
-	dice_stream_stop_packets(dice);
-
-	dice_owner_update(dice);
-
-	fw_iso_resources_update(&dice->resources);
-
-	mutex_unlock(&dice->mutex);
+	snd_fw_recovery_schedule(&dice->recovery);
 }
 
 #define DICE_INTERFACE	0x000001
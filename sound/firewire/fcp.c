@@ -21,9 +21,7 @@
 
 #define CTS_AVC 0x00
 
-#define ERROR_RETRIES	3
-#define ERROR_DELAY_MS	5
-#define FCP_TIMEOUT_MS	125
+#define RESEND_RETRIES	3
 
 int avc_general_set_sig_fmt(struct fw_unit *unit, unsigned int rate,
 			    enum avc_general_plug_dir dir,
@@ -224,6 +222,8 @@ int fcp_avc_transaction(struct fw_unit *unit,
 {
 	struct fcp_transaction t;
 	int tcode, ret, tries = 0;
+	bool resent = false;
+	ktime_t sent;
 
 	t.unit = unit;
 	t.response_buffer = response;
@@ -244,20 +244,32 @@ int fcp_avc_transaction(struct fw_unit *unit,
 					 (void *)command, command_size, 0);
 		if (ret < 0)
 			break;
+		sent = ktime_get();
 
 		wait_event_timeout(t.wait, t.state != STATE_PENDING,
-				   msecs_to_jiffies(FCP_TIMEOUT_MS));
+				   snd_fw_response_timeout(t.unit,
+						SND_FW_AVC_RESPONSE_MIN_MS));
 
 		if (t.state == STATE_COMPLETE) {
+			if (!resent)
+				snd_fw_response_received(t.unit, sent);
 			ret = t.response_size;
 			break;
 		} else if (t.state == STATE_BUS_RESET) {
-			msleep(ERROR_DELAY_MS);
-		} else if (++tries >= ERROR_RETRIES) {
-			dev_err(&t.unit->device, "FCP command timed out\n");
-			ret = -EIO;
-			break;
+			/* the new generation is known already, resend now */
+			spin_lock_irq(&transactions_lock);
+			t.state = STATE_PENDING;
+			spin_unlock_irq(&transactions_lock);
+		} else {
+			snd_fw_response_timed_out(t.unit);
+			if (++tries >= RESEND_RETRIES) {
+				dev_err(&t.unit->device,
+					"FCP command timed out\n");
+				ret = -EIO;
+				break;
+			}
 		}
+		resent = true;
 	}
 
 	spin_lock_irq(&transactions_lock);
@@ -289,6 +301,8 @@ void fcp_bus_reset(struct fw_unit *unit)
 		}
 	}
 	spin_unlock_irq(&transactions_lock);
+
+	snd_fw_notify_bus_reset();
 }
 EXPORT_SYMBOL(fcp_bus_reset);
 
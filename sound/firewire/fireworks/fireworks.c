@@ -39,7 +39,7 @@ module_param(resp_buf_debug, bool, 0444);
 MODULE_PARM_DESC(resp_buf_debug, "store all responses to buffer");
 
 static DEFINE_MUTEX(devices_mutex);
-static unsigned int devices_used;
+static DEFINE_IDR(devices_idr);
 
 #define VENDOR_LOUD			0x000ff2
 #define  MODEL_MACKIE_400F		0x00400f
@@ -157,7 +157,7 @@ efw_card_free(struct snd_card *card)
 
 	if (efw->card_index >= 0) {
 		mutex_lock(&devices_mutex);
-		devices_used &= ~BIT(efw->card_index);
+		idr_remove(&devices_idr, efw->card_index);
 		mutex_unlock(&devices_mutex);
 	}
 
@@ -166,6 +166,18 @@ efw_card_free(struct snd_card *card)
 	return;
 }
 
+/* called in a worker after bus resets settle */
+static void
+efw_recover(struct fw_unit *unit)
+{
+	struct snd_efw *efw = dev_get_drvdata(&unit->device);
+
+	if (efw == NULL)
+		return;
+
+	snd_efw_stream_update_duplex(efw);
+}
+
 static int
 efw_probe(struct fw_unit *unit,
 	  const struct ieee1394_device_id *entry)
@@ -177,12 +189,10 @@ efw_probe(struct fw_unit *unit,
 
 	mutex_lock(&devices_mutex);
 
-	/* check registered cards */
-	for (card_index = 0; card_index < SNDRV_CARDS; ++card_index)
-		if (!(devices_used & BIT(card_index)) && enable[card_index])
-			break;
-	if (card_index >= SNDRV_CARDS) {
-		err = -ENOENT;
+	/* disabled indexes are reserved at module init */
+	card_index = idr_alloc(&devices_idr, NULL, 0, 0, GFP_KERNEL);
+	if (card_index < 0) {
+		err = card_index;
 		goto end;
 	}
 
@@ -190,13 +200,20 @@ efw_probe(struct fw_unit *unit,
 	resp_buf = kzalloc(resp_buf_size, GFP_KERNEL);
 	if (resp_buf == NULL) {
 		err = -ENOMEM;
-		goto end;
+		goto err_index;
 	}
 
-	err = snd_card_create(index[card_index], id[card_index],
-			      THIS_MODULE, sizeof(struct snd_efw), &card);
-	if (err < 0)
-		goto end;
+	/* the module parameters are for the first SNDRV_CARDS devices */
+	if (card_index < SNDRV_CARDS)
+		err = snd_card_create(index[card_index], id[card_index],
+				THIS_MODULE, sizeof(struct snd_efw), &card);
+	else
+		err = snd_card_create(SNDRV_DEFAULT_IDX1, SNDRV_DEFAULT_STR1,
+				THIS_MODULE, sizeof(struct snd_efw), &card);
+	if (err < 0) {
+		kfree(resp_buf);
+		goto err_index;
+	}
 	card->private_free = efw_card_free;
 
 	efw = card->private_data;
@@ -206,7 +223,10 @@ efw_probe(struct fw_unit *unit,
 	efw->card_index = -1;
 	mutex_init(&efw->mutex);
 	spin_lock_init(&efw->lock);
+	amdtp_duplex_init(&efw->duplex, &efw->tx_stream, &efw->rx_stream,
+			  &efw->mutex);
 	init_waitqueue_head(&efw->hwdep_wait);
+	snd_fw_recovery_init(&efw->recovery, unit, efw_recover);
 	efw->resp_buf = efw->pull_ptr = efw->push_ptr = resp_buf;
 
 	err = get_hardware_info(efw);
@@ -240,13 +260,16 @@ efw_probe(struct fw_unit *unit,
 		goto error;
 
 	dev_set_drvdata(&unit->device, efw);
-	devices_used |= BIT(card_index);
+	idr_replace(&devices_idr, efw, card_index);
 	efw->card_index = card_index;
 end:
 	mutex_unlock(&devices_mutex);
 	return err;
 error:
+	snd_efw_transaction_remove_instance(efw);
 	snd_card_free(card);
+err_index:
+	idr_remove(&devices_idr, card_index);
 	mutex_unlock(&devices_mutex);
 	return err;
 }
@@ -255,8 +278,9 @@ static void efw_update(struct fw_unit *unit)
 {
 	struct snd_efw *efw = dev_get_drvdata(&unit->device);
 
+	snd_efw_transaction_update_instance(efw);
 	snd_efw_transaction_bus_reset(efw->unit);
-	snd_efw_stream_update_duplex(efw);
+	snd_fw_recovery_schedule(&efw->recovery);
 
 	return;
 }
@@ -265,6 +289,7 @@ static void efw_remove(struct fw_unit *unit)
 {
 	struct snd_efw *efw = dev_get_drvdata(&unit->device);
 
+	snd_fw_recovery_cancel(&efw->recovery);
 	snd_efw_stream_destroy_duplex(efw);
 	snd_efw_transaction_remove_instance(efw);
 
@@ -305,17 +330,31 @@ static struct fw_driver efw_driver = {
 
 static int __init snd_efw_init(void)
 {
+	unsigned int i;
 	int err;
 
+	/* never assign the indexes disabled by the module parameter */
+	for (i = 0; i < SNDRV_CARDS; i++) {
+		if (enable[i])
+			continue;
+		err = idr_alloc(&devices_idr, NULL, i, i + 1, GFP_KERNEL);
+		if (err < 0)
+			goto err_idr;
+	}
+
 	err = snd_efw_transaction_register();
 	if (err < 0)
-		goto end;
+		goto err_idr;
 
 	err = driver_register(&efw_driver.driver);
-	if (err < 0)
+	if (err < 0) {
 		snd_efw_transaction_unregister();
+		goto err_idr;
+	}
 
-end:
+	return 0;
+err_idr:
+	idr_destroy(&devices_idr);
 	return err;
 }
 
@@ -323,6 +362,7 @@ static void __exit snd_efw_exit(void)
 {
 	snd_efw_transaction_unregister();
 	driver_unregister(&efw_driver.driver);
+	idr_destroy(&devices_idr);
 	mutex_destroy(&devices_mutex);
 }
 
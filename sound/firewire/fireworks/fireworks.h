@@ -17,6 +17,9 @@
 #include <linux/mod_devicetable.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/seqlock.h>
+#include <linux/idr.h>
+#include <linux/hashtable.h>
 
 /* TODO: when mering to upstream, this path should be changed. */
 #include "../../../include/uapi/sound/asound.h"
@@ -60,6 +63,8 @@ struct snd_efw {
 	struct mutex mutex;
 	spinlock_t lock;
 
+	struct snd_fw_recovery recovery;
+
 	/* for transaction */
 	u32 seqnum;
 	bool resp_addr_changable;
@@ -76,6 +81,9 @@ struct snd_efw {
 	struct cmp_connection out_conn;
 	struct cmp_connection in_conn;
 
+	/* updated under mutex, read locklessly */
+	struct amdtp_duplex duplex;
+
 	/* hardware metering parameters */
 	unsigned int phys_out;
 	unsigned int phys_in;
@@ -94,6 +102,9 @@ struct snd_efw {
 	u8 *pull_ptr;
 	u8 *push_ptr;
 	unsigned int resp_queues;
+
+	/* for routing responses, hashed by the node ID */
+	struct hlist_node instance_node;
 };
 
 int snd_efw_transaction_cmd(struct fw_unit *unit,
@@ -105,6 +116,7 @@ int snd_efw_transaction_register(void);
 void snd_efw_transaction_unregister(void);
 void snd_efw_transaction_bus_reset(struct fw_unit *unit);
 void snd_efw_transaction_add_instance(struct snd_efw *efw);
+void snd_efw_transaction_update_instance(struct snd_efw *efw);
 void snd_efw_transaction_remove_instance(struct snd_efw *efw);
 
 struct snd_efw_hwinfo {
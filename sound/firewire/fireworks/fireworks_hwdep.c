@@ -12,8 +12,8 @@
  * 1.get information about firewire node
  * 2.get notification about starting/stopping stream
  * 3.lock/unlock streaming
- * 4.transmit command of EFW transaction
- * 5.receive response of EFW transaction
+ * 4.transmit commands of EFW transaction, several in one write
+ * 5.receive responses of EFW transaction
  *
  */
 
@@ -125,31 +125,51 @@ hwdep_write(struct snd_hwdep *hwdep, const char __user *data, long count,
 	    loff_t *offset)
 {
 	struct snd_efw *efw = hwdep->private_data;
-	u32 seqnum;
+	struct snd_efw_transaction *t;
+	unsigned int length;
+	long consumed = 0;
+	int err = 0;
 	u8 *buf;
 
 	if (count < sizeof(struct snd_efw_transaction))
 		return -EINVAL;
 
-	buf = kmalloc(count, GFP_KERNEL);
-	if (buf == NULL)
-		return -ENOMEM;
+	/* responses to one batch should fit in the response buffer */
+	count = min_t(long, count, resp_buf_size);
 
-	if (copy_from_user(buf, data, count)) {
-		count = -EFAULT;
-		goto end;
-	}
+	buf = memdup_user(data, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
 
-	/* check seqnum is not for kernel-land */
-	seqnum = ((struct snd_efw_transaction *)buf)->seqnum;
-	if (seqnum + 2 > SND_EFW_TRANSACTION_SEQNUM_MAX) {
-		count = -EINVAL;
-		goto end;
+	/*
+	 * Commands can be concatenated. They are sent without waiting for
+	 * responses, which are matched by seqnum in userspace.
+	 */
+	while (count - consumed >= sizeof(struct snd_efw_transaction)) {
+		t = (struct snd_efw_transaction *)(buf + consumed);
+		length = be32_to_cpu(t->length) * sizeof(u32);
+		if (length < sizeof(struct snd_efw_transaction) ||
+		    length > count - consumed)
+			break;
+
+		/* check seqnum is not for kernel-land */
+		if (be32_to_cpu(t->seqnum) + 2 > SND_EFW_TRANSACTION_SEQNUM_MAX)
+			break;
+
+		err = snd_efw_transaction_cmd(efw->unit, t, length);
+		if (err < 0)
+			break;
+
+		consumed += length;
 	}
 
-	if (snd_efw_transaction_cmd(efw->unit, buf, count) < 0)
+	if (consumed > 0)
+		count = consumed;
+	else if (err < 0)
 		count = -EIO;
-end:
+	else
+		count = -EINVAL;
+
 	kfree(buf);
 	return count;
 }
@@ -255,7 +275,9 @@ hwdep_ioctl(struct snd_hwdep *hwdep, struct file *file,
 	case SNDRV_FIREWIRE_IOCTL_UNLOCK:
 		return hwdep_unlock(efw);
 	default:
-		return -ENOIOCTLCMD;
+		return amdtp_stream_hwdep_ioctl(&efw->tx_stream,
+						&efw->rx_stream, &efw->mutex,
+						cmd, (void __user *)arg);
 	}
 }
 
@@ -197,7 +197,7 @@ pcm_init_hw_params(struct snd_efw *efw,
 
 	/* add rule between channels and sampling rate */
 	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		substream->runtime->hw.formats = SNDRV_PCM_FMTBIT_S32;
+		substream->runtime->hw.formats = AMDTP_IN_PCM_FORMAT_BITS;
 		snd_pcm_hw_rule_add(substream->runtime, 0,
 				SNDRV_PCM_HW_PARAM_CHANNELS,
 				hw_rule_capture_channels, efw,
@@ -266,6 +266,7 @@ end:
 static int pcm_open(struct snd_pcm_substream *substream)
 {
 	struct snd_efw *efw = substream->private_data;
+	struct amdtp_duplex_status status;
 	int sampling_rate;
 	unsigned int clock_source;
 	int err;
@@ -286,9 +287,13 @@ static int pcm_open(struct snd_pcm_substream *substream)
 	 * When source of clock is not internal or any PCM streams are running,
 	 * available sampling rate is limited at current sampling rate.
 	 */
-	if ((clock_source != SND_EFW_CLOCK_SOURCE_INTERNAL) ||
-	    amdtp_stream_pcm_running(&efw->tx_stream) ||
+	if (amdtp_stream_pcm_running(&efw->tx_stream) ||
 	    amdtp_stream_pcm_running(&efw->rx_stream)) {
+		/* streams keep the rate published at starting */
+		amdtp_duplex_read_status(&efw->duplex, &status);
+		substream->runtime->hw.rate_min = status.rate;
+		substream->runtime->hw.rate_max = status.rate;
+	} else if (clock_source != SND_EFW_CLOCK_SOURCE_INTERNAL) {
 		err = snd_efw_command_get_sampling_rate(efw, &sampling_rate);
 		if (err < 0)
 			goto err_locked;
@@ -314,8 +319,16 @@ static int pcm_close(struct snd_pcm_substream *substream)
 static int pcm_hw_params(struct snd_pcm_substream *substream,
 			 struct snd_pcm_hw_params *hw_params)
 {
-	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
-						params_buffer_bytes(hw_params));
+	struct snd_efw *efw = substream->private_data;
+	struct amdtp_stream *stream;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		stream = &efw->tx_stream;
+	else
+		stream = &efw->rx_stream;
+
+	return amdtp_stream_alloc_pcm_buffer(stream, substream,
+					     params_buffer_bytes(hw_params));
 }
 
 static int pcm_hw_free(struct snd_pcm_substream *substream)
@@ -358,13 +371,36 @@ end:
 	return err;
 }
 
+/* the substream in the other direction, linked by snd_pcm_link() */
+static struct snd_pcm_substream *
+linked_substream(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream *s;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if ((s->pcm == substream->pcm) &&
+		    (s->stream != substream->stream))
+			return s;
+	}
+
+	return NULL;
+}
+
 static int pcm_capture_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_efw *efw = substream->private_data;
+	struct snd_pcm_substream *link;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(&efw->tx_stream, substream);
+		link = linked_substream(substream);
+		if (link == NULL) {
+			amdtp_stream_pcm_trigger(&efw->tx_stream, substream);
+			break;
+		}
+		amdtp_stream_pcm_link_trigger(&efw->tx_stream, substream,
+					      &efw->rx_stream, link);
+		snd_pcm_trigger_done(link, substream);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		amdtp_stream_pcm_trigger(&efw->tx_stream, NULL);
@@ -378,10 +414,18 @@ static int pcm_capture_trigger(struct snd_pcm_substream *substream, int cmd)
 static int pcm_playback_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_efw *efw = substream->private_data;
+	struct snd_pcm_substream *link;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(&efw->rx_stream, substream);
+		link = linked_substream(substream);
+		if (link == NULL) {
+			amdtp_stream_pcm_trigger(&efw->rx_stream, substream);
+			break;
+		}
+		amdtp_stream_pcm_link_trigger(&efw->tx_stream, link,
+					      &efw->rx_stream, substream);
+		snd_pcm_trigger_done(link, substream);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		amdtp_stream_pcm_trigger(&efw->rx_stream, NULL);
@@ -443,6 +487,12 @@ int snd_efw_create_pcm_devices(struct snd_efw *efw)
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_playback_ops);
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_capture_ops);
 
+	err = amdtp_stream_add_meter_ctl(&efw->tx_stream, efw->card,
+					 "PCM Capture Meter");
+	if (err < 0)
+		goto end;
+	err = amdtp_stream_add_meter_ctl(&efw->rx_stream, efw->card,
+					 "PCM Playback Meter");
 end:
 	return err;
 }
@@ -101,17 +101,26 @@ static void
 proc_read_clock(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
 {
 	struct snd_efw *efw = entry->private_data;
+	struct amdtp_duplex_status status;
 	enum snd_efw_clock_source clock_source;
 	unsigned int sampling_rate;
 
 	if (snd_efw_command_get_clock_source(efw, &clock_source) < 0)
 		goto end;
 
-	if (snd_efw_command_get_sampling_rate(efw, &sampling_rate) < 0)
+	/* the rate is fixed during streaming, thus no need to ask the device */
+	amdtp_duplex_read_status(&efw->duplex, &status);
+	if (status.tx_running || status.rx_running)
+		sampling_rate = status.rate;
+	else if (snd_efw_command_get_sampling_rate(efw, &sampling_rate) < 0)
 		goto end;
 
 	snd_iprintf(buffer, "Clock Source: %d\n", clock_source);
 	snd_iprintf(buffer, "Sampling Rate: %d\n", sampling_rate);
+	snd_iprintf(buffer, "Streaming: %s/%s (tx/rx)%s\n",
+		    (status.tx_running) ? "running" : "stopped",
+		    (status.rx_running) ? "running" : "stopped",
+		    (status.starting) ? ", starting" : "");
 end:
 	return;
 }
@@ -190,6 +199,17 @@ proc_read_queues_state(struct snd_info_entry *entry,
 		    efw->resp_queues, consumed, resp_buf_size);
 }
 
+static void
+proc_read_stream(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct snd_efw *efw = entry->private_data;
+
+	snd_iprintf(buffer, "Output Stream from device:\n");
+	amdtp_stream_proc_read(&efw->tx_stream, buffer);
+	snd_iprintf(buffer, "Input Stream to device:\n");
+	amdtp_stream_proc_read(&efw->rx_stream, buffer);
+}
+
 void snd_efw_proc_init(struct snd_efw *efw)
 {
 	struct snd_info_entry *entry;
@@ -200,6 +220,8 @@ void snd_efw_proc_init(struct snd_efw *efw)
 		snd_info_set_text_ops(entry, efw, proc_read_queues_state);
 	if (!snd_card_proc_new(efw->card, "#clock", &entry))
 		snd_info_set_text_ops(entry, efw, proc_read_clock);
+	if (!snd_card_proc_new(efw->card, "#stream", &entry))
+		snd_info_set_text_ops(entry, efw, proc_read_stream);
 	if (!snd_card_proc_new(efw->card, "#meters", &entry))
 		snd_info_set_text_ops(entry, efw, proc_read_phys_meters);
 	return;
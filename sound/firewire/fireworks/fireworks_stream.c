@@ -13,6 +13,7 @@ init_stream(struct snd_efw *efw, struct amdtp_stream *stream)
 	struct cmp_connection *conn;
 	enum cmp_direction c_dir;
 	enum amdtp_stream_direction s_dir;
+	enum cip_flags flags;
 	int err;
 
 	if (stream == &efw->tx_stream) {
@@ -29,7 +30,12 @@ init_stream(struct snd_efw *efw, struct amdtp_stream *stream)
 	if (err < 0)
 		goto end;
 
-	err = amdtp_stream_init(stream, efw->unit, s_dir, CIP_BLOCKING);
+	/* Fireworks transmits packets out of order */
+	flags = CIP_BLOCKING;
+	if (s_dir == AMDTP_IN_STREAM)
+		flags |= CIP_OUT_OF_ORDER;
+
+	err = amdtp_stream_init(stream, efw->unit, s_dir, flags);
 	if (err < 0) {
 		cmp_connection_destroy(conn);
 		goto end;
@@ -53,19 +59,13 @@ stop_stream(struct snd_efw *efw, struct amdtp_stream *stream)
 	return;
 }
 
-static int
-start_stream(struct snd_efw *efw, struct amdtp_stream *stream,
-	     unsigned int sampling_rate)
+static struct cmp_connection *
+set_stream_params(struct snd_efw *efw, struct amdtp_stream *stream,
+		  unsigned int sampling_rate)
 {
 	struct cmp_connection *conn;
 	unsigned int pcm_channels, midi_ports;
-	int mode, err;
-
-	/* already running */
-	if (amdtp_stream_running(stream)) {
-		err = 0;
-		goto end;
-	}
+	int mode;
 
 	mode = snd_efw_get_multiplier_mode(sampling_rate);
 	if (stream == &efw->tx_stream) {
@@ -81,25 +81,60 @@ start_stream(struct snd_efw *efw, struct amdtp_stream *stream,
 	amdtp_stream_set_parameters(stream, sampling_rate,
 				    pcm_channels, midi_ports);
 
+	return conn;
+}
+
+static int
+make_connection(struct snd_efw *efw, struct amdtp_stream *stream,
+		unsigned int sampling_rate)
+{
+	struct cmp_connection *conn;
+
+	conn = set_stream_params(efw, stream, sampling_rate);
+
 	/*  establish connection via CMP */
-	err = cmp_connection_establish(conn,
+	return cmp_connection_establish(conn,
 				amdtp_stream_get_max_payload(stream));
-	if (err < 0)
-		goto end;
+}
+
+/* both IRM allocations and PCR updates are in flight at the same time */
+static int
+make_both_connections(struct snd_efw *efw, unsigned int sampling_rate)
+{
+	set_stream_params(efw, &efw->tx_stream, sampling_rate);
+	set_stream_params(efw, &efw->rx_stream, sampling_rate);
+
+	return cmp_connection_establish_pair(&efw->out_conn,
+			amdtp_stream_get_max_payload(&efw->tx_stream),
+			&efw->in_conn,
+			amdtp_stream_get_max_payload(&efw->rx_stream));
+}
+
+/* Call after the connection for the stream is established. */
+static int
+start_stream(struct snd_efw *efw, struct amdtp_stream *stream)
+{
+	struct cmp_connection *conn;
+	int err;
+
+	if (stream == &efw->tx_stream)
+		conn = &efw->out_conn;
+	else
+		conn = &efw->in_conn;
 
 	/* start amdtp stream */
 	err = amdtp_stream_start(stream,
 				 conn->resources.channel,
 				 conn->speed);
-	if (err < 0)
+	if (err < 0) {
 		stop_stream(efw, stream);
+		goto end;
+	}
 
 	/* wait first callback */
-	if (!amdtp_stream_wait_callback(stream)) {
+	err = amdtp_duplex_wait_callback(&efw->duplex, stream);
+	if (err < 0)
 		stop_stream(efw, stream);
-		err = -ETIMEDOUT;
-		goto end;
-	}
 end:
 	return err;
 }
@@ -118,6 +153,7 @@ update_stream(struct snd_efw *efw, struct amdtp_stream *stream)
 		amdtp_stream_pcm_abort(stream);
 		mutex_lock(&efw->mutex);
 		stop_stream(efw, stream);
+		amdtp_duplex_publish(&efw->duplex, 0);
 		mutex_unlock(&efw->mutex);
 		return;
 	}
@@ -201,7 +237,9 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 	struct amdtp_stream *master, *slave;
 	enum cip_flags sync_mode;
 	int err, curr_rate;
-	bool slave_flag, used;
+	bool slave_flag, used, shared, slave_connected = false;
+
+	amdtp_duplex_lock(&efw->duplex);
 
 	err = get_roles(efw, &sync_mode, &master, &slave);
 	if (err < 0)
@@ -212,6 +250,19 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 	else
 		slave_flag = false;
 
+	/* the streams keep running after XRUN, thus just attach PCM again */
+	if (amdtp_stream_pcm_reattachable(request, sampling_rate) &&
+	    !amdtp_streaming_error(master))
+		goto end;
+
+	/* the packet queue has stopped, thus restart the streams */
+	if (amdtp_streaming_error(slave))
+		stop_stream(efw, slave);
+	if (amdtp_streaming_error(master)) {
+		stop_stream(efw, slave);
+		stop_stream(efw, master);
+	}
+
 	/*
 	 * Considering JACK/FFADO streaming:
 	 * TODO: This can be removed hwdep functionality becomes popular.
@@ -227,6 +278,11 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 		goto end;
 	}
 
+	/* others receive the stream of the device at current rate */
+	err = cmp_connection_check_shared(&efw->out_conn, &shared);
+	if (err < 0)
+		goto end;
+
 	/* change sampling rate if possible */
 	err = snd_efw_command_get_sampling_rate(efw, &curr_rate);
 	if (err < 0)
@@ -234,6 +290,14 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 	if (sampling_rate == 0)
 		sampling_rate = curr_rate;
 	if (sampling_rate != curr_rate) {
+		if (shared) {
+			dev_err(&efw->unit->device,
+				"sampling rate is fixed by others: %d\n",
+				curr_rate);
+			err = -EBUSY;
+			goto end;
+		}
+
 		/* master is just for MIDI stream */
 		if (amdtp_stream_running(master) &&
 		    !amdtp_stream_pcm_running(master))
@@ -252,8 +316,17 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 	/*  master should be always running */
 	if (!amdtp_stream_running(master)) {
 		amdtp_stream_set_sync(sync_mode, master, slave);
-		err = start_stream(efw, master, sampling_rate);
+		if (slave_flag && !amdtp_stream_running(slave)) {
+			err = make_both_connections(efw, sampling_rate);
+			slave_connected = true;
+		} else {
+			err = make_connection(efw, master, sampling_rate);
+		}
+		if (err >= 0)
+			err = start_stream(efw, master);
 		if (err < 0) {
+			if (slave_connected)
+				stop_stream(efw, slave);
 			dev_err(&efw->unit->device,
 				"fail to start AMDTP master stream:%d\n", err);
 			goto end;
@@ -262,7 +335,10 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 
 	/* start slave if needed */
 	if (slave_flag && !amdtp_stream_running(slave)) {
-		err = start_stream(efw, slave, sampling_rate);
+		if (!slave_connected)
+			err = make_connection(efw, slave, sampling_rate);
+		if (err >= 0)
+			err = start_stream(efw, slave);
 		if (err < 0) {
 			dev_err(&efw->unit->device,
 				"fail to start AMDTP slave stream:%d\n", err);
@@ -270,6 +346,8 @@ int snd_efw_stream_start_duplex(struct snd_efw *efw,
 		}
 	}
 end:
+	amdtp_duplex_publish(&efw->duplex, (err < 0) ? 0 : sampling_rate);
+	mutex_unlock(&efw->mutex);
 	return err;
 }
 
@@ -279,10 +357,16 @@ int snd_efw_stream_stop_duplex(struct snd_efw *efw)
 	enum cip_flags sync_mode;
 	int err;
 
+	mutex_lock(&efw->mutex);
+
 	err = get_roles(efw, &sync_mode, &master, &slave);
 	if (err < 0)
 		goto end;
 
+	/* the starting thread stops them by itself when failing */
+	if (amdtp_duplex_starting(&efw->duplex))
+		goto end;
+
 	if (amdtp_stream_pcm_running(slave) ||
 	    amdtp_stream_midi_running(slave))
 		goto end;
@@ -294,6 +378,8 @@ int snd_efw_stream_stop_duplex(struct snd_efw *efw)
 		stop_stream(efw, master);
 
 end:
+	amdtp_duplex_publish(&efw->duplex, 0);
+	mutex_unlock(&efw->mutex);
 	return err;
 }
 
@@ -310,8 +396,13 @@ void snd_efw_stream_destroy_duplex(struct snd_efw *efw)
 	if (amdtp_stream_pcm_running(&efw->tx_stream))
 		amdtp_stream_pcm_abort(&efw->tx_stream);
 
+	amdtp_duplex_lock(&efw->duplex);
+
 	destroy_stream(efw, &efw->rx_stream);
 	destroy_stream(efw, &efw->tx_stream);
+
+	amdtp_duplex_publish(&efw->duplex, 0);
+	mutex_unlock(&efw->mutex);
 }
 
 void snd_efw_stream_lock_changed(struct snd_efw *efw)
@@ -36,15 +36,17 @@
 /* this is for juju convinience? */
 #define MEMORY_SPACE_EFW_END		0xecc080000200
 
-#define ERROR_RETRIES 3
-#define ERROR_DELAY_MS 5
-#define EFC_TIMEOUT_MS 125
+#define RESEND_RETRIES 3
+
+#define INSTANCES_HASH_BITS		6
+#define TRANSACTION_QUEUES_HASH_BITS	6
 
 static DEFINE_SPINLOCK(instances_lock);
-static struct snd_efw *instances[SNDRV_CARDS] = SNDRV_DEFAULT_PTR;
+static DEFINE_HASHTABLE(instances, INSTANCES_HASH_BITS);
 
+/* hashed by the sequence number of the expected response */
 static DEFINE_SPINLOCK(transaction_queues_lock);
-static LIST_HEAD(transaction_queues);
+static DEFINE_HASHTABLE(transaction_queues, TRANSACTION_QUEUES_HASH_BITS);
 
 enum transaction_queue_state {
 	STATE_PENDING,
@@ -53,7 +55,7 @@ enum transaction_queue_state {
 };
 
 struct transaction_queue {
-	struct list_head list;
+	struct hlist_node node;
 	struct fw_unit *unit;
 	void *buf;
 	unsigned int size;
@@ -76,6 +78,8 @@ int snd_efw_transaction_run(struct fw_unit *unit,
 {
 	struct transaction_queue t;
 	unsigned int tries;
+	bool resent = false;
+	ktime_t sent;
 	int ret;
 
 	t.unit = unit;
@@ -86,7 +90,7 @@ int snd_efw_transaction_run(struct fw_unit *unit,
 	init_waitqueue_head(&t.wait);
 
 	spin_lock_irq(&transaction_queues_lock);
-	list_add_tail(&t.list, &transaction_queues);
+	hash_add(transaction_queues, &t.node, t.seqnum);
 	spin_unlock_irq(&transaction_queues_lock);
 
 	tries = 0;
@@ -94,24 +98,35 @@ int snd_efw_transaction_run(struct fw_unit *unit,
 		ret = snd_efw_transaction_cmd(t.unit, (void *)cmd, cmd_size);
 		if (ret < 0)
 			break;
+		sent = ktime_get();
 
 		wait_event_timeout(t.wait, t.state != STATE_PENDING,
-				   msecs_to_jiffies(EFC_TIMEOUT_MS));
+				   snd_fw_response_timeout(t.unit, 0));
 
 		if (t.state == STATE_COMPLETE) {
+			if (!resent)
+				snd_fw_response_received(t.unit, sent);
 			ret = t.size;
 			break;
 		} else if (t.state == STATE_BUS_RESET) {
-			msleep(ERROR_DELAY_MS);
-		} else if (++tries >= ERROR_RETRIES) {
-			dev_err(&t.unit->device, "EFC command timed out\n");
-			ret = -EIO;
-			break;
+			/* the new generation is known already, resend now */
+			spin_lock_irq(&transaction_queues_lock);
+			t.state = STATE_PENDING;
+			spin_unlock_irq(&transaction_queues_lock);
+		} else {
+			snd_fw_response_timed_out(t.unit);
+			if (++tries >= RESEND_RETRIES) {
+				dev_err(&t.unit->device,
+					"EFC command timed out\n");
+				ret = -EIO;
+				break;
+			}
 		}
+		resent = true;
 	} while (1);
 
 	spin_lock_irq(&transaction_queues_lock);
-	list_del(&t.list);
+	hash_del(&t.node);
 	spin_unlock_irq(&transaction_queues_lock);
 
 	return ret;
@@ -165,20 +180,22 @@ end:
 	spin_unlock_irq(&efw->lock);
 }
 
+static unsigned long instance_key(struct fw_card *card, int node_id)
+{
+	return (unsigned long)card ^ node_id;
+}
+
 static void
 handle_resp_for_user(struct fw_card *card, int generation, int source,
 		     void *data, size_t length, int *rcode)
 {
 	struct fw_device *device;
 	struct snd_efw *efw;
-	unsigned int i;
 
 	spin_lock_irq(&instances_lock);
 
-	for (i = 0; i < SNDRV_CARDS; i++) {
-		efw = instances[i];
-		if (efw == NULL)
-			continue;
+	hash_for_each_possible(instances, efw, instance_node,
+			       instance_key(card, source)) {
 		device = fw_parent_device(efw->unit);
 		if ((device->card != card) ||
 		    (device->generation != generation))
@@ -187,13 +204,10 @@ handle_resp_for_user(struct fw_card *card, int generation, int source,
 		if (device->node_id != source)
 			continue;
 
+		copy_resp_to_buf(efw, data, length, rcode);
 		break;
 	}
-	if (i == SNDRV_CARDS)
-		goto end;
 
-	copy_resp_to_buf(efw, data, length, rcode);
-end:
 	spin_unlock_irq(&instances_lock);
 }
 
@@ -206,7 +220,7 @@ handle_resp_for_kernel(struct fw_card *card, int generation, int source,
 	unsigned long flags;
 
 	spin_lock_irqsave(&transaction_queues_lock, flags);
-	list_for_each_entry(t, &transaction_queues, list) {
+	hash_for_each_possible(transaction_queues, t, node, seqnum) {
 		device = fw_parent_device(t->unit);
 		if ((device->card != card) ||
 		    (device->generation != generation))
@@ -261,41 +275,44 @@ end:
 
 void snd_efw_transaction_add_instance(struct snd_efw *efw)
 {
-	unsigned int i;
+	struct fw_device *device = fw_parent_device(efw->unit);
 
 	spin_lock_irq(&instances_lock);
-
-	for (i = 0; i < SNDRV_CARDS; i++) {
-		if (instances[i] != NULL)
-			continue;
-		instances[i] = efw;
-		break;
-	}
-
+	hash_add(instances, &efw->instance_node,
+		 instance_key(device->card, device->node_id));
 	spin_unlock_irq(&instances_lock);
 }
 
-void snd_efw_transaction_remove_instance(struct snd_efw *efw)
+/* Call after bus reset, because the node ID can be changed. */
+void snd_efw_transaction_update_instance(struct snd_efw *efw)
 {
-	unsigned int i;
+	struct fw_device *device = fw_parent_device(efw->unit);
 
 	spin_lock_irq(&instances_lock);
-
-	for (i = 0; i < SNDRV_CARDS; i++) {
-		if (instances[i] != efw)
-			continue;
-		instances[i] = NULL;
+	if (!hash_hashed(&efw->instance_node)) {
+		spin_unlock_irq(&instances_lock);
+		return;
 	}
+	hash_del(&efw->instance_node);
+	hash_add(instances, &efw->instance_node,
+		 instance_key(device->card, device->node_id));
+	spin_unlock_irq(&instances_lock);
+}
 
+void snd_efw_transaction_remove_instance(struct snd_efw *efw)
+{
+	spin_lock_irq(&instances_lock);
+	hash_del(&efw->instance_node);
 	spin_unlock_irq(&instances_lock);
 }
 
 void snd_efw_transaction_bus_reset(struct fw_unit *unit)
 {
 	struct transaction_queue *t;
+	unsigned int bkt;
 
 	spin_lock_irq(&transaction_queues_lock);
-	list_for_each_entry(t, &transaction_queues, list) {
+	hash_for_each(transaction_queues, bkt, t, node) {
 		if ((t->unit == unit) &&
 		    (t->state == STATE_PENDING)) {
 			t->state = STATE_BUS_RESET;
@@ -303,6 +320,8 @@ void snd_efw_transaction_bus_reset(struct fw_unit *unit)
 		}
 	}
 	spin_unlock_irq(&transaction_queues_lock);
+
+	snd_fw_notify_bus_reset();
 }
 
 static struct fw_address_handler resp_register_handler = {
@@ -322,6 +341,6 @@ int snd_efw_transaction_register(void)
 
 void snd_efw_transaction_unregister(void)
 {
-	WARN_ON(!list_empty(&transaction_queues));
+	WARN_ON(!hash_empty(transaction_queues));
 	fw_core_remove_address_handler(&resp_register_handler);
 }
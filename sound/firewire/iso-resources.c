@@ -230,3 +230,18 @@ void fw_iso_resources_free(struct fw_iso_resources *r)
 	mutex_unlock(&r->mutex);
 }
 EXPORT_SYMBOL(fw_iso_resources_free);
+
+/**
+ * fw_iso_resources_abandon - stop managing resources without freeing them
+ * @r: the resource manager
+ *
+ * The channel and bandwidth stay allocated at the IRM for the other users of
+ * the channel, till the next bus reset when nobody reallocates them.
+ */
+void fw_iso_resources_abandon(struct fw_iso_resources *r)
+{
+	mutex_lock(&r->mutex);
+	r->allocated = false;
+	mutex_unlock(&r->mutex);
+}
+EXPORT_SYMBOL(fw_iso_resources_abandon);
@@ -34,5 +34,6 @@ int fw_iso_resources_allocate(struct fw_iso_resources *r,
 			      unsigned int max_payload_bytes, int speed);
 int fw_iso_resources_update(struct fw_iso_resources *r);
 void fw_iso_resources_free(struct fw_iso_resources *r);
+void fw_iso_resources_abandon(struct fw_iso_resources *r);
 
 #endif
@@ -8,10 +8,52 @@
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/firewire.h>
+#include <linux/jiffies.h>
 #include <linux/module.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "lib.h"
 
-#define ERROR_RETRY_DELAY_MS	20
+#define TRANSACTION_RETRIES	5
+#define BACKOFF_BASE_US		2000
+#define BUS_RESET_WAIT_MS	20
+
+/* bounds of the timeout for responses, the lower one is for jitter */
+#define RESPONSE_TIMEOUT_MIN_MS	10
+#define RESPONSE_TIMEOUT_MAX_MS	1000
+/* used until the first response is measured */
+#define RESPONSE_TIMEOUT_INIT_MS	125
+
+/* bus resets within this window are coalesced, up to the maximum */
+#define RECOVERY_DELAY_MS	20
+#define RECOVERY_MAX_DELAY_MS	200
+
+/* devices are identified by GUID, thus the history survives reconnection */
+#define RTT_ENTRIES		32
+
+struct rtt_entry {
+	u64 guid;
+	unsigned long used;	/* jiffies, for replacement */
+	unsigned int srtt;	/* microseconds */
+	unsigned int rttvar;	/* microseconds */
+	unsigned int backoff;	/* kept until the next valid sample */
+};
+
+static struct rtt_entry rtt_entries[RTT_ENTRIES];
+static DEFINE_SPINLOCK(rtt_lock);
+
+static DECLARE_WAIT_QUEUE_HEAD(bus_reset_wait);
+
+/* sleeps exponentially longer for each retry, with random jitter */
+static void backoff(unsigned int tries)
+{
+	unsigned int us = BACKOFF_BASE_US << (tries - 1);
+
+	us += prandom_u32() % us;
+	usleep_range(us, us + us / 4);
+}
 
 /**
  * snd_fw_transaction - send a request and wait for its completion
@@ -26,7 +68,8 @@
  *
  * Submits an asynchronous request to the target device, and waits for the
  * response.  The node ID and the current generation are derived from @unit.
- * On a bus reset or an error, the transaction is retried a few times.
+ * On an error, the transaction is retried a few times with increasing delays.
+ * On a bus reset, it is retried as soon as the new generation is known.
  * Returns zero on success, or a negative error code.
  */
 int snd_fw_transaction(struct fw_unit *unit, int tcode,
@@ -53,7 +96,8 @@ int snd_fw_transaction(struct fw_unit *unit, int tcode,
 		if (rcode == RCODE_GENERATION && (flags & FW_FIXED_GENERATION))
 			return -EAGAIN;
 
-		if (rcode_is_permanent_error(rcode) || ++tries >= 3) {
+		if (rcode_is_permanent_error(rcode) ||
+		    ++tries >= TRANSACTION_RETRIES) {
 			if (!(flags & FW_QUIET))
 				dev_err(&unit->device,
 					"transaction failed: %s\n",
@@ -61,11 +105,229 @@ int snd_fw_transaction(struct fw_unit *unit, int tcode,
 			return -EIO;
 		}
 
-		msleep(ERROR_RETRY_DELAY_MS);
+		if (rcode == RCODE_GENERATION)
+			wait_event_timeout(bus_reset_wait,
+					   device->generation != generation,
+					   msecs_to_jiffies(BUS_RESET_WAIT_MS));
+		else
+			backoff(tries);
 	}
 }
 EXPORT_SYMBOL(snd_fw_transaction);
 
+/**
+ * snd_fw_notify_bus_reset - wake up transactions waiting for a bus reset
+ *
+ * This function should be called from the driver's .update handler. The
+ * transactions which failed due to the old generation are retried at once.
+ */
+void snd_fw_notify_bus_reset(void)
+{
+	wake_up_all(&bus_reset_wait);
+}
+EXPORT_SYMBOL(snd_fw_notify_bus_reset);
+
+static u64 unit_guid(struct fw_unit *unit)
+{
+	struct fw_device *device = fw_parent_device(unit);
+
+	return ((u64)device->config_rom[3] << 32) | device->config_rom[4];
+}
+
+/* call with rtt_lock held */
+static struct rtt_entry *find_rtt_entry(u64 guid, bool create)
+{
+	struct rtt_entry *entry, *oldest = &rtt_entries[0];
+	unsigned int i;
+
+	for (i = 0; i < RTT_ENTRIES; i++) {
+		entry = &rtt_entries[i];
+		if (entry->used != 0 && entry->guid == guid)
+			return entry;
+		if (entry->used == 0 ||
+		    (oldest->used != 0 &&
+		     time_before(entry->used, oldest->used)))
+			oldest = entry;
+	}
+
+	if (!create)
+		return NULL;
+
+	memset(oldest, 0, sizeof(struct rtt_entry));
+	oldest->guid = guid;
+	return oldest;
+}
+
+/**
+ * snd_fw_response_timeout - get the time to wait for a response frame
+ * @unit: the driver's unit on the target device
+ * @min_ms: the time the protocol allows the target to take, or zero
+ *
+ * For protocols in which the target writes a response to the initiator, such
+ * as FCP. The timeout is derived from round trip times measured on the same
+ * device, and doubled for each timeout until a response to a command sent
+ * only once is measured. Returns the timeout in jiffies.
+ */
+unsigned long snd_fw_response_timeout(struct fw_unit *unit,
+				      unsigned int min_ms)
+{
+	struct rtt_entry *entry;
+	unsigned int ms = RESPONSE_TIMEOUT_INIT_MS;
+	unsigned int backoff = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rtt_lock, flags);
+	entry = find_rtt_entry(unit_guid(unit), false);
+	if (entry != NULL) {
+		if (entry->srtt > 0)
+			ms = DIV_ROUND_UP(entry->srtt + 4 * entry->rttvar,
+					  1000);
+		backoff = entry->backoff;
+	}
+	spin_unlock_irqrestore(&rtt_lock, flags);
+
+	min_ms = max_t(unsigned int, min_ms, RESPONSE_TIMEOUT_MIN_MS);
+	ms = clamp_t(unsigned int, ms, min_ms, RESPONSE_TIMEOUT_MAX_MS);
+	ms = min_t(unsigned int, ms << backoff, RESPONSE_TIMEOUT_MAX_MS);
+
+	return msecs_to_jiffies(ms);
+}
+EXPORT_SYMBOL(snd_fw_response_timeout);
+
+/**
+ * snd_fw_response_timed_out - back off the timeout for a response frame
+ * @unit: the driver's unit on the target device
+ *
+ * The doubled timeout is kept for later commands, until
+ * snd_fw_response_received() takes a valid sample, as Karn's algorithm does.
+ */
+void snd_fw_response_timed_out(struct fw_unit *unit)
+{
+	struct rtt_entry *entry;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rtt_lock, flags);
+
+	entry = find_rtt_entry(unit_guid(unit), true);
+	entry->used = jiffies | 1;
+	if (entry->backoff < 8)
+		entry->backoff++;
+
+	spin_unlock_irqrestore(&rtt_lock, flags);
+}
+EXPORT_SYMBOL(snd_fw_response_timed_out);
+
+/**
+ * snd_fw_response_received - measure the round trip time of a response
+ * @unit: the driver's unit on the target device
+ * @sent: the time just before the command was sent
+ *
+ * The caller should skip this for retried commands, because it is ambiguous
+ * which of the commands the response is for.
+ */
+void snd_fw_response_received(struct fw_unit *unit, ktime_t sent)
+{
+	s64 delta = ktime_us_delta(ktime_get(), sent);
+	unsigned int rtt = clamp_t(s64, delta, 1,
+				   RESPONSE_TIMEOUT_MAX_MS * 1000);
+	struct rtt_entry *entry;
+	unsigned long flags;
+	int err;
+
+	spin_lock_irqsave(&rtt_lock, flags);
+
+	entry = find_rtt_entry(unit_guid(unit), true);
+	entry->used = jiffies | 1;
+	entry->backoff = 0;
+
+	/* smoothed as TCP does, in RFC 6298 */
+	if (entry->srtt == 0) {
+		entry->srtt = rtt;
+		entry->rttvar = rtt / 2;
+	} else {
+		err = (int)rtt - (int)entry->srtt;
+		entry->srtt += err / 8;
+		entry->rttvar += ((int)abs(err) - (int)entry->rttvar) / 4;
+	}
+
+	spin_unlock_irqrestore(&rtt_lock, flags);
+}
+EXPORT_SYMBOL(snd_fw_response_received);
+
+static void recovery_work(struct work_struct *work)
+{
+	struct snd_fw_recovery *r =
+		container_of(to_delayed_work(work), struct snd_fw_recovery,
+			     work);
+
+	/* a bus reset from now schedules this again */
+	spin_lock_irq(&r->lock);
+	r->pending = false;
+	spin_unlock_irq(&r->lock);
+
+	r->recover(r->unit);
+}
+
+/**
+ * snd_fw_recovery_init - initialize the deferred recovery
+ * @r: the recovery
+ * @unit: the driver's unit on the target device
+ * @recover: the function to update connections and resources, called in
+ *	     process context
+ */
+void snd_fw_recovery_init(struct snd_fw_recovery *r, struct fw_unit *unit,
+			  void (*recover)(struct fw_unit *unit))
+{
+	INIT_DELAYED_WORK(&r->work, recovery_work);
+	spin_lock_init(&r->lock);
+	r->unit = unit;
+	r->recover = recover;
+	r->pending = false;
+}
+EXPORT_SYMBOL(snd_fw_recovery_init);
+
+/**
+ * snd_fw_recovery_schedule - schedule the recovery after a bus reset
+ * @r: the recovery
+ *
+ * This function should be called from the driver's .update handler. Each call
+ * postpones the recovery a bit, but not more than a limit after the first
+ * reset, because connections should be restored within a second.
+ */
+void snd_fw_recovery_schedule(struct snd_fw_recovery *r)
+{
+	unsigned long now = jiffies;
+	unsigned long delay = msecs_to_jiffies(RECOVERY_DELAY_MS);
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+
+	if (!r->pending) {
+		r->pending = true;
+		r->deadline = now + msecs_to_jiffies(RECOVERY_MAX_DELAY_MS);
+	}
+
+	if (time_after(now + delay, r->deadline))
+		delay = time_after(r->deadline, now) ? r->deadline - now : 0;
+
+	mod_delayed_work(system_unbound_wq, &r->work, delay);
+
+	spin_unlock_irqrestore(&r->lock, flags);
+}
+EXPORT_SYMBOL(snd_fw_recovery_schedule);
+
+/**
+ * snd_fw_recovery_cancel - cancel the recovery and wait for it
+ * @r: the recovery
+ *
+ * Call this in the driver's .remove handler before releasing connections.
+ */
+void snd_fw_recovery_cancel(struct snd_fw_recovery *r)
+{
+	cancel_delayed_work_sync(&r->work);
+}
+EXPORT_SYMBOL(snd_fw_recovery_cancel);
+
 MODULE_DESCRIPTION("FireWire audio helper functions");
 MODULE_AUTHOR("Clemens Ladisch <clemens@ladisch.de>");
 MODULE_LICENSE("GPL v2");
@@ -2,7 +2,10 @@
 #define SOUND_FIREWIRE_LIB_H_INCLUDED
 
 #include <linux/firewire-constants.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 struct fw_unit;
 
@@ -13,6 +16,37 @@ struct fw_unit;
 int snd_fw_transaction(struct fw_unit *unit, int tcode,
 		       u64 offset, void *buffer, size_t length,
 		       unsigned int flags);
+void snd_fw_notify_bus_reset(void);
+
+/* AV/C targets may take this long before sending an INTERIM response */
+#define SND_FW_AVC_RESPONSE_MIN_MS	100
+
+unsigned long snd_fw_response_timeout(struct fw_unit *unit,
+				      unsigned int min_ms);
+void snd_fw_response_timed_out(struct fw_unit *unit);
+void snd_fw_response_received(struct fw_unit *unit, ktime_t sent);
+
+/**
+ * struct snd_fw_recovery - deferred recovery from bus resets
+ *
+ * Bus resets often come in bursts. The recovery runs once in a worker after
+ * the bus has been quiet for a while, against the final generation. Each
+ * device has its own work, thus devices are recovered in parallel.
+ */
+struct snd_fw_recovery {
+	/* private: */
+	struct delayed_work work;
+	struct fw_unit *unit;
+	void (*recover)(struct fw_unit *unit);
+	spinlock_t lock;
+	bool pending;
+	unsigned long deadline;
+};
+
+void snd_fw_recovery_init(struct snd_fw_recovery *r, struct fw_unit *unit,
+			  void (*recover)(struct fw_unit *unit));
+void snd_fw_recovery_schedule(struct snd_fw_recovery *r);
+void snd_fw_recovery_cancel(struct snd_fw_recovery *r);
 
 /* returns true if retrying the transaction would not make sense */
 static inline bool rcode_is_permanent_error(int rcode)
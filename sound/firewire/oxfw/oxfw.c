@@ -24,7 +24,7 @@ module_param_array(enable, bool, NULL, 0444);
 MODULE_PARM_DESC(enable, "enable OXFW970/971 sound card");
 
 static DEFINE_MUTEX(devices_mutex);
-static unsigned int devices_used;
+static DEFINE_IDR(devices_idr);
 
 #define OXFW_FIRMWARE_ID_ADDRESS	(CSR_REGISTER_BASE + 0x50000)
 
@@ -87,39 +87,56 @@ oxfw_card_free(struct snd_card *card)
 
 	if (oxfw->card_index >= 0) {
 		mutex_lock(&devices_mutex);
-		devices_used &= ~BIT(oxfw->card_index);
+		idr_remove(&devices_idr, oxfw->card_index);
 		mutex_unlock(&devices_mutex);
 	}
 
 	mutex_destroy(&oxfw->mutex);
+	mutex_destroy(&oxfw->avc_mutex);
 
 	return;
 }
 
+/* called in a worker after bus resets settle */
+static void
+oxfw_recover(struct fw_unit *unit)
+{
+	struct snd_oxfw *oxfw = dev_get_drvdata(&unit->device);
+
+	if (oxfw == NULL)
+		return;
+
+	snd_oxfw_stream_update_duplex(oxfw);
+}
+
 static int
 oxfw_probe(struct fw_unit *unit,
 	    const struct ieee1394_device_id *entry)
 {
 	struct snd_card *card;
 	struct snd_oxfw *oxfw;
-	unsigned int card_index;
-	int err;
+	int card_index, err;
 
 	mutex_lock(&devices_mutex);
 
-	for (card_index = 0; card_index < SNDRV_CARDS; card_index++) {
-		if (!(devices_used & BIT(card_index)) && enable[card_index])
-			break;
-	}
-	if (card_index >= SNDRV_CARDS) {
-		err = -ENOENT;
+	/* disabled indexes are reserved at module init */
+	card_index = idr_alloc(&devices_idr, NULL, 0, 0, GFP_KERNEL);
+	if (card_index < 0) {
+		err = card_index;
 		goto end;
 	}
 
-	err = snd_card_create(index[card_index], id[card_index],
-			      THIS_MODULE, sizeof(struct snd_oxfw), &card);
-	if (err < 0)
+	/* the module parameters are for the first SNDRV_CARDS devices */
+	if (card_index < SNDRV_CARDS)
+		err = snd_card_create(index[card_index], id[card_index],
+				THIS_MODULE, sizeof(struct snd_oxfw), &card);
+	else
+		err = snd_card_create(SNDRV_DEFAULT_IDX1, SNDRV_DEFAULT_STR1,
+				THIS_MODULE, sizeof(struct snd_oxfw), &card);
+	if (err < 0) {
+		idr_remove(&devices_idr, card_index);
 		goto end;
+	}
 	card->private_free = oxfw_card_free;
 
 	oxfw = card->private_data;
@@ -128,8 +145,12 @@ oxfw_probe(struct fw_unit *unit,
 	oxfw->unit = unit;
 	oxfw->card_index = -1;
 	mutex_init(&oxfw->mutex);
+	mutex_init(&oxfw->avc_mutex);
 	spin_lock_init(&oxfw->lock);
+	amdtp_duplex_init(&oxfw->duplex, &oxfw->tx_stream, &oxfw->rx_stream,
+			  &oxfw->mutex);
 	init_waitqueue_head(&oxfw->hwdep_wait);
+	snd_fw_recovery_init(&oxfw->recovery, unit, oxfw_recover);
 
 	err = name_device(oxfw, entry->vendor_id);
 	if (err < 0)
@@ -167,13 +188,14 @@ oxfw_probe(struct fw_unit *unit,
 		goto error;
 	}
 	dev_set_drvdata(&unit->device, oxfw);
-	devices_used |= BIT(card_index);
+	idr_replace(&devices_idr, oxfw, card_index);
 	oxfw->card_index = card_index;
 end:
 	mutex_unlock(&devices_mutex);
 	return err;
 error:
 	snd_card_free(card);
+	idr_remove(&devices_idr, card_index);
 	mutex_unlock(&devices_mutex);
 	return err;
 }
@@ -184,7 +206,7 @@ oxfw_update(struct fw_unit *unit)
 	struct snd_oxfw *oxfw = dev_get_drvdata(&unit->device);
 
 	fcp_bus_reset(oxfw->unit);
-	snd_oxfw_stream_update_duplex(oxfw);
+	snd_fw_recovery_schedule(&oxfw->recovery);
 }
 
 static void
@@ -192,6 +214,7 @@ oxfw_remove(struct fw_unit *unit)
 {
 	struct snd_oxfw *oxfw = dev_get_drvdata(&unit->device);
 
+	snd_fw_recovery_cancel(&oxfw->recovery);
 	snd_oxfw_stream_destroy_duplex(oxfw);
 	snd_card_disconnect(oxfw->card);
 	snd_card_free_when_closed(oxfw->card);
@@ -235,13 +258,33 @@ static struct fw_driver oxfw_driver = {
 static int __init
 snd_oxfw_init(void)
 {
-	return driver_register(&oxfw_driver.driver);
+	unsigned int i;
+	int err;
+
+	/* never assign the indexes disabled by the module parameter */
+	for (i = 0; i < SNDRV_CARDS; i++) {
+		if (enable[i])
+			continue;
+		err = idr_alloc(&devices_idr, NULL, i, i + 1, GFP_KERNEL);
+		if (err < 0)
+			goto error;
+	}
+
+	err = driver_register(&oxfw_driver.driver);
+	if (err < 0)
+		goto error;
+
+	return 0;
+error:
+	idr_destroy(&devices_idr);
+	return err;
 }
 
 static void __exit
 snd_oxfw_exit(void)
 {
 	driver_unregister(&oxfw_driver.driver);
+	idr_destroy(&devices_idr);
 	mutex_destroy(&devices_mutex);
 }
 
@@ -17,6 +17,8 @@
 #include <linux/mod_devicetable.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/seqlock.h>
+#include <linux/idr.h>
 
 /* TODO: when mering to upstream, this path should be changed. */
 #include "../../../include/uapi/sound/asound.h"
@@ -45,6 +47,8 @@ struct snd_oxfw_stream_formation {
 /* this is a lookup table for index of stream formations */
 extern const unsigned int snd_oxfw_rate_table[SND_OXFW_RATE_TABLE_ENTRIES];
 
+#define SND_OXFW_AVC_RESP_SIZE	8192
+
 struct snd_oxfw {
 	struct snd_card *card;
 	struct fw_device *device;
@@ -54,6 +58,8 @@ struct snd_oxfw {
 	struct mutex mutex;
 	spinlock_t lock;
 
+	struct snd_fw_recovery recovery;
+
 	struct snd_oxfw_stream_formation
 		tx_stream_formations[SND_OXFW_RATE_TABLE_ENTRIES];
 	struct snd_oxfw_stream_formation
@@ -67,10 +73,19 @@ struct snd_oxfw {
 	struct cmp_connection in_conn;
 	struct amdtp_stream rx_stream;
 
+	/* updated under mutex, read locklessly */
+	struct amdtp_duplex duplex;
+
 	/* for uapi */
 	int dev_lock_count;
 	bool dev_lock_changed;
 	wait_queue_head_t hwdep_wait;
+
+	/* serializes batches of AV/C commands, apart from streaming */
+	struct mutex avc_mutex;
+	/* AV/C responses to hwdep, as struct snd_firewire_avc_frame */
+	u8 avc_resp[SND_OXFW_AVC_RESP_SIZE];
+	unsigned int avc_resp_len;
 };
 
 /* AV/C Stream Format Information Specification 1.1 (Apr 2005, 1394TA) */
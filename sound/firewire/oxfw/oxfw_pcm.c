@@ -180,7 +180,7 @@ pcm_init_hw_params(struct snd_oxfw *oxfw,
 			      oxfw->tx_stream_formations);
 		prepare_channels(&substream->runtime->hw,
 				 oxfw->tx_stream_formations);
-		substream->runtime->hw.formats = SNDRV_PCM_FMTBIT_S32_LE;
+		substream->runtime->hw.formats = AMDTP_IN_PCM_FORMAT_BITS;
 		snd_pcm_hw_rule_add(substream->runtime, 0,
 				SNDRV_PCM_HW_PARAM_CHANNELS,
 				hw_rule_capture_channels, oxfw,
@@ -233,7 +233,7 @@ static int
 pcm_open(struct snd_pcm_substream *substream)
 {
 	struct snd_oxfw *oxfw = substream->private_data;
-	unsigned int sampling_rate;
+	struct amdtp_duplex_status status;
 //	bool internal;
 	int err;
 
@@ -259,12 +259,10 @@ pcm_open(struct snd_pcm_substream *substream)
 	if (
 	    amdtp_stream_pcm_running(&oxfw->tx_stream) ||
 	    amdtp_stream_pcm_running(&oxfw->rx_stream)) {
-		err = snd_oxfw_stream_get_rate(oxfw, &sampling_rate);
-		if (err < 0)
-			goto err_locked;
-
-		substream->runtime->hw.rate_min = sampling_rate;
-		substream->runtime->hw.rate_max = sampling_rate;
+		/* streams keep the rate published at starting */
+		amdtp_duplex_read_status(&oxfw->duplex, &status);
+		substream->runtime->hw.rate_min = status.rate;
+		substream->runtime->hw.rate_max = status.rate;
 	}
 
 	snd_pcm_set_sync(substream);
@@ -287,8 +285,16 @@ static int
 pcm_hw_params(struct snd_pcm_substream *substream,
 	      struct snd_pcm_hw_params *hw_params)
 {
-	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
-						params_buffer_bytes(hw_params));
+	struct snd_oxfw *oxfw = substream->private_data;
+	struct amdtp_stream *stream;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		stream = &oxfw->tx_stream;
+	else
+		stream = &oxfw->rx_stream;
+
+	return amdtp_stream_alloc_pcm_buffer(stream, substream,
+					     params_buffer_bytes(hw_params));
 }
 
 static int
@@ -425,6 +431,12 @@ int snd_oxfw_create_pcm_devices(struct snd_oxfw *oxfw)
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_playback_ops);
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_capture_ops);
 
+	err = amdtp_stream_add_meter_ctl(&oxfw->tx_stream, oxfw->card,
+					 "PCM Capture Meter");
+	if (err < 0)
+		goto end;
+	err = amdtp_stream_add_meter_ctl(&oxfw->rx_stream, oxfw->card,
+					 "PCM Playback Meter");
 end:
 	return err;
 }
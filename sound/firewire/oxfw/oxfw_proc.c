@@ -42,12 +42,21 @@ proc_read_clock(struct snd_info_entry *entry,
 		struct snd_info_buffer *buffer)
 {
 	struct snd_oxfw *oxfw = entry->private_data;
+	struct amdtp_duplex_status status;
 	unsigned int rate;
 	bool internal;
 
-	if (snd_oxfw_stream_get_rate(oxfw, &rate) < 0)
+	/* the rate is fixed during streaming, thus no need to ask the device */
+	amdtp_duplex_read_status(&oxfw->duplex, &status);
+	if (status.tx_running || status.rx_running)
+		rate = status.rate;
+	else if (snd_oxfw_stream_get_rate(oxfw, &rate) < 0)
 		return;
 	snd_iprintf(buffer, "Sampling rate: %d\n", rate);
+	snd_iprintf(buffer, "Streaming: %s/%s (tx/rx)%s\n",
+		    (status.tx_running) ? "running" : "stopped",
+		    (status.rx_running) ? "running" : "stopped",
+		    (status.starting) ? ", starting" : "");
 
 /*
 	if (snd_oxfw_stream_check_internal_clock(oxfw, &internal) < 0)
@@ -58,6 +67,18 @@ proc_read_clock(struct snd_info_entry *entry,
 */
 }
 
+static void
+proc_read_stream(struct snd_info_entry *entry,
+		 struct snd_info_buffer *buffer)
+{
+	struct snd_oxfw *oxfw = entry->private_data;
+
+	snd_iprintf(buffer, "Output Stream from device:\n");
+	amdtp_stream_proc_read(&oxfw->tx_stream, buffer);
+	snd_iprintf(buffer, "Input Stream to device:\n");
+	amdtp_stream_proc_read(&oxfw->rx_stream, buffer);
+}
+
 void snd_oxfw_proc_init(struct snd_oxfw *oxfw)
 {
 	struct snd_info_entry *entry;
@@ -68,5 +89,8 @@ void snd_oxfw_proc_init(struct snd_oxfw *oxfw)
 	if (!snd_card_proc_new(oxfw->card, "#clock", &entry))
 		snd_info_set_text_ops(entry, oxfw, proc_read_clock);
 
+	if (!snd_card_proc_new(oxfw->card, "#stream", &entry))
+		snd_info_set_text_ops(entry, oxfw, proc_read_stream);
+
 	return;
 }
@@ -151,59 +151,97 @@ stop_stream(struct snd_oxfw *oxfw, struct amdtp_stream *stream)
 }
 
 static int
-start_stream(struct snd_oxfw *oxfw, struct amdtp_stream *stream,
-	     unsigned int sampling_rate)
+set_stream_params(struct snd_oxfw *oxfw, struct amdtp_stream *stream,
+		  unsigned int sampling_rate)
 {
-	struct cmp_connection *conn;
 	unsigned int i, pcm_channels, midi_ports;
-	int err;
-
-	/* already running */
-	if (amdtp_stream_running(stream)) {
-		err = 0;
-		goto end;
-	}
 
 	for (i = 0; i < sizeof(snd_oxfw_rate_table); i++) {
 		if (snd_oxfw_rate_table[i] == sampling_rate)
 			break;
 	}
-	if (i == sizeof(snd_oxfw_rate_table)) {
-		err = -EINVAL;
-		goto end;
-	}
+	if (i == sizeof(snd_oxfw_rate_table))
+		return -EINVAL;
 
 	/* set stream formation */
 	if (stream == &oxfw->tx_stream) {
-		conn = &oxfw->out_conn;
 		pcm_channels = oxfw->tx_stream_formations[i].pcm;
 		midi_ports = oxfw->tx_stream_formations[i].midi * 8;
 	} else {
-		conn = &oxfw->in_conn;
 		pcm_channels = oxfw->rx_stream_formations[i].pcm;
 		midi_ports = oxfw->rx_stream_formations[i].midi * 8;
 	}
 	amdtp_stream_set_parameters(stream, sampling_rate,
 				    pcm_channels, midi_ports);
 
+	return 0;
+}
+
+static int
+make_connection(struct snd_oxfw *oxfw, struct amdtp_stream *stream,
+		unsigned int sampling_rate)
+{
+	struct cmp_connection *conn;
+	int err;
+
+	err = set_stream_params(oxfw, stream, sampling_rate);
+	if (err < 0)
+		return err;
+
+	if (stream == &oxfw->tx_stream)
+		conn = &oxfw->out_conn;
+	else
+		conn = &oxfw->in_conn;
+
 	/*  establish connection via CMP */
-	err = cmp_connection_establish(conn,
+	return cmp_connection_establish(conn,
 				amdtp_stream_get_max_payload(stream));
+}
+
+/* the IRM and the device handle requests for both directions in parallel */
+static int
+make_both_connections(struct snd_oxfw *oxfw, unsigned int sampling_rate)
+{
+	int err;
+
+	err = set_stream_params(oxfw, &oxfw->tx_stream, sampling_rate);
 	if (err < 0)
-		goto end;
+		return err;
+	err = set_stream_params(oxfw, &oxfw->rx_stream, sampling_rate);
+	if (err < 0)
+		return err;
+
+	return cmp_connection_establish_pair(&oxfw->out_conn,
+			amdtp_stream_get_max_payload(&oxfw->tx_stream),
+			&oxfw->in_conn,
+			amdtp_stream_get_max_payload(&oxfw->rx_stream));
+}
+
+/* Call after the connection for the stream is established. */
+static int
+start_stream(struct snd_oxfw *oxfw, struct amdtp_stream *stream)
+{
+	struct cmp_connection *conn;
+	int err;
+
+	if (stream == &oxfw->tx_stream)
+		conn = &oxfw->out_conn;
+	else
+		conn = &oxfw->in_conn;
 
 	/* start amdtp stream */
 	err = amdtp_stream_start(stream,
 				 conn->resources.channel,
 				 conn->speed);
-	if (err < 0)
+	if (err < 0) {
 		stop_stream(oxfw, stream);
+		goto end;
+	}
 
 	/* wait first callback */
-	if (!amdtp_stream_wait_callback(stream)) {
+	err = amdtp_duplex_wait_callback(&oxfw->duplex, stream);
+	if (err < 0)
 		stop_stream(oxfw, stream);
-		err = -ETIMEDOUT;
-	}
 end:
 	return err;
 }
@@ -222,6 +260,7 @@ update_stream(struct snd_oxfw *oxfw, struct amdtp_stream *stream)
 		amdtp_stream_pcm_abort(stream);
 		mutex_lock(&oxfw->mutex);
 		stop_stream(oxfw, stream);
+		amdtp_duplex_publish(&oxfw->duplex, 0);
 		mutex_unlock(&oxfw->mutex);
 		return;
 	}
@@ -271,10 +310,10 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 	struct amdtp_stream *master, *slave;
 	enum cip_flags sync_mode;
 	unsigned int curr_rate;
-	bool slave_flag, used;
+	bool slave_flag, used, shared, slave_connected = false;
 	int err;
 
-	mutex_lock(&oxfw->mutex);
+	amdtp_duplex_lock(&oxfw->duplex);
 
 	err = get_roles(oxfw, &sync_mode, &master, &slave);
 	if (err < 0)
@@ -285,6 +324,19 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 	else
 		slave_flag = false;
 
+	/* the streams keep running after XRUN, thus just attach PCM again */
+	if (amdtp_stream_pcm_reattachable(request, rate) &&
+	    !amdtp_streaming_error(master))
+		goto end;
+
+	/* the packet queue has stopped, thus restart the streams */
+	if (amdtp_streaming_error(slave))
+		stop_stream(oxfw, slave);
+	if (amdtp_streaming_error(master)) {
+		stop_stream(oxfw, slave);
+		stop_stream(oxfw, master);
+	}
+
 	/*
 	 * Considering JACK/FFADO streaming:
 	 * TODO: This can be removed hwdep functionality becomes popular.
@@ -300,6 +352,11 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 		goto end;
 	}
 
+	/* others receive the stream of the device at current rate */
+	err = cmp_connection_check_shared(&oxfw->out_conn, &shared);
+	if (err < 0)
+		goto end;
+
 	/* get current rate */
 	err = snd_oxfw_stream_get_rate(oxfw, &curr_rate);
 	if (err < 0)
@@ -309,6 +366,14 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 
 	/* change sampling rate if needed */
 	if (rate != curr_rate) {
+		if (shared) {
+			dev_err(&oxfw->unit->device,
+				"sampling rate is fixed by others: %d\n",
+				curr_rate);
+			err = -EBUSY;
+			goto end;
+		}
+
 		/* slave is just for MIDI stream */
 		if (amdtp_stream_running(slave) &&
 		    !amdtp_stream_pcm_running(slave))
@@ -326,8 +391,17 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 
 	/* master should be always running */
 	if (!amdtp_stream_running(master)) {
-		err = start_stream(oxfw, master, rate);
+		if (slave_flag && !amdtp_stream_running(slave)) {
+			err = make_both_connections(oxfw, rate);
+			slave_connected = true;
+		} else {
+			err = make_connection(oxfw, master, rate);
+		}
+		if (err >= 0)
+			err = start_stream(oxfw, master);
 		if (err < 0) {
+			if (slave_connected)
+				stop_stream(oxfw, slave);
 			dev_err(&oxfw->unit->device,
 				"fail to run AMDTP master stream:%d\n", err);
 			goto end;
@@ -336,12 +410,16 @@ int snd_oxfw_stream_start_duplex(struct snd_oxfw *oxfw,
 
 	/* start slave if needed */
 	if (slave_flag && !amdtp_stream_running(slave)) {
-		err = start_stream(oxfw, slave, rate);
+		if (!slave_connected)
+			err = make_connection(oxfw, slave, rate);
+		if (err >= 0)
+			err = start_stream(oxfw, slave);
 		if (err < 0)
 			dev_err(&oxfw->unit->device,
 				"fail to run AMDTP slave stream:%d\n", err);
 	}
 end:
+	amdtp_duplex_publish(&oxfw->duplex, (err < 0) ? 0 : rate);
 	mutex_unlock(&oxfw->mutex);
 	return err;
 }
@@ -358,6 +436,10 @@ int snd_oxfw_stream_stop_duplex(struct snd_oxfw *oxfw)
 	if (err < 0)
 		goto end;
 
+	/* the starting thread stops them by itself when failing */
+	if (amdtp_duplex_starting(&oxfw->duplex))
+		goto end;
+
 	if (amdtp_stream_pcm_running(slave) ||
 	    amdtp_stream_midi_running(slave))
 		goto end;
@@ -370,23 +452,21 @@ int snd_oxfw_stream_stop_duplex(struct snd_oxfw *oxfw)
 
 	stop_stream(oxfw, master);
 end:
+	amdtp_duplex_publish(&oxfw->duplex, 0);
 	mutex_unlock(&oxfw->mutex);
 	return err;
 }
 
 void snd_oxfw_stream_update_duplex(struct snd_oxfw *oxfw)
 {
-	mutex_lock(&oxfw->mutex);
-
+	/* the mutex is held only when stopping streams */
 	update_stream(oxfw, &oxfw->rx_stream);
 	update_stream(oxfw, &oxfw->tx_stream);
-
-	mutex_unlock(&oxfw->mutex);
 }
 
 void snd_oxfw_stream_destroy_duplex(struct snd_oxfw *oxfw)
 {
-	mutex_lock(&oxfw->mutex);
+	amdtp_duplex_lock(&oxfw->duplex);
 
 	if (amdtp_stream_pcm_running(&oxfw->rx_stream))
 		amdtp_stream_pcm_abort(&oxfw->rx_stream);
@@ -396,6 +476,7 @@ void snd_oxfw_stream_destroy_duplex(struct snd_oxfw *oxfw)
 	destroy_stream(oxfw, &oxfw->rx_stream);
 	destroy_stream(oxfw, &oxfw->tx_stream);
 
+	amdtp_duplex_publish(&oxfw->duplex, 0);
 	mutex_unlock(&oxfw->mutex);
 }
 
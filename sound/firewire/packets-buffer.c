@@ -5,6 +5,7 @@
  * Licensed under the terms of the GNU General Public License, version 2.
  */
 
+#include <linux/device.h>
 #include <linux/firewire.h>
 #include <linux/export.h>
 #include <linux/slab.h>
@@ -22,12 +23,15 @@ int iso_packets_buffer_init(struct iso_packets_buffer *b, struct fw_unit *unit,
 			    unsigned int count, unsigned int packet_size,
 			    enum dma_data_direction direction)
 {
+	struct fw_card *card = fw_parent_device(unit)->card;
 	unsigned int packets_per_page, pages;
 	unsigned int i, page_index, offset_in_page;
 	void *p;
 	int err;
 
-	b->packets = kmalloc(count * sizeof(*b->packets), GFP_KERNEL);
+	/* the array is accessed in callbacks of the controller */
+	b->packets = kmalloc_node(count * sizeof(*b->packets), GFP_KERNEL,
+				  dev_to_node(card->device));
 	if (!b->packets) {
 		err = -ENOMEM;
 		goto error;
@@ -41,8 +45,7 @@ int iso_packets_buffer_init(struct iso_packets_buffer *b, struct fw_unit *unit,
 	}
 	pages = DIV_ROUND_UP(count, packets_per_page);
 
-	err = fw_iso_buffer_init(&b->iso_buffer, fw_parent_device(unit)->card,
-				 pages, direction);
+	err = fw_iso_buffer_init(&b->iso_buffer, card, pages, direction);
 	if (err < 0)
 		goto err_packets;
 